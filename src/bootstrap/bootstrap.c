@@ -109,8 +109,8 @@ static void ClassCommand(void);
 
 
 //static void objectWrite(FILE * fp, struct object *obj);
-static struct object *symbolTreeInsert(struct object *base,
-                                       struct object *symNode);
+static struct object *symbolTreeBuild(struct object **syms, int low,
+                                      int high);
 static struct object *fixSymbols(void);
 static void fixGlobals(void);
 static void checkGlobals(void);
@@ -213,6 +213,23 @@ int main(int argc, char **argv)
             i++;
 
             info("Output file: \"%s\"\n", output_file);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            if(i + 1 >= argc) {
+                info("You need to provide an image version if you use the -f option.\n");
+                usage();
+            }
+
+            imageWriteVersion = atoi(argv[i+1]);
+            i++;
+
+            if(imageWriteVersion != IMAGE_VERSION_3 && imageWriteVersion != IMAGE_VERSION_4) {
+                error("Unsupported output image version %d!", imageWriteVersion);
+            }
+
+            info("Output image version: %d\n", imageWriteVersion);
+        } else if (strcmp(argv[i], "-z") == 0) {
+            imageCompressed = 1;
+            info("Compressing output image.\n");
         } else {
             image_source = argv[i];
             info("Input file: \"%s\"\n", image_source);
@@ -314,9 +331,11 @@ int main(int argc, char **argv)
 void usage(void)
 {
     printf(
-        "Usage: bootstrap [-v] [-g] [-o outputfile] [inputfile]\n"
+        "Usage: bootstrap [-v] [-g] [-f version] [-z] [-o outputfile] [inputfile]\n"
         "\t-v\tPrint out the Little Smalltalk version.\n"
         "\t-g\tEnable debugging output.  Warning, this is verbose!\n"
+        "\t-f version\tWrite image version 3 (portable) or 4 (fast loading, native word size). Default 4.\n"
+        "\t-z\tCompress the output image.\n"
         "\t-o outputfile\tSpecify the output file to use for the final binary image. Default \"lst.img\".\n"
         "\tinputfile\tSpecify the source input file.  Must be valid Little Smalltalk code.  Default \"lst.st\".\n"
         "All arguments are optional.\n"
@@ -697,8 +716,9 @@ int readInteger()
 /*	new instances of standard things                             */
 /* ------------------------------------------------------------- */
 
+#define SYMBOL_LIMIT (5000)
 static int symbolTop = 0;
-static struct object *oldSymbols[5000];
+static struct object *oldSymbols[SYMBOL_LIMIT];
 
 int symbolBareCmp(const uint8_t *left, int leftsize, const uint8_t *right, int rightsize)
 {
@@ -751,6 +771,9 @@ struct object *newSymbol(char *text)
     }
 
     /* not there, make a new one */
+    if (symbolTop >= SYMBOL_LIMIT) {
+        error("newSymbol(): too many symbols (max %d) to add #%s!", SYMBOL_LIMIT, text);
+    }
     result = binaryAlloc((int)strlen(text));
     for (i = 0; i < (int)strlen(text); i++) {
         result->bytes[i] = (uint8_t)text[i];
@@ -774,11 +797,12 @@ struct object *newNode(struct object *v, struct object *l, struct object *r)
 {
     struct object *result;
 
-    result = gcalloc(3);
+    result = gcalloc(4);
     result->class = lookupGlobalName("Node", 0);
-    result->data[0] = v;
-    result->data[1] = l;
-    result->data[2] = r;
+    result->data[valueInNode] = v;
+    result->data[leftInNode] = l;
+    result->data[rightInNode] = r;
+    result->data[heightInNode] = newInteger(1);
     return result;
 }
 
@@ -2282,30 +2306,57 @@ void ClassCommand(void)
 /*	fix up symbol tables                                         */
 /* ------------------------------------------------------------- */
 
-struct object *symbolTreeInsert(struct object *base, struct object *symNode)
+static int symbolSortCmp(const void *left, const void *right)
+{
+    return symbolCmp(*(struct object * const *)left,
+                     *(struct object * const *)right);
+}
+
+static int nodeHeight(struct object *node)
 {
-    if (base == nilObject)
-        return symNode;
-    if (symbolCmp(symNode->data[valueInNode], base->data[valueInNode]) < 0)
-        base->data[leftInNode] =
-            symbolTreeInsert(base->data[leftInNode], symNode);
+    if (node == nilObject)
+        return 0;
+    return integerValue(node->data[heightInNode]);
+}
+
+/*
+ * build a height-balanced tree from the sorted symbols syms[low..high-1],
+ * filling in the heights the image's AVL Tree code expects.
+ */
+struct object *symbolTreeBuild(struct object **syms, int low, int high)
+{
+    struct object *node, *left, *right;
+    int mid;
+
+    if (low >= high)
+        return nilObject;
+    mid = low + (high - low) / 2;
+    left = symbolTreeBuild(syms, low, mid);
+    right = symbolTreeBuild(syms, mid + 1, high);
+    node = newNode(syms[mid], left, right);
+    if (nodeHeight(left) > nodeHeight(right))
+        node->data[heightInNode] = newInteger(nodeHeight(left) + 1);
     else
-        base->data[rightInNode] =
-            symbolTreeInsert(base->data[rightInNode], symNode);
-    return base;
+        node->data[heightInNode] = newInteger(nodeHeight(right) + 1);
+    return node;
 }
 
 
 static struct object *fixSymbols(void)
 {
     struct object *t;
-    int i;
+    struct object **sorted;
+
+    sorted = malloc(sizeof(struct object *) * (size_t)(symbolTop ? symbolTop : 1));
+    if (!sorted) {
+        error("fixSymbols(): not enough memory to sort %d symbols!", symbolTop);
+    }
+    memcpy(sorted, oldSymbols, sizeof(struct object *) * (size_t)symbolTop);
+    qsort(sorted, (size_t)symbolTop, sizeof(struct object *), symbolSortCmp);
 
     t = newTree();
-    for (i = 0; i < symbolTop; i++)
-        t->data[0] = symbolTreeInsert(t->data[0],
-                                      newNode(oldSymbols[i], nilObject,
-                                              nilObject));
+    t->data[rootInTree] = symbolTreeBuild(sorted, 0, symbolTop);
+    free(sorted);
     return t;
 }
 
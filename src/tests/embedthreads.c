@@ -0,0 +1,149 @@
+/*
+ * embedthreads.c
+ *	Embed liblst in two threads at once
+ *
+ * Each thread opens a VM of its own on the same image, runs Smalltalk
+ * in it while the other does too, and closes it again.  Then a bad
+ * image has to make lstOpen() fail rather than end the program, as do a
+ * second lstOpen() on a thread with a VM and the misuse of its root stack.
+ *
+ * usage: embedthreads lst_repl.img
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "lst.h"
+
+# define Threads 2
+# define Rounds 20
+
+
+struct run {
+    const char *image;
+    int base;
+    int failed;
+};
+
+
+static void *runVM(void *arg)
+{
+    struct run *run = arg;
+    struct object *result;
+    char source[256];
+    char name[32];
+    int i;
+
+    if (lstOpen(run->image, 0, 0) != 0) {
+        run->failed = 1;
+        return NULL;
+    }
+
+    for (i = 0; i < Rounds && !run->failed; i++) {
+        snprintf(name, sizeof(name), "vm%d", run->base + i);
+        snprintf(source, sizeof(source),
+                 "((1 to: 2000) collect: [:x | x + %d ]) size + (Symbol new: '%s') printString size",
+                 run->base + i, name);
+        result = lstEval(source);
+
+        if (!lstIsInteger(result) || lstIntegerValue(result) != 2000 + (int64_t)strlen(name)) {
+            run->failed = 1;
+        }
+    }
+
+    lstClose();
+
+    return NULL;
+}
+
+
+/* write size bytes of junk, or of the start of from, to a file of its own. */
+static int badImage(char *path, const char *from, size_t size)
+{
+    char buffer[4096];
+    FILE *in, *out;
+    size_t count = 0;
+    int fd;
+
+    if ((fd = mkstemp(path)) == -1 || !(out = fdopen(fd, "wb"))) {
+        return -1;
+    }
+
+    if (from && (in = fopen(from, "rb"))) {
+        count = fread(buffer, 1, size < sizeof(buffer) ? size : sizeof(buffer), in);
+        fclose(in);
+    }
+
+    memset(buffer + count, 0x5a, sizeof(buffer) - count);
+    fwrite(buffer, 1, size < sizeof(buffer) ? size : sizeof(buffer), out);
+    fclose(out);
+
+    return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    struct run runs[Threads];
+    pthread_t threads[Threads];
+    char junk[] = "/tmp/lstjunkXXXXXX";
+    char cut[] = "/tmp/lstcutXXXXXX";
+    int i, failed = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s image\n", argv[0]);
+        return 2;
+    }
+
+    for (i = 0; i < Threads; i++) {
+        runs[i].image = argv[1];
+        runs[i].base = i * 10;
+        runs[i].failed = 0;
+        pthread_create(&threads[i], NULL, runVM, &runs[i]);
+    }
+
+    for (i = 0; i < Threads; i++) {
+        pthread_join(threads[i], NULL);
+        if (runs[i].failed) {
+            fprintf(stderr, "the VM of thread %d went wrong\n", i);
+            failed = 1;
+        }
+    }
+
+    /* neither junk nor an image cut short may end the program */
+    if (badImage(junk, NULL, 256) == -1 || badImage(cut, argv[1], 4096) == -1) {
+        fprintf(stderr, "cannot write the bad images\n");
+        return 1;
+    }
+
+    if (lstOpen(junk, 0, 0) != -1 || lstOpen(cut, 0, 0) != -1) {
+        fprintf(stderr, "a bad image was read\n");
+        failed = 1;
+    }
+
+    unlink(junk);
+    unlink(cut);
+
+    /* and the thread can still open a good one afterwards */
+    if (lstOpen(argv[1], 0, 0) != 0 || !lstIsInteger(lstEval("3 + 4"))) {
+        fprintf(stderr, "the image can not be read after a bad one\n");
+        failed = 1;
+    }
+
+    /* but not a second one over it, which leaves the first one working */
+    if (lstOpen(argv[1], 0, 0) != -1 || lstIntegerValue(lstEval("3 + 4")) != 7) {
+        fprintf(stderr, "a second VM was opened on the thread\n");
+        failed = 1;
+    }
+
+    /* popping an empty root stack fails rather than ending the program */
+    if (lstPushRoot(lstNil()) != 0 || !lstIsNil(lstPopRoot()) || lstPopRoot() != NULL) {
+        fprintf(stderr, "the root stack went wrong\n");
+        failed = 1;
+    }
+    lstClose();
+
+    return failed;
+}
@@ -0,0 +1,59 @@
+/*
+ * isolatesymbols.c
+ *	Send Symbols made after the image was read between isolates
+ *
+ * A Symbol arrives in another isolate as a copy.  It has to come out
+ * identical to the receiver's Symbol by that name, whether the receiver
+ * made one first or only makes it after the message came in.
+ *
+ * usage: isolatesymbols lst_repl.img
+ */
+
+#include <stdio.h>
+#include "lst.h"
+
+
+/* each doIt is one statement, answering true if the Symbols came through */
+static const char *checks[] = {
+    /* a Symbol the receiver has never seen */
+    "[ Isolate spawn: '(Isolate id: 0) send: (Symbol new: ''zzFresh'')'. "
+    "Isolate receive == (Symbol new: 'zzFresh') ] value",
+
+    /* one the receiver made too, twice in the same message */
+    "[ Symbol new: 'qqBoth'. "
+    "Isolate spawn: '[:a | a at: 1 put: (Symbol new: ''qqBoth''). "
+    "a at: 2 put: (Symbol new: ''qqBoth''). (Isolate id: 0) send: a ] value: (Array new: 2)'. "
+    "[:a | ((a at: 1) == (Symbol new: 'qqBoth')) and: [ (a at: 2) == (a at: 1) ] ] value: Isolate receive ] value",
+
+    /* one from the image */
+    "[ Isolate spawn: '(Isolate id: 0) send: #size'. "
+    "Isolate receive == #size ] value",
+};
+
+
+int main(int argc, char **argv)
+{
+    size_t i;
+    int failed = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s image\n", argv[0]);
+        return 2;
+    }
+
+    if (lstOpen(argv[1], 0, 0) != 0) {
+        fprintf(stderr, "cannot read %s\n", argv[1]);
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        if (!lstIsTrue(lstEval(checks[i]))) {
+            fprintf(stderr, "not identical: %s\n", checks[i]);
+            failed = 1;
+        }
+    }
+
+    lstClose();
+
+    return failed;
+}
@@ -0,0 +1,72 @@
+/*
+ * orderedcollection.c
+ *	Grow and shrink an OrderedCollection at both ends
+ *
+ * Each doIt is printed and has to print as the transcript says.  The
+ * collection they work on is the global Ordered, so each one goes on
+ * from where the one before left it.  collect:, select: and break:
+ * answer OrderedCollections.
+ *
+ * usage: orderedcollection lst_repl.img
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "lst.h"
+
+
+struct step {
+    const char *source;
+    const char *expected;
+};
+
+static const struct step transcript[] = {
+    { "[:c | 1 to: 20 do: [:i | c addLast: i. c addFirst: 0 - i ]. "
+      "Smalltalk at: #Ordered put: c. c size ] value: OrderedCollection new", "40" },
+    { "Ordered first", "-20" },
+    { "Ordered last", "20" },
+    { "Ordered at: 21", "1" },
+    { "[ Ordered at: 21 put: 100. Ordered at: 21 ] value", "100" },
+    { "Ordered removeFirst", "-20" },
+    { "Ordered removeLast", "20" },
+    { "[:s | s at: 1 put: 0. Ordered do: [:x | s at: 1 put: (s at: 1) + x ]. s at: 1 ] value: (Array new: 1)", "99" },
+    { "(Ordered collect: [:x | x * 2 ]) class", "OrderedCollection" },
+    { "(Ordered select: [:x | x > 0 ]) size", "19" },
+    { "('to be or not' break: ' ') class", "OrderedCollection" },
+    { "[ [ Ordered isEmpty ] whileFalse: [ Ordered removeFirst ]. Ordered size ] value", "0" },
+};
+
+
+int main(int argc, char **argv)
+{
+    char source[512], text[256];
+    size_t i;
+    int failed = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s image\n", argv[0]);
+        return 2;
+    }
+
+    if (lstOpen(argv[1], 0, 0) != 0) {
+        fprintf(stderr, "cannot read %s\n", argv[1]);
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(transcript) / sizeof(transcript[0]); i++) {
+        snprintf(source, sizeof(source), "(%s) printString", transcript[i].source);
+
+        if (lstStringValue(lstEval(source), text, sizeof(text)) == -1) {
+            strcpy(text, "(no answer)");
+        }
+
+        if (strcmp(text, transcript[i].expected) != 0) {
+            fprintf(stderr, "%s\n  printed %s, expected %s\n", transcript[i].source, text, transcript[i].expected);
+            failed = 1;
+        }
+    }
+
+    lstClose();
+
+    return failed;
+}
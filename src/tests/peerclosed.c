@@ -0,0 +1,96 @@
+/*
+ * peerclosed.c
+ *	Write to a socket whose peer has gone away
+ *
+ * The peer connects and closes at once.  The VM reads until the peer's
+ * reset comes in, then goes on writing to the accepted socket, which
+ * fails with EPIPE, and has to come through that instead of dying of
+ * SIGPIPE.
+ *
+ * usage: peerclosed lst_webide.img
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "lst.h"
+
+# define TestPort 7813
+
+
+/* connect once the VM is listening, then close without reading. */
+static void *peer(void *arg)
+{
+    struct sockaddr_in addr;
+    struct linger linger = { 1, 0 };
+    int fd, tries;
+
+    (void)arg;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TestPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (tries = 0; tries < 100; tries++) {
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+            return NULL;
+        }
+
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            /* reset the connection rather than shut it down */
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+            close(fd);
+            return NULL;
+        }
+
+        close(fd);
+        usleep(50000);
+    }
+
+    return NULL;
+}
+
+
+int main(int argc, char **argv)
+{
+    struct object *result;
+    pthread_t thread;
+    char source[1024];
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s image\n", argv[0]);
+        return 2;
+    }
+
+    if (lstOpen(argv[1], 0, 0) != 0) {
+        fprintf(stderr, "cannot read %s\n", argv[1]);
+        return 1;
+    }
+
+    pthread_create(&thread, NULL, peer, NULL);
+
+    /* the answer is what the last write managed, nil once it failed */
+    snprintf(source, sizeof(source),
+             "[:l | l bindTo: '127.0.0.1' onPort: %d. "
+             "[:c | c read. (1 to: 20) do: [:i | c write: (String new: 65536) ]. "
+             "[:last | c close. l close. last ] value: (c write: 'x') ] value: l accept ] value: TCPSocket new",
+             TestPort);
+    result = lstEval(source);
+
+    pthread_join(thread, NULL);
+
+    if (!result || !lstIsNil(result)) {
+        fprintf(stderr, "the writes to the closed socket did not fail\n");
+        lstClose();
+        return 1;
+    }
+
+    lstClose();
+
+    return 0;
+}
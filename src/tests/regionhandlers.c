@@ -0,0 +1,170 @@
+/*
+ * regionhandlers.c
+ *	Serve two connections at once, each handler in a region of its own
+ *
+ * The first request comes in halfway, so its handler waits on the
+ * socket while the second one is handled.  The second one asks how many
+ * regions are open, opening one of its own: its handler's and its own
+ * are all there may be, the waiting handler holds none.  Then the first
+ * request is finished and still has to be answered.
+ *
+ * usage: regionhandlers lst_webide.img
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "lst.h"
+
+# define TestPort 7815
+
+static char first[65536];
+static char second[65536];
+
+
+/* a connection to the VM once it is listening, or -1. */
+static int connectVM(void)
+{
+    struct timeval timeout = { 10, 0 };
+    struct sockaddr_in addr;
+    int fd, tries;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TestPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (tries = 0; tries < 100; tries++) {
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+            return -1;
+        }
+
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            /* a VM that hangs fails the test rather than hanging it */
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            return fd;
+        }
+
+        close(fd);
+        usleep(50000);
+    }
+
+    return -1;
+}
+
+
+static int sendText(int fd, const char *text)
+{
+    return write(fd, text, strlen(text)) == (ssize_t)strlen(text) ? 0 : -1;
+}
+
+
+/* the answer to what was sent on fd goes into buffer if there is one. */
+static void answer(int fd, char *buffer, size_t size)
+{
+    size_t count = 0;
+    ssize_t got;
+
+    while (buffer && count < size - 1 && (got = read(fd, buffer + count, size - 1 - count)) > 0) {
+        count += (size_t)got;
+    }
+    if (buffer) {
+        buffer[count] = 0;
+    }
+
+    close(fd);
+}
+
+
+/* send one whole request, the answer goes into buffer if there is one. */
+static void request(const char *path, char *buffer, size_t size)
+{
+    char text[512];
+    int fd;
+
+    if ((fd = connectVM()) == -1) {
+        return;
+    }
+
+    snprintf(text, sizeof(text), "GET %s HTTP/1.0\r\nHost: 127.0.0.1\r\n\r\n", path);
+    if (sendText(fd, text) == -1) {
+        close(fd);
+        return;
+    }
+
+    answer(fd, buffer, size);
+}
+
+
+static void *client(void *arg)
+{
+    int fd;
+
+    (void)arg;
+
+    if ((fd = connectVM()) != -1 &&
+            sendText(fd, "GET /do_it?cmd=%27abc%27%20reverse HTTP/1.0\r\n") == 0) {
+        /* its handler waits for the rest while the next one runs */
+        usleep(300000);
+
+        request("/do_it?cmd=%5B%3An%20%7C%20Region%20close.%20n%20%5D%20value%3A%20Region%20open",
+                second, sizeof(second));
+
+        if (sendText(fd, "Host: 127.0.0.1\r\n\r\n") == 0) {
+            answer(fd, first, sizeof(first));
+        } else {
+            close(fd);
+        }
+    }
+
+    /* the server may be gone before it answers this one */
+    request("/stop", NULL, 0);
+
+    return NULL;
+}
+
+
+int main(int argc, char **argv)
+{
+    pthread_t thread;
+    char source[256];
+    int failed = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s image\n", argv[0]);
+        return 2;
+    }
+
+    if (lstOpen(argv[1], 0, 0) != 0) {
+        fprintf(stderr, "cannot read %s\n", argv[1]);
+        return 1;
+    }
+
+    pthread_create(&thread, NULL, client, NULL);
+
+    /* serves until the client asks it to stop, new would serve on the default port */
+    snprintf(source, sizeof(source),
+             "[:s | s bindTo: '127.0.0.1' onPort: %d. HTTPClassBrowser basicNew startOn: s ] value: TCPSocket new",
+             TestPort);
+    lstEval(source);
+
+    pthread_join(thread, NULL);
+    lstClose();
+
+    if (!strstr(second, "=> 2")) {
+        fprintf(stderr, "the handler did not have a region of its own:\n%s\n", second);
+        failed = 1;
+    }
+
+    if (!strstr(first, "=> cba")) {
+        fprintf(stderr, "the first request was not answered:\n%s\n", first);
+        failed = 1;
+    }
+
+    return failed;
+}
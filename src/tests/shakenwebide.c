@@ -0,0 +1,152 @@
+/*
+ * shakenwebide.c
+ *	Shake the web IDE image and serve a page from what is left
+ *
+ * The page is a doIt, whose code is compiled only when the request comes
+ * in.  The String methods it sends are reached from nothing the shaker
+ * can see in the image and still have to be there.
+ *
+ * usage: shakenwebide lst lst_webide.img
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "lst.h"
+
+# define TestPort 7814
+
+static char page[65536];
+
+
+/* send one request once the VM is listening, the answer goes into buffer if there is one. */
+static int request(const char *path, char *buffer, size_t size)
+{
+    struct timeval timeout = { 10, 0 };
+    struct sockaddr_in addr;
+    char text[256];
+    size_t count = 0;
+    ssize_t got;
+    int fd, tries;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TestPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (tries = 0; tries < 100; tries++) {
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+            return -1;
+        }
+
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            break;
+        }
+
+        close(fd);
+        fd = -1;
+        usleep(50000);
+    }
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    snprintf(text, sizeof(text), "GET %s HTTP/1.0\r\nHost: 127.0.0.1\r\n\r\n", path);
+    if (write(fd, text, strlen(text)) != (ssize_t)strlen(text)) {
+        close(fd);
+        return -1;
+    }
+
+    /* a VM that hangs fails the test rather than hanging it */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    while (buffer && count < size - 1 && (got = read(fd, buffer + count, size - 1 - count)) > 0) {
+        count += (size_t)got;
+    }
+    if (buffer) {
+        buffer[count] = 0;
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+
+static void *client(void *arg)
+{
+    (void)arg;
+
+    request("/do_it?cmd=%27abc%27%20reverse", page, sizeof(page));
+
+    /* the server may be gone before it answers this one */
+    request("/stop", NULL, 0);
+
+    return NULL;
+}
+
+
+int main(int argc, char **argv)
+{
+    char shaken[] = "/tmp/lstshakenXXXXXX";
+    pthread_t thread;
+    pid_t pid;
+    int status, fd;
+    char source[256];
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s lst image\n", argv[0]);
+        return 2;
+    }
+
+    if ((fd = mkstemp(shaken)) == -1) {
+        fprintf(stderr, "cannot make a file for the shaken image\n");
+        return 1;
+    }
+    close(fd);
+
+    /* the shaker writes the image and ends the VM, so run it on its own */
+    if ((pid = fork()) == 0) {
+        execl(argv[1], argv[1], "-shake", shaken, argv[2], (char *)NULL);
+        _exit(127);
+    }
+
+    if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "cannot shake %s\n", argv[2]);
+        unlink(shaken);
+        return 1;
+    }
+
+    if (lstOpen(shaken, 0, 0) != 0) {
+        fprintf(stderr, "cannot read the shaken image\n");
+        unlink(shaken);
+        return 1;
+    }
+    unlink(shaken);
+
+    pthread_create(&thread, NULL, client, NULL);
+
+    /* serves until the client asks it to stop, new would serve on the default port */
+    snprintf(source, sizeof(source),
+             "[:s | s bindTo: '127.0.0.1' onPort: %d. HTTPClassBrowser basicNew startOn: s ] value: TCPSocket new",
+             TestPort);
+    lstEval(source);
+
+    pthread_join(thread, NULL);
+    lstClose();
+
+    if (!strstr(page, "=> cba")) {
+        fprintf(stderr, "the doIt did not run in the shaken image:\n%s\n", page);
+        return 1;
+    }
+
+    return 0;
+}
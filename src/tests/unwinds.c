@@ -0,0 +1,76 @@
+/*
+ * unwinds.c
+ *	Run ensure: blocks however the receiver is left
+ *
+ * A ^ out of the receiver of ensure: runs its block on the way and takes
+ * its link off the unwinds of the process, which is what keeps a ^ in
+ * Semaphore>>critical: from holding the semaphore for good.  A process
+ * terminated by another one runs its ensure: blocks itself.
+ *
+ * usage: unwinds lst_repl.img
+ */
+
+#include <stdio.h>
+#include "lst.h"
+
+
+/* the methods the checks return out of */
+static const char *methods[] = {
+    "Object addMethod: 'unwindsReturn [ ^ 1 ] ensure: [ Smalltalk at: #UnwindsLog put: 2 ]. ^ 3'",
+    "Object addMethod: 'unwindsCritical: s s critical: [ ^ 1 ]. ^ 2'",
+};
+
+/* each doIt is one statement, answering true if the ensure: blocks ran */
+static const char *checks[] = {
+    /* a ^ out of the receiver, which leaves no link behind */
+    "[ Smalltalk at: #UnwindsLog put: 0. "
+    "(nil unwindsReturn = 1) and: [ (Smalltalk at: #UnwindsLog) = 2 and: [ Process active unwinds isNil ] ] ] value",
+
+    /* only as far as the ^ goes */
+    "[ [ nil unwindsReturn. Process active unwinds notNil ] ensure: [ nil ] ] value",
+
+    /* a ^ out of critical: signals, else the second one waits for good */
+    "[:s | s signal. nil unwindsCritical: s. (nil unwindsCritical: s) = 1 ] value: Semaphore new",
+
+    /* terminate runs the blocks in the process terminated */
+    "[:ready :done | [:p | ready wait. p terminate. done wait. (Smalltalk at: #UnwindsLog) == p ] "
+    "value: [ [ ready signal. Semaphore new wait ] "
+    "ensure: [ Smalltalk at: #UnwindsLog put: Process active. done signal ] ] fork ] "
+    "value: Semaphore new value: Semaphore new",
+};
+
+
+int main(int argc, char **argv)
+{
+    size_t i;
+    int failed = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s image\n", argv[0]);
+        return 2;
+    }
+
+    if (lstOpen(argv[1], 0, 0) != 0) {
+        fprintf(stderr, "cannot read %s\n", argv[1]);
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        if (!lstIsString(lstEval(methods[i]))) {
+            fprintf(stderr, "cannot compile: %s\n", methods[i]);
+            lstClose();
+            return 1;
+        }
+    }
+
+    for (i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        if (!lstIsTrue(lstEval(checks[i]))) {
+            fprintf(stderr, "did not unwind: %s\n", checks[i]);
+            failed = 1;
+        }
+    }
+
+    lstClose();
+
+    return failed;
+}
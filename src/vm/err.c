@@ -1,3 +1,4 @@
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -9,6 +10,8 @@
 #include "interp.h"
 
 
+VM_LOCAL jmp_buf *errorRecovery = NULL;
+
 static void print_log(const char *func, int line_num, const char *templ, va_list va)
 {
     char output[2048];
@@ -47,6 +50,10 @@ void error_impl(const char *func, int line_num, const char *templ, ...)
     print_log(func, line_num, templ, va);
     va_end(va);
 
+    if(errorRecovery) {
+        longjmp(*errorRecovery, 1);
+    }
+
     exit(1);
 }
 
@@ -1,9 +1,13 @@
 
 #pragma once
 
+#include <setjmp.h>
 #include <stdint.h>
 #include "memory.h"
 
+/* while set, error() jumps here after printing rather than exiting */
+extern VM_LOCAL jmp_buf *errorRecovery;
+
 
 extern void info_impl(const char *func, int line_num, const char *templ, ...);
 extern void error_impl(const char *func, int line_num, const char *templ, ...);
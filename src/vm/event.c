@@ -0,0 +1,1081 @@
+/*
+ * event.c
+ *	Waiting on file descriptors with epoll
+ *
+ * Each descriptor has a Semaphore slot for reading and one for writing.
+ * Descriptors are registered one-shot with the union of the events
+ * waited for and re-armed after an event for whatever is still waited
+ * on.  The Semaphore table is a GC root vector, so it is filled with
+ * nil rather than NULL.
+ *
+ * io_uring is driven with the raw system calls.  Its file descriptor is
+ * part of the epoll set, so that one epoll_wait() sleeps until either a
+ * descriptor is ready or a request completes.
+ *
+ * Work that can only be done by a blocking call runs on a small pool of
+ * threads instead.  The threads never touch the heap: they work on the
+ * buffer of their request and post its id to a done list, then an
+ * eventfd in the epoll set wakes the interpreter, which signals the
+ * Semaphores itself.
+ *
+ * Timers are advanced by eventPoll() too, see timer.c.  A Semaphore
+ * whose timer fires first is taken back from the descriptors and the
+ * requests it waits on.  Such a request is cancelled and frees itself
+ * once it completes, which is why ids carry how often their slot has
+ * been used: a late ioResult() must not see the next request there.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <linux/io_uring.h>
+#include "err.h"
+#include "globals.h"
+#include "memory.h"
+#include "interp.h"
+#include "event.h"
+#include "timer.h"
+
+#define EVENT_BATCH 256
+
+static VM_LOCAL int epollFd = -1;
+
+/* two slots per descriptor, see EventRead and EventWrite */
+static VM_LOCAL struct object **eventSemaphores = NULL;
+static VM_LOCAL int eventSlots = 0;
+
+/* descriptors known to the epoll set */
+static VM_LOCAL uint8_t *eventRegistered = NULL;
+
+static VM_LOCAL int eventWaiting = 0;
+
+#define IO_RING_ENTRIES 256
+#define IO_REQUESTS 512
+
+struct ioRequest {
+    int busy;
+    int done;
+    int pooled;
+    int abandoned;
+    int uses;
+    int op;
+    int fd;
+    int result;
+    uint8_t *buffer;
+    size_t size;
+    int64_t offset;
+    ioWork work;
+};
+
+/* user_data of cancel requests, whose completions are not recorded */
+#define IO_CANCEL IO_REQUESTS
+
+/* ids are slot + IO_REQUESTS * uses and have to be SmallInts */
+#define IO_USES_MASK 0xffff
+
+VM_LOCAL int ioUringDisabled = 0;
+
+/* 0 until io_uring is first wanted, then 1 if it works or -1 */
+static VM_LOCAL int ioState = 0;
+static VM_LOCAL int ringFd = -1;
+
+static VM_LOCAL unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+static VM_LOCAL unsigned *cqHead, *cqTail, *cqMask;
+static VM_LOCAL struct io_uring_sqe *sqEntries;
+static VM_LOCAL struct io_uring_cqe *cqEntries;
+
+/* the mappings of the ring, to give them back at the end */
+static VM_LOCAL void *ringMaps[3];
+static VM_LOCAL size_t ringMapSizes[3];
+
+/* entries queued but not yet handed to the kernel */
+static VM_LOCAL unsigned ioQueued = 0;
+static VM_LOCAL int ioInFlight = 0;
+
+static VM_LOCAL struct ioRequest ioRequests[IO_REQUESTS];
+static VM_LOCAL struct object *ioSemaphoreTable[IO_REQUESTS];
+static VM_LOCAL struct object **ioSemaphores = NULL;
+static VM_LOCAL int ioSemaphoreCount = IO_REQUESTS;
+static VM_LOCAL int ioTableReady = 0;
+
+#define IO_THREADS 4
+
+/*
+ * The threads of a pool only see the pool.  Its queue and done list are
+ * guarded by its lock, and the requests belong to the isolate, which
+ * stops the threads before it goes away.
+ */
+struct ioPool {
+    pthread_mutex_t lock;
+    pthread_cond_t waiting;
+    struct ioRequest *requests;
+    int queue[IO_REQUESTS];
+    int first;
+    int queued;
+    int done[IO_REQUESTS];
+    int doneCount;
+    int stopping;
+    int fd;                     /* the eventfd the threads post to */
+    volatile int *interrupts;   /* of the interpreter, to poll soon */
+    pthread_t threads[IO_THREADS];
+};
+
+/* NULL until the pool is first wanted */
+static VM_LOCAL struct ioPool *pool = NULL;
+
+static int ioReap(void);
+static int poolReap(void);
+static void poolStop(void);
+static int ioAllocate(const void *data, size_t size);
+static int ioStart(int id, int pooled, struct object *sem);
+static void ioFlush(void);
+static void ioCancel(int fd);
+static void ioCancelRequest(int id);
+static void ioDiscard(int id);
+
+
+static int eventGrow(int fd)
+{
+    int slots = eventSlots ? eventSlots : 64;
+    struct object **sems;
+    uint8_t *registered;
+    int i;
+
+    while (slots <= fd * 2 + 1) {
+        slots *= 2;
+    }
+
+    sems = realloc(eventSemaphores, slots * sizeof(struct object *));
+    if (!sems) {
+        return -1;
+    }
+    eventSemaphores = sems;
+
+    registered = realloc(eventRegistered, slots / 2);
+    if (!registered) {
+        return -1;
+    }
+    eventRegistered = registered;
+
+    for (i = eventSlots; i < slots; i++) {
+        eventSemaphores[i] = nilObject;
+    }
+    memset(eventRegistered + eventSlots / 2, 0, (slots - eventSlots) / 2);
+
+    if (!eventSlots) {
+        addRootVector(&eventSemaphores, &eventSlots);
+    }
+    eventSlots = slots;
+
+    return 0;
+}
+
+
+/* (re-)arm a descriptor for the events still waited on. */
+static int eventArm(int fd)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLONESHOT;
+    ev.data.fd = fd;
+
+    if (eventSemaphores[fd * 2 + EventRead] != nilObject) {
+        ev.events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (eventSemaphores[fd * 2 + EventWrite] != nilObject) {
+        ev.events |= EPOLLOUT;
+    }
+
+    if (eventRegistered[fd]) {
+        if (epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev) == 0) {
+            return 0;
+        }
+
+        /* the descriptor may have been closed and reused behind our back */
+        if (errno != ENOENT) {
+            return -1;
+        }
+    }
+
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        return -1;
+    }
+    eventRegistered[fd] = 1;
+
+    return 0;
+}
+
+
+static void eventSignal(int slot)
+{
+    struct object *sem = eventSemaphores[slot];
+
+    if (sem != nilObject) {
+        eventSemaphores[slot] = nilObject;
+        eventWaiting--;
+        signalSemaphore(sem);
+    }
+}
+
+
+int eventWaitFor(int fd, int mode, struct object *sem)
+{
+    int slot = fd * 2 + mode;
+
+    if (fd < 0 || (mode != EventRead && mode != EventWrite)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (epollFd == -1 && (epollFd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        return -1;
+    }
+
+    if (slot >= eventSlots && eventGrow(fd) == -1) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* only one process at a time waits for each direction */
+    if (eventSemaphores[slot] != nilObject) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    eventSemaphores[slot] = sem;
+    eventWaiting++;
+
+    if (eventArm(fd) == -1) {
+        eventSemaphores[slot] = nilObject;
+        eventWaiting--;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void eventForget(int fd)
+{
+    if (fd < 0) {
+        return;
+    }
+
+    /* a request keeps the descriptor open, so it has to be stopped */
+    ioCancel(fd);
+
+    if (fd * 2 >= eventSlots) {
+        return;
+    }
+
+    if (eventRegistered[fd]) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+        eventRegistered[fd] = 0;
+    }
+
+    eventSignal(fd * 2 + EventRead);
+    eventSignal(fd * 2 + EventWrite);
+}
+
+
+void eventAbandon(struct object *sem)
+{
+    int i;
+
+    for (i = 0; i < eventSlots; i++) {
+        if (eventSemaphores[i] == sem) {
+            eventSemaphores[i] = nilObject;
+            eventWaiting--;
+        }
+    }
+
+    if (!ioTableReady) {
+        return;
+    }
+
+    /* the requests free themselves when they complete */
+    for (i = 0; i < IO_REQUESTS; i++) {
+        if (ioRequests[i].busy && !ioRequests[i].done && ioSemaphores[i] == sem) {
+            ioSemaphores[i] = nilObject;
+            ioRequests[i].abandoned = 1;
+            if (!ioRequests[i].pooled) {
+                ioCancelRequest(i);
+            }
+        }
+    }
+}
+
+
+void eventForkChild(void)
+{
+    int i;
+
+    /* the epoll set and the ring would be shared with the parent */
+    if (epollFd != -1) {
+        close(epollFd);
+        epollFd = -1;
+    }
+
+    if (eventSlots) {
+        for (i = 0; i < eventSlots; i++) {
+            eventSemaphores[i] = nilObject;
+        }
+        memset(eventRegistered, 0, eventSlots / 2);
+    }
+    eventWaiting = 0;
+
+    if (ringFd != -1) {
+        close(ringFd);
+        ringFd = -1;
+    }
+
+    /* only the forking thread lives on, maybe with the lock of the pool held */
+    if (pool) {
+        close(pool->fd);
+        pool = NULL;
+    }
+
+    for (i = 0; i < IO_REQUESTS; i++) {
+        free(ioRequests[i].buffer);
+        ioRequests[i].buffer = NULL;
+        ioRequests[i].busy = 0;
+        if (ioTableReady) {
+            ioSemaphores[i] = nilObject;
+        }
+    }
+    ioQueued = 0;
+    ioInFlight = 0;
+    if (ioState == 1) {
+        ioState = 0;
+    }
+}
+
+
+void eventShutdown(void)
+{
+    int i;
+
+    if (pool) {
+        poolStop();
+    }
+
+    if (ringFd != -1) {
+        close(ringFd);
+        ringFd = -1;
+        for (i = 0; i < 3; i++) {
+            if (ringMaps[i]) {
+                munmap(ringMaps[i], ringMapSizes[i]);
+                ringMaps[i] = NULL;
+            }
+        }
+    }
+    ioState = 0;
+
+    for (i = 0; i < IO_REQUESTS; i++) {
+        free(ioRequests[i].buffer);
+        ioRequests[i].buffer = NULL;
+        ioRequests[i].busy = 0;
+    }
+    ioQueued = 0;
+    ioInFlight = 0;
+
+    if (epollFd != -1) {
+        close(epollFd);
+        epollFd = -1;
+    }
+
+    free(eventSemaphores);
+    eventSemaphores = NULL;
+    free(eventRegistered);
+    eventRegistered = NULL;
+    eventSlots = 0;
+    eventWaiting = 0;
+
+    /* the root vector goes with the heap */
+    ioSemaphores = NULL;
+    ioTableReady = 0;
+
+    timerRelease();
+}
+
+
+int eventPending(void)
+{
+    return eventWaiting + ioInFlight + timerCount();
+}
+
+
+int eventPoll(int timeout)
+{
+    struct epoll_event events[EVENT_BATCH];
+    int count, i, fd, next, signaled = 0;
+
+    if (!eventPending()) {
+        return 0;
+    }
+
+    /* only timers may be pending */
+    if (epollFd == -1 && (epollFd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        error("epoll_create1() failed, errno=%d!", errno);
+    }
+
+    ioFlush();
+
+    /* no need to sleep if requests have completed already */
+    if ((signaled = ioReap())) {
+        timeout = 0;
+    }
+
+    /* nor for longer than until the next timer is due */
+    if ((next = timerNext()) >= 0 && (timeout < 0 || next < timeout)) {
+        timeout = next;
+    }
+
+    /* a signal for the interpreter ends the wait, as for Ctrl-C */
+    do {
+        count = epoll_wait(epollFd, events, EVENT_BATCH, timeout);
+    } while (count == -1 && errno == EINTR && !interrupts);
+
+    if (count == -1 && errno == EINTR) {
+        count = 0;
+    } else if (count == -1) {
+        error("epoll_wait() failed, errno=%d!", errno);
+    }
+
+    for (i = 0; i < count; i++) {
+        fd = events[i].data.fd;
+
+        if (fd == ringFd) {
+            signaled += ioReap();
+            continue;
+        }
+
+        if (pool && fd == pool->fd) {
+            signaled += poolReap();
+            continue;
+        }
+
+        /* errors and hang ups wake both sides so they see them */
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+            signaled += eventSemaphores[fd * 2 + EventRead] != nilObject;
+            eventSignal(fd * 2 + EventRead);
+        }
+        if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+            signaled += eventSemaphores[fd * 2 + EventWrite] != nilObject;
+            eventSignal(fd * 2 + EventWrite);
+        }
+
+        if (eventSemaphores[fd * 2 + EventRead] != nilObject ||
+                eventSemaphores[fd * 2 + EventWrite] != nilObject) {
+            eventArm(fd);
+        }
+    }
+
+    /* what completed in time was signaled before its timer could fire */
+    signaled += timerExpire();
+
+    return signaled;
+}
+
+
+
+/*
+ * Asynchronous I/O
+ */
+
+static int ioSetup(void)
+{
+    struct io_uring_params params;
+    struct epoll_event ev;
+    size_t sqSize, cqSize;
+    uint8_t *sq, *cq;
+
+    memset(&params, 0, sizeof(params));
+    ringFd = (int)syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+    if (ringFd == -1) {
+        info("io_uring is not available, errno=%d.", errno);
+        return -1;
+    }
+
+    sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cqSize > sqSize) {
+            sqSize = cqSize;
+        }
+        cqSize = sqSize;
+    }
+
+    sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        goto fail;
+    }
+    ringMaps[0] = sq;
+    ringMapSizes[0] = sqSize;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            goto fail;
+        }
+        ringMaps[1] = cq;
+        ringMapSizes[1] = cqSize;
+    }
+
+    sqEntries = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqEntries == MAP_FAILED) {
+        goto fail;
+    }
+    ringMaps[2] = sqEntries;
+    ringMapSizes[2] = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    sqHead = (unsigned *)(sq + params.sq_off.head);
+    sqTail = (unsigned *)(sq + params.sq_off.tail);
+    sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned *)(sq + params.sq_off.array);
+    cqHead = (unsigned *)(cq + params.cq_off.head);
+    cqTail = (unsigned *)(cq + params.cq_off.tail);
+    cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqEntries = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    /* completions wake up the epoll_wait() of the scheduler */
+    if (epollFd == -1 && (epollFd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        goto fail;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = ringFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, ringFd, &ev) == -1) {
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    info("io_uring setup failed, errno=%d.", errno);
+    close(ringFd);
+    ringFd = -1;
+    return -1;
+}
+
+
+/* hand the queued entries to the kernel. */
+static void ioFlush(void)
+{
+    int count;
+
+    while (ioQueued > 0) {
+        count = (int)syscall(__NR_io_uring_enter, ringFd, ioQueued, 0, 0, NULL, 0);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            /* EAGAIN and EBUSY clear up as completions are reaped */
+            if (errno == EAGAIN || errno == EBUSY) {
+                ioReap();
+                continue;
+            }
+
+            error("io_uring_enter() failed, errno=%d!", errno);
+        }
+
+        ioQueued -= count;
+    }
+}
+
+
+/* record the completions and signal the waiting Semaphores. */
+static int ioReap(void)
+{
+    struct io_uring_cqe *cqe;
+    struct ioRequest *req;
+    unsigned head, tail;
+    int signaled = 0;
+
+    if (ioState != 1) {
+        return 0;
+    }
+
+    head = *cqHead;
+    tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        cqe = &cqEntries[head & *cqMask];
+        if (cqe->user_data == IO_CANCEL) {
+            head++;
+            continue;
+        }
+
+        req = &ioRequests[cqe->user_data];
+        req->done = 1;
+        req->result = cqe->res;
+        ioInFlight--;
+        head++;
+
+        if (req->abandoned) {
+            ioDiscard((int)cqe->user_data);
+        } else if (ioSemaphores[cqe->user_data] != nilObject) {
+            signalSemaphore(ioSemaphores[cqe->user_data]);
+            ioSemaphores[cqe->user_data] = nilObject;
+            signaled++;
+        }
+    }
+
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+    return signaled;
+}
+
+
+/* the next free submission entry, cleared. */
+static struct io_uring_sqe *ioEntry(void)
+{
+    struct io_uring_sqe *sqe;
+
+    if (*sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > *sqMask) {
+        ioFlush();
+    }
+
+    sqe = &sqEntries[*sqTail & *sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+
+/* add the entry from ioEntry() to the submission queue. */
+static void ioQueue(void)
+{
+    unsigned tail = *sqTail;
+
+    sqArray[tail & *sqMask] = tail & *sqMask;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    ioQueued++;
+}
+
+
+/* ask the kernel to cancel a request, which then completes early. */
+static void ioCancelRequest(int id)
+{
+    struct io_uring_sqe *sqe;
+
+    if (ioState != 1) {
+        return;
+    }
+
+    sqe = ioEntry();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = id;
+    sqe->user_data = IO_CANCEL;
+    ioQueue();
+}
+
+
+/* cancel the requests still running on a descriptor. */
+static void ioCancel(int fd)
+{
+    int id;
+
+    for (id = 0; id < IO_REQUESTS; id++) {
+        if (ioRequests[id].busy && !ioRequests[id].done && !ioRequests[id].pooled &&
+                ioRequests[id].fd == fd) {
+            ioCancelRequest(id);
+        }
+    }
+}
+
+
+/* free an abandoned request once it completes, with what it opened. */
+static void ioDiscard(int id)
+{
+    struct ioRequest *req = &ioRequests[id];
+
+    if (req->op == IoAccept && req->result >= 0) {
+        close(req->result);
+    }
+
+    free(req->buffer);
+    req->buffer = NULL;
+    req->abandoned = 0;
+    req->busy = 0;
+}
+
+
+/* run the requests queued for the pool, without touching the heap. */
+static void *poolRun(void *arg)
+{
+    struct ioPool *self = arg;
+    struct ioRequest *req;
+    uint64_t one = 1;
+    ssize_t count = 0;
+    int id;
+
+    for (;;) {
+        pthread_mutex_lock(&self->lock);
+        while (self->queued == 0 && !self->stopping) {
+            pthread_cond_wait(&self->waiting, &self->lock);
+        }
+        if (self->stopping) {
+            pthread_mutex_unlock(&self->lock);
+            break;
+        }
+        id = self->queue[self->first];
+        self->first = (self->first + 1) % IO_REQUESTS;
+        self->queued--;
+        pthread_mutex_unlock(&self->lock);
+
+        req = &self->requests[id];
+
+        switch (req->op) {
+        case IoRead:
+            count = pread(req->fd, req->buffer, req->size, (off_t)req->offset);
+            break;
+
+        case IoWrite:
+            count = pwrite(req->fd, req->buffer, req->size, (off_t)req->offset);
+            break;
+
+        case IoWork:
+            count = req->work(&req->buffer, req->size);
+            break;
+        }
+        req->result = (count < 0 && req->op != IoWork) ? -errno : (int)count;
+
+        pthread_mutex_lock(&self->lock);
+        self->done[self->doneCount++] = id;
+        pthread_mutex_unlock(&self->lock);
+
+        while (write(self->fd, &one, sizeof(one)) == -1 && errno == EINTR)
+            ;
+
+        /* the interpreter picks it up at its next check point */
+        __atomic_or_fetch(self->interrupts, InterruptPoll, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+
+/* start the threads, which leave all signals to the interpreter. */
+static int poolStart(void)
+{
+    struct epoll_event ev;
+    sigset_t all, old;
+    int i;
+
+    if (epollFd == -1 && (epollFd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        return -1;
+    }
+
+    if (!(pool = calloc(1, sizeof(*pool)))) {
+        return -1;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->waiting, NULL);
+    pool->requests = ioRequests;
+    pool->interrupts = interruptFlag();
+
+    if ((pool->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        free(pool);
+        pool = NULL;
+        return -1;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = pool->fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, pool->fd, &ev) == -1) {
+        close(pool->fd);
+        free(pool);
+        pool = NULL;
+        return -1;
+    }
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    for (i = 0; i < IO_THREADS; i++) {
+        if (pthread_create(&pool->threads[i], NULL, poolRun, pool) != 0) {
+            error("Unable to start an I/O thread!");
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return 0;
+}
+
+
+/* wait for the threads to finish what they are doing and end them. */
+static void poolStop(void)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->waiting);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < IO_THREADS; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    close(pool->fd);
+    pthread_cond_destroy(&pool->waiting);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    pool = NULL;
+}
+
+
+static int poolSubmit(int op, int fd, const void *data, size_t size, int64_t offset, ioWork work, struct object *sem)
+{
+    struct ioRequest *req;
+    int id, tagged;
+
+    if (!pool && poolStart() == -1) {
+        return -1;
+    }
+
+    if ((id = ioAllocate(data, size)) == -1) {
+        return -1;
+    }
+    req = &ioRequests[id];
+    req->op = op;
+    req->fd = fd;
+    req->offset = offset;
+    req->work = work;
+    tagged = ioStart(id, 1, sem);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queue[(pool->first + pool->queued) % IO_REQUESTS] = id;
+    pool->queued++;
+    pthread_cond_signal(&pool->waiting);
+    pthread_mutex_unlock(&pool->lock);
+
+    return tagged;
+}
+
+
+/* record the requests the threads have finished and signal them. */
+static int poolReap(void)
+{
+    int done[IO_REQUESTS];
+    uint64_t posts;
+    int count, i, id, signaled = 0;
+
+    while (read(pool->fd, &posts, sizeof(posts)) == -1 && errno == EINTR)
+        ;
+
+    pthread_mutex_lock(&pool->lock);
+    count = pool->doneCount;
+    memcpy(done, pool->done, count * sizeof(int));
+    pool->doneCount = 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < count; i++) {
+        id = done[i];
+        ioRequests[id].done = 1;
+        ioInFlight--;
+
+        if (ioRequests[id].abandoned) {
+            ioDiscard(id);
+        } else if (ioSemaphores[id] != nilObject) {
+            signalSemaphore(ioSemaphores[id]);
+            ioSemaphores[id] = nilObject;
+            signaled++;
+        }
+    }
+
+    return signaled;
+}
+
+
+/* a free request holding a copy of data, or -1. */
+static int ioAllocate(const void *data, size_t size)
+{
+    struct ioRequest *req;
+    int i, id;
+
+    if (!ioTableReady) {
+        ioSemaphores = ioSemaphoreTable;
+        for (i = 0; i < IO_REQUESTS; i++) {
+            ioSemaphores[i] = nilObject;
+        }
+        addRootVector(&ioSemaphores, &ioSemaphoreCount);
+        ioTableReady = 1;
+    }
+
+    for (id = 0; id < IO_REQUESTS && ioRequests[id].busy; id++)
+        ;
+    if (id == IO_REQUESTS) {
+        return -1;
+    }
+    req = &ioRequests[id];
+
+    req->buffer = NULL;
+    if (size > 0) {
+        req->buffer = malloc(size);
+        if (!req->buffer) {
+            return -1;
+        }
+        if (data) {
+            memcpy(req->buffer, data, size);
+        }
+    }
+    req->size = size;
+
+    return id;
+}
+
+
+/* mark a request as running until its Semaphore is signaled, returns its id. */
+static int ioStart(int id, int pooled, struct object *sem)
+{
+    ioRequests[id].busy = 1;
+    ioRequests[id].done = 0;
+    ioRequests[id].pooled = pooled;
+    ioRequests[id].abandoned = 0;
+    ioRequests[id].uses++;
+    ioSemaphores[id] = sem;
+    ioInFlight++;
+
+    return id + IO_REQUESTS * (ioRequests[id].uses & IO_USES_MASK);
+}
+
+
+/* the slot of a request that has not been freed or abandoned, or -1. */
+static int ioFind(int id)
+{
+    int slot = id % IO_REQUESTS;
+
+    if (id < 0 || !ioRequests[slot].busy || ioRequests[slot].abandoned ||
+            (ioRequests[slot].uses & IO_USES_MASK) != id / IO_REQUESTS) {
+        return -1;
+    }
+
+    return slot;
+}
+
+
+int ioSubmit(int op, int fd, const void *data, size_t size, int64_t offset, struct object *sem)
+{
+    struct io_uring_sqe *sqe;
+    struct ioRequest *req;
+    int id;
+
+    if (ioState == 0) {
+        ioState = (!ioUringDisabled && ioSetup() == 0) ? 1 : -1;
+    }
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    /* without io_uring, reads and writes at an offset block a thread */
+    if (ioState != 1) {
+        if ((op != IoRead && op != IoWrite) || offset < 0) {
+            return -1;
+        }
+        return poolSubmit(op, fd, data, size, offset, NULL, sem);
+    }
+
+    if ((id = ioAllocate(data, size)) == -1) {
+        return -1;
+    }
+    req = &ioRequests[id];
+
+    sqe = ioEntry();
+    sqe->fd = fd;
+    sqe->user_data = id;
+    req->fd = fd;
+
+    switch (op) {
+    case IoRead:
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = (uintptr_t)req->buffer;
+        sqe->len = (unsigned)size;
+        sqe->off = (uint64_t)offset;
+        break;
+
+    case IoWrite:
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->addr = (uintptr_t)req->buffer;
+        sqe->len = (unsigned)size;
+        sqe->off = (uint64_t)offset;
+        break;
+
+    /* a peer that has gone away must not raise SIGPIPE */
+    case IoSend:
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (uintptr_t)req->buffer;
+        sqe->len = (unsigned)size;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        break;
+
+    case IoAccept:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->accept_flags = SOCK_NONBLOCK;
+        break;
+
+    case IoClose:
+        sqe->opcode = IORING_OP_CLOSE;
+        break;
+
+    default:
+        free(req->buffer);
+        req->buffer = NULL;
+        return -1;
+    }
+
+    ioQueue();
+
+    return ioStart(id, 0, sem);
+}
+
+
+int ioSubmitWork(ioWork work, const void *data, size_t size, struct object *sem)
+{
+    return poolSubmit(IoWork, -1, data, size, 0, work, sem);
+}
+
+
+int ioResult(int id, int *result, uint8_t **buffer)
+{
+    if ((id = ioFind(id)) == -1 || !ioRequests[id].done) {
+        return 0;
+    }
+
+    *result = ioRequests[id].result;
+    *buffer = ioRequests[id].buffer;
+
+    return 1;
+}
+
+
+void ioRelease(int id)
+{
+    if ((id = ioFind(id)) == -1 || !ioRequests[id].done) {
+        return;
+    }
+
+    free(ioRequests[id].buffer);
+    ioRequests[id].buffer = NULL;
+    ioRequests[id].busy = 0;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "memory.h"
+
+/*
+ * The event loop lets a Process wait for a file descriptor without
+ * blocking the VM.  A Semaphore is registered for reading or writing
+ * on the descriptor and signaled once the descriptor is ready, closed
+ * or in error.  The scheduler polls when it has nothing else to do.
+ */
+
+#define EventRead 0
+#define EventWrite 1
+
+/* returns 0 on success or -1 with errno set */
+extern int eventWaitFor(int fd, int mode, struct object *sem);
+
+/* wakes up anything waiting on a descriptor which is being closed */
+extern void eventForget(int fd);
+
+/* drops the state shared with the parent in a forked child */
+extern void eventForkChild(void);
+
+/* stops the I/O threads and frees everything, when an isolate ends */
+extern void eventShutdown(void);
+
+/* stops the waits and requests a Semaphore was given to, when it times out */
+extern void eventAbandon(struct object *sem);
+
+/* the number of Semaphores waiting for a descriptor, an I/O request or a timer */
+extern int eventPending(void);
+
+/* waits up to timeout ms (-1 forever) and returns the number signaled */
+extern int eventPoll(int timeout);
+
+
+/*
+ * Asynchronous I/O requests are run by io_uring when the kernel has it.
+ * A request copies its data in and out of a buffer of its own, as the
+ * heap may move while it runs, and signals its Semaphore on completion.
+ * Requests are queued and handed to the kernel together when the
+ * scheduler next polls.  Without io_uring, file reads and writes and
+ * any other work that blocks run on a pool of threads.
+ */
+
+#define IoRead 0
+#define IoWrite 1
+#define IoAccept 2
+#define IoClose 3
+#define IoWork 4
+#define IoSend 5
+
+/* set to leave io_uring alone, as if the kernel did not have it, for this VM */
+extern VM_LOCAL int ioUringDisabled;
+
+/* returns a request id, or -1 if it can not run asynchronously */
+extern int ioSubmit(int op, int fd, const void *data, size_t size, int64_t offset, struct object *sem);
+
+/*
+ * Work for a pool thread gets the request's buffer, holding a copy of
+ * the data it was submitted with, and may replace it with a malloc()ed
+ * one for its output.  It must not touch the heap.  The result it
+ * returns is the request's, a negative errno value for an error.
+ */
+typedef int (*ioWork)(uint8_t **buffer, size_t size);
+
+/* returns a request id for running work on a pool thread, or -1 */
+extern int ioSubmitWork(ioWork work, const void *data, size_t size, struct object *sem);
+
+/* returns 1 and the result once the request completed, 0 before or if abandoned */
+extern int ioResult(int id, int *result, uint8_t **buffer);
+
+/* frees a completed request */
+extern void ioRelease(int id);
@@ -17,25 +17,25 @@ unsigned int debugging = 0;
 
 
 /* commonly used objects */
-struct object *badMethodSym = NULL;
-struct object *binaryMessages[3] = {0,};
-struct object *falseObject = NULL;
-struct object *globalsObject = NULL;
-struct object *initialMethod = NULL;
-struct object *nilObject = NULL;
-struct object *trueObject = NULL;
+VM_LOCAL struct object *badMethodSym = NULL;
+VM_LOCAL struct object *binaryMessages[3] = {0,};
+VM_LOCAL struct object *falseObject = NULL;
+VM_LOCAL struct object *globalsObject = NULL;
+VM_LOCAL struct object *initialMethod = NULL;
+VM_LOCAL struct object *nilObject = NULL;
+VM_LOCAL struct object *trueObject = NULL;
 
 /* commonly used classes */
-struct object *ArrayClass = NULL;
-struct object *BlockClass = NULL;
-struct object *ByteArrayClass = NULL;
-struct object *ContextClass = NULL;
-struct object *DictionaryClass = NULL;
-struct object *IntegerClass = NULL;
-struct object *SmallIntClass = NULL;
-struct object *StringClass = NULL;
-struct object *SymbolClass = NULL;
-struct object *UndefinedClass = NULL;
+VM_LOCAL struct object *ArrayClass = NULL;
+VM_LOCAL struct object *BlockClass = NULL;
+VM_LOCAL struct object *ByteArrayClass = NULL;
+VM_LOCAL struct object *ContextClass = NULL;
+VM_LOCAL struct object *DictionaryClass = NULL;
+VM_LOCAL struct object *IntegerClass = NULL;
+VM_LOCAL struct object *SmallIntClass = NULL;
+VM_LOCAL struct object *StringClass = NULL;
+VM_LOCAL struct object *SymbolClass = NULL;
+VM_LOCAL struct object *UndefinedClass = NULL;
 
 /* storage for the program's argc and argv. */
 int prog_argc = 0;
@@ -8,6 +8,7 @@
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdint.h>
+#include "memory.h"
 
 /* get the current time in microseconds. Used mostly for debugging. */
 extern int64_t time_usec();
@@ -22,25 +23,25 @@ extern unsigned int debugging;
 
 
 /* commonly used objects */
-extern struct object *badMethodSym;
-extern struct object *binaryMessages[3];
-extern struct object *falseObject;
-extern struct object *globalsObject;
-extern struct object *initialMethod;
-extern struct object *nilObject;
-extern struct object *trueObject;
+extern VM_LOCAL struct object *badMethodSym;
+extern VM_LOCAL struct object *binaryMessages[3];
+extern VM_LOCAL struct object *falseObject;
+extern VM_LOCAL struct object *globalsObject;
+extern VM_LOCAL struct object *initialMethod;
+extern VM_LOCAL struct object *nilObject;
+extern VM_LOCAL struct object *trueObject;
 
 /* commonly used classes */
-extern struct object *ArrayClass;
-extern struct object *BlockClass;
-extern struct object *ByteArrayClass;
-extern struct object *ContextClass;
-extern struct object *DictionaryClass;
-extern struct object *IntegerClass;
-extern struct object *SmallIntClass;
-extern struct object *StringClass;
-extern struct object *SymbolClass;
-extern struct object *UndefinedClass;
+extern VM_LOCAL struct object *ArrayClass;
+extern VM_LOCAL struct object *BlockClass;
+extern VM_LOCAL struct object *ByteArrayClass;
+extern VM_LOCAL struct object *ContextClass;
+extern VM_LOCAL struct object *DictionaryClass;
+extern VM_LOCAL struct object *IntegerClass;
+extern VM_LOCAL struct object *SmallIntClass;
+extern VM_LOCAL struct object *StringClass;
+extern VM_LOCAL struct object *SymbolClass;
+extern VM_LOCAL struct object *UndefinedClass;
 
 
 /* values for the current program. */
@@ -52,14 +53,49 @@ extern const char **prog_argv;
     field offsets
 */
 /*
-    A Process has two fields
+    A Process has eight fields
         * a current context
         * status of process (running, waiting, etc)
+        * the result of the last execution
+        * its scheduling priority, nil for the default
+        * the next process on the list it is on
+        * the list it is on: nil if none, its priority if it
+          is ready to run or the Semaphore it waits on
+        * a ByteArray of what it has used and may use, in
+          64 bit counters, or nil until it first runs
+        * the Link of blocks ensure: has yet to run, newest first
 */
-# define processSize 3
+# define processSize 8
 # define contextInProcess 0
 # define statusInProcess 1
 # define resultInProcess 2
+# define priorityInProcess 3
+# define linkInProcess 4
+# define listInProcess 5
+# define usageInProcess 6
+# define unwindsInProcess 7
+
+/*
+    The usage of a Process counts bytecodes, bytes allocated and
+    microseconds of wall time it ran for, then the quotas for each
+    of them, 0 for none.
+*/
+# define usageSize 6
+# define bytecodesInUsage 0
+# define bytesInUsage 1
+# define timeInUsage 2
+# define bytecodesQuotaInUsage 3
+# define bytesQuotaInUsage 4
+# define timeQuotaInUsage 5
+
+/*
+    A Semaphore has the count of excess signals and the first
+    and last of the processes waiting on it.
+*/
+# define semaphoreSize 3
+# define signalsInSemaphore 0
+# define firstInSemaphore 1
+# define lastInSemaphore 2
 
 /*
     A Context has:
@@ -136,11 +172,13 @@ extern const char **prog_argv;
         * value field
         * left subtree
         * right subtree
+        * height of the subtree, for AVL balancing
 */
 
 # define valueInNode 0
 # define leftInNode 1
 # define rightInNode 2
+# define heightInNode 3
 
 /*
     misc defines
@@ -155,3 +193,12 @@ extern const char **prog_argv;
 #define keysInDictionary    (0)
 #define valuesInDictionary  (1)
 
+/*
+    A StringBuffer has:
+        * a String used as the backing byte store
+        * the number of bytes of the store in use
+*/
+
+# define bufferInStringBuffer 0
+# define countInStringBuffer 1
+
@@ -1,14 +1,17 @@
 
 
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <sys/types.h>
 #include "err.h"
 #include "globals.h"
 #include "image.h"
 #include "memory.h"
+#include "prim.h"
 
 
 
@@ -43,6 +46,24 @@ The bytes per word or size is usually stored in the lower bits */
 
 
 
+/* buffered input and output for the tag based image formats */
+#define IMAGE_IO_BUFFER_SIZE (65536)
+
+struct image_io {
+    FILE *fp;
+    size_t pos;
+    size_t len;
+    uint64_t total;
+    uint8_t data[IMAGE_IO_BUFFER_SIZE];
+};
+
+/* objects whose class and fields are still to be read or written */
+struct image_frame {
+    struct object *obj;
+    int next;
+};
+
+
 #define PTR_BETWEEN(p, low, high) (((intptr_t)p >= (intptr_t)low) && ((intptr_t)p < (intptr_t)high))
 
 
@@ -54,11 +75,24 @@ static int fileIn_version_1(FILE *fp);
 //static int fileOut_version_1(FILE *fp);
 static int getIntSize(int val);
 static void objectWrite(FILE * fp, struct object *obj);
+static void objectWriteOne(FILE * fp, struct object *obj);
 static void writeTag(FILE * fp, int type, int val);
 
 static struct object *objectRead(FILE *fp);
+static struct object *objectReadOne(FILE *fp);
 static void readTag(FILE *fp, int *type, int *val);
+
+static void push_image_frame(struct object *obj);
+
+static void image_io_reset(struct image_io *io, FILE *fp);
+static void image_io_flush(struct image_io *io);
+static size_t image_io_fill(struct image_io *io);
+static uint64_t image_io_read_total(void);
+static int image_io_rate(uint64_t bytes, int64_t usec);
+static void put_byte(FILE *fp, int b);
+static void put_bytes(FILE *fp, const uint8_t *bytes, size_t count);
 static int get_byte(FILE *fp);
+static void get_bytes(FILE *fp, uint8_t *bytes, size_t count);
 
 //static int fileOut_version_2(FILE *fp);
 static int fileIn_version_2(FILE *fp);
@@ -68,17 +102,44 @@ static struct object *object_fix_up(struct object *obj, int64_t offset);
 static int fileIn_version_3(FILE *fp);
 static int fileOut_object_version_3(FILE *img, struct object *globs);
 
+static int fileIn_version_4(FILE *fp);
+static int fileOut_object_version_4(FILE *img, struct object *globs);
+
+static void findCoreObjects(void);
+
+static int fileIn_delta(FILE *fp);
+static void trackObject(struct object *obj);
+static void resetTracking(struct object **objects, size_t count);
+
+static int fileOut_object_image(FILE *fp, struct object *obj);
+static int fileIn_compressed(FILE *fp);
+static int fileOut_compressed(FILE *fp, struct object *obj);
+
 
 
 /* used for image pointer remapping */
-static int indirtop = 0;
-static struct object **indirArray;
+static VM_LOCAL int indirtop = 0;
+static VM_LOCAL struct object **indirArray;
+
+/* buffers and work stack for the tag based image formats */
+static VM_LOCAL struct image_io imageIn;
+static VM_LOCAL struct image_io imageOut;
+
+static VM_LOCAL struct image_frame *imageStack = NULL;
+static VM_LOCAL int imageStackTop = 0;
+static VM_LOCAL int imageStackSize = 0;
 
 
-/* used for bootstrap version 1 image */
-#define imageMaxNumberOfObjects 10000
-//static struct object **writtenObjects = NULL;
-//static int imageTop = 0;
+/* open addressing map from object address to an index, used when writing images */
+struct object_map {
+    struct object **keys;
+    size_t *values;
+    size_t capacity;
+    size_t count;
+};
+
+/* objects already written to a version 3 image */
+static VM_LOCAL struct object_map writtenObjects;
 
 
 
@@ -89,11 +150,130 @@ static struct object **indirArray;
 //struct object *imageTop;
 
 
+/* the image version written by fileOut() and fileOut_object() */
+VM_LOCAL int imageWriteVersion = IMAGE_VERSION_4;
 
-int fileIn(FILE *fp)
+/* set when images are written compressed, or the last one read was. */
+VM_LOCAL int imageCompressed = 0;
+static VM_LOCAL int imageDecompressing = 0;
+
+
+/* objects of the last image read or written, in image order, and the
+   ones among them that have been stored into since. */
+static VM_LOCAL struct object **imageObjects = NULL;
+static VM_LOCAL int imageObjectCount = 0;
+static VM_LOCAL int imageObjectCapacity = 0;
+
+static VM_LOCAL struct object **dirtyObjects = NULL;
+static VM_LOCAL int dirtyObjectCount = 0;
+static VM_LOCAL int dirtyObjectCapacity = 0;
+
+static VM_LOCAL int imageTrackingReady = 0;
+static VM_LOCAL int imageObjectsExchanged = 0;
+
+/* set while fileOut() writes the image, so the written objects are tracked. */
+static VM_LOCAL int trackingWrites = 0;
+
+
+
+static size_t object_map_hash(struct object *obj, size_t mask)
+{
+    uint64_t h = (uint64_t)(uintptr_t)obj;
+
+    h = (h >> 3) * UINT64_C(0x9E3779B97F4A7C15);
+
+    return (size_t)(h ^ (h >> 32)) & mask;
+}
+
+
+static void object_map_init(struct object_map *map, size_t capacity)
+{
+    map->capacity = capacity;
+    map->count = 0;
+    map->keys = calloc(capacity, sizeof(struct object *));
+    map->values = calloc(capacity, sizeof(size_t));
+
+    if(!map->keys || !map->values) {
+        error("Unable to allocate object map of %zu entries!", capacity);
+    }
+}
+
+
+static void object_map_free(struct object_map *map)
+{
+    free(map->keys);
+    free(map->values);
+
+    map->keys = NULL;
+    map->values = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
+
+
+/* return 1 and set *value if the object is in the map, 0 otherwise. */
+static int object_map_find(struct object_map *map, struct object *obj, size_t *value)
+{
+    size_t mask = map->capacity - 1;
+    size_t slot = object_map_hash(obj, mask);
+
+    while(map->keys[slot]) {
+        if(map->keys[slot] == obj) {
+            *value = map->values[slot];
+            return 1;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    return 0;
+}
+
+
+static void object_map_add(struct object_map *map, struct object *obj, size_t value)
+{
+    size_t mask;
+    size_t slot;
+
+    /* keep the load factor under one half. */
+    if((map->count + 1) * 2 > map->capacity) {
+        struct object_map bigger;
+        size_t i;
+
+        object_map_init(&bigger, map->capacity * 2);
+
+        for(i = 0; i < map->capacity; i++) {
+            if(map->keys[i]) {
+                object_map_add(&bigger, map->keys[i], map->values[i]);
+            }
+        }
+
+        object_map_free(map);
+        *map = bigger;
+    }
+
+    mask = map->capacity - 1;
+    slot = object_map_hash(obj, mask);
+
+    while(map->keys[slot]) {
+        slot = (slot + 1) & mask;
+    }
+
+    map->keys[slot] = obj;
+    map->values[slot] = value;
+    map->count++;
+}
+
+
+
+
+static int fileIn_image(FILE *fp)
 {
     uint8_t version = get_image_version(fp);
 
+    /* the tag based formats read through the image input buffer. */
+    image_io_reset(&imageIn, fp);
+
     switch(version) {
     case IMAGE_VERSION_0:
         info("Reading in version 0 image.");
@@ -115,6 +295,25 @@ int fileIn(FILE *fp)
         return fileIn_version_3(fp);
         break;
 
+    case IMAGE_VERSION_4:
+        info("Reading in version 4 image.");
+        return fileIn_version_4(fp);
+        break;
+
+    case IMAGE_VERSION_COMPRESSED:
+        info("Reading in compressed image.");
+        return fileIn_compressed(fp);
+        break;
+
+    case IMAGE_VERSION_DELTA:
+        if(!imageObjectCount) {
+            error("A delta image can only be read on top of a version 3 or 4 image!");
+        }
+
+        info("Reading in delta image.");
+        return fileIn_delta(fp);
+        break;
+
     default:
         error("Unsupported image file version: %u.", version);
         break;
@@ -124,17 +323,51 @@ int fileIn(FILE *fp)
 }
 
 
+int fileIn(FILE *fp)
+{
+    int count;
+
+    /* nothing is weak until the whole image is in */
+    holdWeakRoots(1);
+    count = fileIn_image(fp);
+    holdWeakRoots(0);
+
+    return count;
+}
+
+
 
 
 int fileOut(FILE *fp)
 {
-    return fileOut_object(fp, globalsObject);
+    int count;
+
+    /* deltas written after this are based on this image. */
+    trackingWrites = 1;
+    count = fileOut_object(fp, globalsObject);
+    trackingWrites = 0;
+
+    return count;
 }
 
 
 int fileOut_object(FILE *fp, struct object *obj)
 {
-    return fileOut_object_version_3(fp, obj);
+    if(imageCompressed) {
+        return fileOut_compressed(fp, obj);
+    }
+
+    return fileOut_object_image(fp, obj);
+}
+
+
+static int fileOut_object_image(FILE *fp, struct object *obj)
+{
+    if(imageWriteVersion == IMAGE_VERSION_3) {
+        return fileOut_object_version_3(fp, obj);
+    }
+
+    return fileOut_object_version_4(fp, obj);
 }
 
 
@@ -326,8 +559,8 @@ int fileIn_version_1(FILE *fp)
 
 int fileIn_version_3(FILE *fp)
 {
-    struct object *specialSymbols = NULL;
-    struct object *startupClass = NULL;
+    int64_t start = time_usec();
+    int64_t elapsed;
 
     /* use the currently unused space for the indir pointers */
     if (inSpaceOne) {
@@ -343,13 +576,38 @@ int fileIn_version_3(FILE *fp)
     globalsObject = objectRead(fp);
     addStaticRoot(&globalsObject);
 
+    elapsed = time_usec() - start;
+
+    /* the object table is in the order the objects were read. */
+    resetTracking(indirArray, (size_t)indirtop);
+
     if(debugging) {
         printf("Globals: ");
         dumpDictKeys(globalsObject);
         printf("\n");
     }
 
-    /* fix up everything from globals. */
+    findCoreObjects();
+
+    info("Memory top %p", memoryTop);
+    info("Memory pointer %p", memoryPointer);
+
+    info("Read in %d objects, %" PRIu64 " bytes in %d usec (%d KB/s).", indirtop, image_io_read_total(), (int)elapsed, image_io_rate(image_io_read_total(), elapsed));
+
+    return indirtop;
+}
+
+
+
+
+
+/* find the special symbols and core classes of a freshly read image
+   through the globals object and register them as static roots. */
+
+void findCoreObjects(void)
+{
+    struct object *specialSymbols = NULL;
+
     info("Finding special symbols.");
     specialSymbols = lookupGlobal("specialSymbols");
 
@@ -404,27 +662,17 @@ int fileIn_version_3(FILE *fp)
 
     UndefinedClass = lookupGlobal("Undefined");
     addStaticRoot(&UndefinedClass);
-
-    info("Memory top %p", memoryTop);
-    info("Memory pointer %p", memoryPointer);
-
-    info("Read in %d objects.", indirtop);
-
-    return indirtop;
 }
 
 
 
 
-
 int fileOut_object_version_3(FILE *img, struct object *globs)
 {
-    /* use the currently unused space for the indir pointers */
-    if (inSpaceOne) {
-        indirArray = (struct object * *) spaceTwo;
-    } else {
-        indirArray = (struct object * *) spaceOne;
-    }
+    int64_t start = time_usec();
+    int64_t elapsed;
+
+    object_map_init(&writtenObjects, 4096);
     indirtop = 0;
 
     info("Writing out image version 3.");
@@ -433,7 +681,32 @@ int fileOut_object_version_3(FILE *img, struct object *globs)
     put_image_version(img, IMAGE_VERSION_3);
 
     /* write the main objects. */
+    image_io_reset(&imageOut, img);
     objectWrite(img, globs);
+    image_io_flush(&imageOut);
+
+    if(trackingWrites) {
+        struct object **order = malloc((size_t)(indirtop ? indirtop : 1) * sizeof(struct object *));
+        size_t i;
+
+        if(!order) {
+            error("Unable to allocate the written object table!");
+        }
+
+        for(i = 0; i < writtenObjects.capacity; i++) {
+            if(writtenObjects.keys[i]) {
+                order[writtenObjects.values[i]] = writtenObjects.keys[i];
+            }
+        }
+
+        resetTracking(order, (size_t)indirtop);
+        free(order);
+    }
+
+    object_map_free(&writtenObjects);
+
+    elapsed = time_usec() - start;
+    info("Wrote %d objects, %" PRIu64 " bytes in %d usec (%d KB/s).", indirtop, imageOut.total, (int)elapsed, image_io_rate(imageOut.total, elapsed));
 
     return indirtop;
 }
@@ -491,12 +764,12 @@ void writeTag(FILE * fp, int type, int val)
 
     if (tempSize) {
         /*write the tag byte */
-        fputc((type | tempSize | LST_LARGE_TAG_FLAG), fp);
+        put_byte(fp, (type | tempSize | LST_LARGE_TAG_FLAG));
 
         for (i = 0; i < tempSize; i++)
-            fputc((val >> (8 * i)), fp);
+            put_byte(fp, (val >> (8 * i)));
     } else {
-        fputc((type | val), fp);
+        put_byte(fp, (type | val));
     }
 }
 
@@ -505,27 +778,47 @@ void writeTag(FILE * fp, int type, int val)
 /**
 * objectWrite
 *
-* This routine writes an object to the output image file.  This is for a
-* version 1 image file.
+* This routine writes an object and everything reachable from it to the
+* output image file.  The object graph is walked depth first with an
+* explicit stack of partially written objects so that long chains do not
+* use up the C stack.  The order of the output is the same as the order
+* of a recursive walk: the tag, then the class, then the fields.
 */
 
 void objectWrite(FILE * fp, struct object *obj)
 {
-    int i;
-    int size;
-    int intVal;
-
-    if(!indirArray) {
-        indirArray = calloc(sizeof(struct object *), imageMaxNumberOfObjects);
-
-        if(!indirArray) {
-            error("Unable to allocate object mapping array!");
+    int base = imageStackTop;
+
+    objectWriteOne(fp, obj);
+
+    while (imageStackTop > base) {
+        struct image_frame *frame = &imageStack[imageStackTop - 1];
+        struct object *child;
+
+        if (frame->next < 0) {
+            child = frame->obj->class;
+            frame->next = 0;
+        } else if (!IS_BINOBJ(frame->obj) && frame->next < (int)SIZE(frame->obj)) {
+            child = frame->obj->data[frame->next++];
+        } else {
+            imageStackTop--;
+            continue;
         }
-    }
 
-    if (indirtop > imageMaxNumberOfObjects) {
-        error("objectWrite(): too many indirect objects.");
+        objectWriteOne(fp, child);
     }
+}
+
+
+
+/* write the tag and any bytes of one object.  Objects with a class and
+fields still to write are pushed on the image stack. */
+
+static void objectWriteOne(FILE * fp, struct object *obj)
+{
+    int size;
+    int intVal;
+    size_t index;
 
     /* check for illegal object */
     if (obj == NULL) {
@@ -546,48 +839,31 @@ void objectWrite(FILE * fp, struct object *obj)
     }
 
     /* see if already written */
-    for (i = 0; i < indirtop; i++)
-        if (obj == indirArray[i]) {
-            if (i == 0)
-                writeTag(fp, LST_NIL_TYPE, 0);
-            else {
-                writeTag(fp, LST_POBJ_TYPE, i);
-            }
-            return;
+    if (object_map_find(&writtenObjects, obj, &index)) {
+        if (index == 0)
+            writeTag(fp, LST_NIL_TYPE, 0);
+        else {
+            writeTag(fp, LST_POBJ_TYPE, (int)index);
         }
+        return;
+    }
 
     /* not written, do it now */
-    indirArray[indirtop++] = obj;
-
-    /* byte objects */
-    if (IS_BINOBJ(obj)) {
-        struct byteObject *bobj = (struct byteObject *) obj;
+    object_map_add(&writtenObjects, obj, (size_t)indirtop++);
 
-        size = (int)SIZE(obj);
+    size = (int)SIZE(obj);
 
-        /* write the header tag */
+    if (IS_BINOBJ(obj)) {
+        /* byte objects, write the header tag and the bytes */
         writeTag(fp, LST_BARRAY_TYPE, size);
-
-        /*write out bytes */
-        for (i = 0; i < size; i++)
-            fputc(bobj->bytes[i], fp);
-
-        objectWrite(fp, obj->class);
-
-        return;
+        put_bytes(fp, bytePtr(obj), (size_t)size);
+    } else {
+        /* ordinary objects */
+        writeTag(fp, LST_OBJ_TYPE, size);
     }
 
-    /* ordinary objects */
-    size = SIZE(obj);
-
-    writeTag(fp, LST_OBJ_TYPE, size);
-
-    /* write the class first */
-    objectWrite(fp, obj->class);
-
-    /* write the instance variables of the object */
-    for (i = 0; i < size; i++)
-        objectWrite(fp, obj->data[i]);
+    /* the class and the instance variables come next. */
+    push_image_frame(obj);
 }
 
 
@@ -599,17 +875,48 @@ void objectWrite(FILE * fp, struct object *obj)
 *
 * Read in an object from the input image file.  Several kinds of object are
 * handled as special cases.  The routine readTag above does most of the work
-* of figuring out what type of object it is and how big it is.
+* of figuring out what type of object it is and how big it is.  Like
+* objectWrite, this keeps an explicit stack of objects whose class and
+* fields have not been read yet.
 */
 
 struct object *objectRead(FILE *fp)
+{
+    int base = imageStackTop;
+    struct object *result = objectReadOne(fp);
+
+    while (imageStackTop > base) {
+        struct image_frame *frame = &imageStack[imageStackTop - 1];
+        struct object **slot;
+
+        if (frame->next < 0) {
+            slot = &frame->obj->class;
+            frame->next = 0;
+        } else if (!IS_BINOBJ(frame->obj) && frame->next < (int)SIZE(frame->obj)) {
+            slot = &frame->obj->data[frame->next++];
+        } else {
+            imageStackTop--;
+            continue;
+        }
+
+        /* the slot is in the heap, so it stays put if the stack grows. */
+        *slot = objectReadOne(fp);
+    }
+
+    return result;
+}
+
+
+
+/* read the tag and any bytes of one object.  New objects whose class and
+fields are still to come are pushed on the image stack. */
+
+static struct object *objectReadOne(FILE *fp)
 {
     int type;
     int size;
     int val;
-    int i;
     struct object *newObj=(struct object *)0;
-    struct byteObject *bnewObj;
 
     /* get the tag header for the object, this has a type and value */
     readTag(fp,&type,&val);
@@ -624,12 +931,7 @@ struct object *objectRead(FILE *fp)
         size = val;
         newObj = gcalloc(size);
         indirArray[indirtop++] = newObj;
-        newObj->class = objectRead(fp);
-
-        /* get object field values. */
-        for (i = 0; i < size; i++) {
-            newObj->data[i] = objectRead(fp);
-        }
+        push_image_frame(newObj);
 
         break;
 
@@ -643,16 +945,10 @@ struct object *objectRead(FILE *fp)
 
     case LST_BARRAY_TYPE:   /* byte arrays */
         size = val;
-//        newObj = staticIAllocate(size);
         newObj = gcialloc(size);
         indirArray[indirtop++] = newObj;
-        bnewObj = (struct byteObject *) newObj;
-        for (i = 0; i < size; i++) {
-            /* FIXME check for EOF! */
-            bnewObj->bytes[i] = (uint8_t)get_byte(fp);
-        }
-
-        bnewObj->class = objectRead(fp);
+        get_bytes(fp, bytePtr(newObj), (size_t)size);
+        push_image_frame(newObj);
         break;
 
     case LST_POBJ_TYPE: /* previous object */
@@ -677,17 +973,146 @@ struct object *objectRead(FILE *fp)
 }
 
 
+
+static void push_image_frame(struct object *obj)
+{
+    if (imageStackTop >= imageStackSize) {
+        imageStackSize = imageStackSize ? imageStackSize * 2 : 1024;
+        imageStack = realloc(imageStack, (size_t)imageStackSize * sizeof(struct image_frame));
+
+        if (!imageStack) {
+            error("Unable to grow the image stack to %d entries!", imageStackSize);
+        }
+    }
+
+    imageStack[imageStackTop].obj = obj;
+    imageStack[imageStackTop].next = -1;
+    imageStackTop++;
+}
+
+
+
+/* buffered image file input and output */
+
+static void image_io_reset(struct image_io *io, FILE *fp)
+{
+    io->fp = fp;
+    io->pos = 0;
+    io->len = 0;
+    io->total = 0;
+}
+
+
+static void image_io_flush(struct image_io *io)
+{
+    if (io->pos && fwrite(io->data, 1, io->pos, io->fp) != io->pos) {
+        error("Unable to write image file!");
+    }
+
+    io->total += io->pos;
+    io->pos = 0;
+}
+
+
+static void put_byte(FILE *fp, int b)
+{
+    (void)fp;
+
+    if (imageOut.pos >= IMAGE_IO_BUFFER_SIZE) {
+        image_io_flush(&imageOut);
+    }
+
+    imageOut.data[imageOut.pos++] = (uint8_t)b;
+}
+
+
+static void put_bytes(FILE *fp, const uint8_t *bytes, size_t count)
+{
+    (void)fp;
+
+    while (count > 0) {
+        size_t chunk;
+
+        if (imageOut.pos >= IMAGE_IO_BUFFER_SIZE) {
+            image_io_flush(&imageOut);
+        }
+
+        chunk = IMAGE_IO_BUFFER_SIZE - imageOut.pos;
+        if (chunk > count) {
+            chunk = count;
+        }
+
+        memcpy(imageOut.data + imageOut.pos, bytes, chunk);
+        imageOut.pos += chunk;
+        bytes += chunk;
+        count -= chunk;
+    }
+}
+
+
+/* refill the input buffer, returns the number of bytes available. */
+static size_t image_io_fill(struct image_io *io)
+{
+    if (io->pos >= io->len) {
+        io->total += io->len;
+        io->len = fread(io->data, 1, IMAGE_IO_BUFFER_SIZE, io->fp);
+        io->pos = 0;
+    }
+
+    return io->len - io->pos;
+}
+
+
 static int get_byte(FILE *fp)
 {
-    static int offset = 0;
-    int inByte;
+    (void)fp;
+
+    if (imageIn.pos >= imageIn.len && !image_io_fill(&imageIn)) {
+        return EOF;
+    }
+
+    return imageIn.data[imageIn.pos++];
+}
+
+
+static void get_bytes(FILE *fp, uint8_t *bytes, size_t count)
+{
+    (void)fp;
+
+    while (count > 0) {
+        size_t chunk = image_io_fill(&imageIn);
 
-    inByte = fgetc(fp);
-    offset++;
+        if (!chunk) {
+            error("Unexpected EOF reading image file: reading %zu bytes of a byte array.", count);
+        }
+
+        if (chunk > count) {
+            chunk = count;
+        }
+
+        memcpy(bytes, imageIn.data + imageIn.pos, chunk);
+        imageIn.pos += chunk;
+        bytes += chunk;
+        count -= chunk;
+    }
+}
+
+
+/* bytes read so far, including the current buffer. */
+static uint64_t image_io_read_total(void)
+{
+    return imageIn.total + imageIn.pos;
+}
 
-    //fprintf(stderr, "%06d: %u (%x)\n", offset, inByte, inByte);
 
-    return inByte;
+/* rate in KB per second */
+static int image_io_rate(uint64_t bytes, int64_t usec)
+{
+    if (usec < 1) {
+        usec = 1;
+    }
+
+    return (int)((bytes * 1000000 / (uint64_t)usec) / 1024);
 }
 
 
@@ -1024,6 +1449,2126 @@ struct object *object_fix_up(struct object *obj, int64_t offset)
 
 
 
+/*
+ * Version 4 Image
+ *
+ * A version 4 image is a snapshot of the heap reachable from the globals
+ * object, laid out exactly as the objects sit in memory, followed by a
+ * relocation table.  Pointers in the snapshot are stored as byte offsets
+ * from the start of the heap data and the relocation table lists the cell
+ * index of every pointer cell.  Loading is a single read into the current
+ * space and one linear pass over the relocation table.
+ *
+ * The snapshot uses the native word size and byte order.  Version 3 is
+ * still the portable format.
+ */
+
+struct image_layout {
+    struct object_map map;
+    struct object **objects;
+    uint64_t *offsets;
+    size_t count;
+    size_t capacity;
+};
+
+/* buffered output of image cells */
+#define IMAGE_CELL_BUFFER_SIZE (4096)
+
+struct cell_buffer {
+    FILE *fp;
+    size_t top;
+    uintptr_t cells[IMAGE_CELL_BUFFER_SIZE];
+};
+
+
+
+/* number of cells including the header and class. */
+static uint64_t object_cells(struct object *obj)
+{
+    if(IS_BINOBJ(obj)) {
+        return (uint64_t)TO_WORDS(SIZE(obj)) + 2;
+    }
+
+    return (uint64_t)SIZE(obj) + 2;
+}
+
+
+static void layout_add(struct image_layout *layout, struct object *obj)
+{
+    size_t index;
+
+    if(obj == NULL || IS_SMALLINT(obj)) {
+        return;
+    }
+
+    if(object_map_find(&layout->map, obj, &index)) {
+        return;
+    }
+
+    if(layout->count >= layout->capacity) {
+        layout->capacity = layout->capacity ? layout->capacity * 2 : 4096;
+        layout->objects = realloc(layout->objects, layout->capacity * sizeof(struct object *));
+        layout->offsets = realloc(layout->offsets, layout->capacity * sizeof(uint64_t));
+
+        if(!layout->objects || !layout->offsets) {
+            error("Unable to allocate image layout for %zu objects!", layout->capacity);
+        }
+    }
+
+    layout->objects[layout->count] = obj;
+    object_map_add(&layout->map, obj, layout->count);
+    layout->count++;
+}
+
+
+/* translate a pointer into its offset in the image. */
+static uintptr_t layout_pointer(struct image_layout *layout, struct object *obj)
+{
+    size_t index;
+
+    if(obj == NULL) {
+        obj = nilObject;
+    }
+
+    if(IS_SMALLINT(obj)) {
+        return (uintptr_t)obj;
+    }
+
+    if(!object_map_find(&layout->map, obj, &index)) {
+        error("Object %p is not in the image layout!", (void *)obj);
+    }
+
+    return (uintptr_t)(layout->offsets[index] * (uint64_t)BytesPerWord);
+}
+
+
+static void cell_buffer_flush(struct cell_buffer *buf)
+{
+    if(buf->top && fwrite(buf->cells, sizeof(uintptr_t), buf->top, buf->fp) != buf->top) {
+        error("Unable to write image data!");
+    }
+
+    buf->top = 0;
+}
+
+
+static void cell_buffer_put(struct cell_buffer *buf, uintptr_t cell)
+{
+    if(buf->top >= IMAGE_CELL_BUFFER_SIZE) {
+        cell_buffer_flush(buf);
+    }
+
+    buf->cells[buf->top++] = cell;
+}
+
+
+
+int fileOut_object_version_4(FILE *img, struct object *globs)
+{
+    struct image_layout layout;
+    struct image_header_v4 header;
+    struct cell_buffer *buf;
+    uint32_t *relocs;
+    uint64_t relocTop = 0;
+    uint64_t totalCells = 0;
+    uint64_t totalRelocs = 0;
+    size_t i;
+    int64_t start = time_usec();
+
+    info("Writing out image version 4.");
+
+    memset(&layout, 0, sizeof(layout));
+    object_map_init(&layout.map, 4096);
+
+    /* lay out everything reachable from the globals.  The object list is
+       the work queue, so this is a breadth first walk with no recursion. */
+    layout_add(&layout, globs);
+    layout_add(&layout, nilObject);
+
+    for(i = 0; i < layout.count; i++) {
+        struct object *obj = layout.objects[i];
+
+        layout.offsets[i] = totalCells;
+        totalCells += object_cells(obj);
+
+        layout_add(&layout, obj->class);
+        totalRelocs++;
+
+        if(!IS_BINOBJ(obj)) {
+            uint32_t size = SIZE(obj);
+            uint32_t j;
+
+            for(j = 0; j < size; j++) {
+                if(!IS_SMALLINT(obj->data[j])) {
+                    layout_add(&layout, obj->data[j]);
+                    totalRelocs++;
+                }
+            }
+        }
+    }
+
+    if(totalCells >= UINT32_MAX) {
+        error("Image of %" PRIu64 " cells is too large for a version 4 image!", totalCells);
+    }
+
+    /* write the headers. */
+    put_image_version(img, IMAGE_VERSION_4);
+
+    memset(&header, 0, sizeof(header));
+    header.word_size = (uint32_t)BytesPerWord;
+    header.object_count = (uint64_t)layout.count;
+    header.cell_count = totalCells;
+    header.reloc_count = totalRelocs;
+    header.root_offset = layout.offsets[0];
+
+    if(fwrite(&header, sizeof(header), 1, img) != 1) {
+        error("Unable to write version 4 image header!");
+    }
+
+    /* write the objects, translating pointers to image offsets. */
+    buf = malloc(sizeof(*buf));
+    relocs = malloc((size_t)(totalRelocs ? totalRelocs : 1) * sizeof(uint32_t));
+
+    if(!buf || !relocs) {
+        error("Unable to allocate image output buffers!");
+    }
+
+    buf->fp = img;
+    buf->top = 0;
+
+    for(i = 0; i < layout.count; i++) {
+        struct object *obj = layout.objects[i];
+        uint32_t cell = (uint32_t)layout.offsets[i];
+        uint32_t size = SIZE(obj);
+        uint32_t j;
+
+        cell_buffer_put(buf, obj->header & ~(uintptr_t)(FLAG_GCDONE | FLAG_TRACKED));
+
+        cell_buffer_put(buf, layout_pointer(&layout, obj->class));
+        relocs[relocTop++] = cell + 1;
+
+        if(IS_BINOBJ(obj)) {
+            uintptr_t *words = (uintptr_t *)bytePtr(obj);
+
+            for(j = 0; j < (uint32_t)TO_WORDS(size); j++) {
+                cell_buffer_put(buf, words[j]);
+            }
+        } else {
+            for(j = 0; j < size; j++) {
+                cell_buffer_put(buf, layout_pointer(&layout, obj->data[j]));
+
+                if(!IS_SMALLINT(obj->data[j])) {
+                    relocs[relocTop++] = cell + 2 + j;
+                }
+            }
+        }
+    }
+
+    cell_buffer_flush(buf);
+
+    if(relocTop && fwrite(relocs, sizeof(uint32_t), (size_t)relocTop, img) != (size_t)relocTop) {
+        error("Unable to write version 4 relocation table!");
+    }
+
+    free(relocs);
+    free(buf);
+
+    if(trackingWrites) {
+        resetTracking(layout.objects, layout.count);
+    }
+
+    free(layout.objects);
+    free(layout.offsets);
+    object_map_free(&layout.map);
+
+    info("Wrote %zu objects, %" PRIu64 " cells and %" PRIu64 " relocations in %d usec (%d KB/s).", layout.count, totalCells, totalRelocs, (int)(time_usec() - start),
+         image_io_rate(totalCells * (uint64_t)BytesPerWord + totalRelocs * sizeof(uint32_t), time_usec() - start));
+
+    return (int)header.object_count;
+}
+
+
+
+int fileIn_version_4(FILE *fp)
+{
+    struct image_header_v4 header;
+    uint32_t relocs[IMAGE_CELL_BUFFER_SIZE];
+    uintptr_t *cells;
+    uint64_t freeCells;
+    uint64_t remaining;
+    int64_t start = time_usec();
+    int64_t loaded;
+
+    if(fread(&header, sizeof(header), 1, fp) != 1) {
+        error("Unable to read version 4 image header!");
+    }
+
+    if(header.word_size != (uint32_t)BytesPerWord) {
+        error("Image was written with %u byte words, this VM uses %d byte words!", header.word_size, BytesPerWord);
+    }
+
+    freeCells = (uint64_t)(((intptr_t)memoryPointer - (intptr_t)memoryBase)/BytesPerWord);
+
+    if(header.cell_count > freeCells) {
+        error("Image needs %" PRIu64 " cells but only %" PRIu64 " are free!  Use a larger dynamic memory size.", header.cell_count, freeCells);
+    }
+
+    /* read the heap straight into the top of the current space. */
+    memoryPointer = WORDSDOWN(memoryPointer, (intptr_t)header.cell_count);
+    cells = (uintptr_t *)memoryPointer;
+
+    if(fread(cells, (size_t)BytesPerWord, (size_t)header.cell_count, fp) != (size_t)header.cell_count) {
+        error("Unexpected EOF reading version 4 image data!");
+    }
+
+    loaded = time_usec();
+
+    /* one pass over the relocation table turns offsets into pointers. */
+    remaining = header.reloc_count;
+
+    while(remaining > 0) {
+        size_t count = remaining > IMAGE_CELL_BUFFER_SIZE ? IMAGE_CELL_BUFFER_SIZE : (size_t)remaining;
+        size_t i;
+
+        if(fread(relocs, sizeof(uint32_t), count, fp) != count) {
+            error("Unexpected EOF reading version 4 relocation table!");
+        }
+
+        for(i = 0; i < count; i++) {
+            uint32_t cell = relocs[i];
+
+            if(cell >= header.cell_count || cells[cell] >= header.cell_count * (uint64_t)BytesPerWord) {
+                error("Bad relocation entry %u in version 4 image!", cell);
+            }
+
+            cells[cell] += (uintptr_t)cells;
+        }
+
+        remaining -= count;
+    }
+
+    globalsObject = WORDSUP(cells, (intptr_t)header.root_offset);
+    addStaticRoot(&globalsObject);
+
+    /* the object table is in layout order. */
+    resetTracking(NULL, 0);
+    {
+        struct object *obj = (struct object *)cells;
+        uint64_t i;
+
+        for(i = 0; i < header.object_count; i++) {
+            trackObject(obj);
+            obj = WORDSUP(obj, (intptr_t)object_cells(obj));
+        }
+    }
+
+    findCoreObjects();
+
+    info("Read %" PRIu64 " cells in %d usec (%d KB/s), relocated %" PRIu64 " pointers in %d usec.", header.cell_count, (int)(loaded - start),
+         image_io_rate(header.cell_count * (uint64_t)BytesPerWord, loaded - start), header.reloc_count, (int)(time_usec() - loaded));
+
+    info("Read in %" PRIu64 " objects.", header.object_count);
+
+    return (int)header.object_count;
+}
+
+
+
+
+/*
+ * Delta Images
+ *
+ * The objects of the last image read or written are kept in a table in
+ * image order, so an object's index is its identity in that image and
+ * in any delta image based on it.  These objects are tracked: the first
+ * store into one clears its tracked flag and logs it as dirty.  Both
+ * tables are weak roots, an entry is cleared to NULL when the garbage
+ * collector finds nothing else refers to its object.  They are held
+ * while an image is read, as a delta can refer to base objects that
+ * nothing reached before it was read.
+ *
+ * A delta image holds the contents of the dirty objects and of any new
+ * objects reachable from them.  References are written as table indexes
+ * shifted left by one, SmallInts as themselves.  Reading a delta image
+ * allocates the new objects and then overwrites the contents of the
+ * objects it names.  A chain of deltas must be read in the order it was
+ * written on top of the same base image.
+ */
+
+static void trackObject(struct object *obj)
+{
+    if(imageObjectCount >= imageObjectCapacity) {
+        imageObjectCapacity = imageObjectCapacity ? imageObjectCapacity * 2 : 4096;
+        imageObjects = realloc(imageObjects, (size_t)imageObjectCapacity * sizeof(struct object *));
+
+        if(!imageObjects) {
+            error("Unable to grow the image object table to %d entries!", imageObjectCapacity);
+        }
+    }
+
+    if(!imageTrackingReady) {
+        addWeakRootVector(&imageObjects, &imageObjectCount);
+        addWeakRootVector(&dirtyObjects, &dirtyObjectCount);
+        imageTrackingReady = 1;
+    }
+
+    SET_TRACKED(obj);
+    imageObjects[imageObjectCount++] = obj;
+}
+
+
+/* start over tracking the objects of an image just read or written. */
+static void resetTracking(struct object **objects, size_t count)
+{
+    size_t i;
+
+    for(i = 0; i < (size_t)imageObjectCount; i++) {
+        if(imageObjects[i]) {
+            CLEAR_TRACKED(imageObjects[i]);
+        }
+    }
+
+    imageObjectCount = 0;
+    dirtyObjectCount = 0;
+    imageObjectsExchanged = 0;
+
+    for(i = 0; i < count; i++) {
+        trackObject(objects[i]);
+    }
+}
+
+
+/* called from the write barrier on the first store into a tracked object. */
+void markDirty(struct object *obj)
+{
+    CLEAR_TRACKED(obj);
+
+    if(dirtyObjectCount >= dirtyObjectCapacity) {
+        dirtyObjectCapacity = dirtyObjectCapacity ? dirtyObjectCapacity * 2 : 256;
+        dirtyObjects = realloc(dirtyObjects, (size_t)dirtyObjectCapacity * sizeof(struct object *));
+
+        if(!dirtyObjects) {
+            error("Unable to grow the dirty object log to %d entries!", dirtyObjectCapacity);
+        }
+    }
+
+    dirtyObjects[dirtyObjectCount++] = obj;
+}
+
+
+/* object identities were exchanged, so references anywhere could have changed. */
+void markAllDirty(void)
+{
+    imageObjectsExchanged = 1;
+}
+
+
+static void put_word(FILE *fp, uintptr_t word)
+{
+    put_bytes(fp, (const uint8_t *)&word, sizeof(word));
+}
+
+
+static uintptr_t get_word(FILE *fp)
+{
+    uintptr_t word;
+
+    get_bytes(fp, (uint8_t *)&word, sizeof(word));
+
+    return word;
+}
+
+
+static uintptr_t delta_ref(struct object_map *map, struct object *obj)
+{
+    size_t index;
+
+    if(obj == NULL) {
+        obj = nilObject;
+    }
+
+    if(IS_SMALLINT(obj)) {
+        return (uintptr_t)obj;
+    }
+
+    if(!object_map_find(map, obj, &index)) {
+        error("Object %p is not in the delta image!", (void *)obj);
+    }
+
+    return (uintptr_t)index << 1;
+}
+
+
+static struct object *delta_object(uintptr_t ref)
+{
+    if(ref & 1) {
+        return (struct object *)ref;
+    }
+
+    if((ref >> 1) >= (uintptr_t)imageObjectCount) {
+        error("Delta image refers to object %" PRIuPTR " but there are only %d!", ref >> 1, imageObjectCount);
+    }
+
+    if(!imageObjects[ref >> 1]) {
+        error("Delta image refers to object %" PRIuPTR " which has been collected!", ref >> 1);
+    }
+
+    return imageObjects[ref >> 1];
+}
+
+
+
+/*
+ * Write the objects changed since the last image was read or written.
+ * Returns the number of objects written or -1 if there is no image to
+ * write a delta against.
+ */
+
+int fileOutDelta(FILE *fp)
+{
+    struct image_header_delta header;
+    struct object_map map;
+    struct object **records = NULL;
+    size_t recordCount = 0;
+    size_t recordCapacity = 0;
+    size_t newStart;
+    size_t i;
+    int64_t start = time_usec();
+    int64_t elapsed;
+
+    if(!imageObjectCount || imageObjectsExchanged) {
+        info("No image to write a delta against, write a full image.");
+        return -1;
+    }
+
+    object_map_init(&map, 4096);
+
+    for(i = 0; i < (size_t)imageObjectCount; i++) {
+        if(imageObjects[i]) {
+            object_map_add(&map, imageObjects[i], i);
+        }
+    }
+
+    /* the dirty objects come first, then the new objects they reach. */
+    recordCapacity = (size_t)dirtyObjectCount + 1024;
+    records = malloc(recordCapacity * sizeof(struct object *));
+
+    if(!records) {
+        error("Unable to allocate the delta image record list!");
+    }
+
+    for(i = 0; i < (size_t)dirtyObjectCount; i++) {
+        if(dirtyObjects[i]) {
+            records[recordCount++] = dirtyObjects[i];
+        }
+    }
+
+    newStart = recordCount;
+
+    for(i = 0; i < recordCount; i++) {
+        struct object *obj = records[i];
+        uint32_t size = IS_BINOBJ(obj) ? 0 : SIZE(obj);
+        uint32_t j;
+        size_t index;
+
+        for(j = 0; j <= size; j++) {
+            struct object *ref = (j == 0) ? obj->class : obj->data[j - 1];
+
+            if(ref == NULL || IS_SMALLINT(ref) || object_map_find(&map, ref, &index)) {
+                continue;
+            }
+
+            if(recordCount >= recordCapacity) {
+                recordCapacity *= 2;
+                records = realloc(records, recordCapacity * sizeof(struct object *));
+
+                if(!records) {
+                    error("Unable to grow the delta image record list!");
+                }
+            }
+
+            object_map_add(&map, ref, (size_t)imageObjectCount + (recordCount - newStart));
+            records[recordCount++] = ref;
+        }
+    }
+
+    /* write the headers. */
+    put_image_version(fp, IMAGE_VERSION_DELTA);
+
+    memset(&header, 0, sizeof(header));
+    header.word_size = (uint32_t)BytesPerWord;
+    header.base_count = (uint64_t)imageObjectCount;
+    header.new_count = (uint64_t)(recordCount - newStart);
+    header.record_count = (uint64_t)recordCount;
+
+    if(fwrite(&header, sizeof(header), 1, fp) != 1) {
+        error("Unable to write delta image header!");
+    }
+
+    image_io_reset(&imageOut, fp);
+
+    /* the shapes of the new objects. */
+    for(i = newStart; i < recordCount; i++) {
+        put_word(fp, records[i]->header & (uintptr_t)FLAG_BIN);
+        put_word(fp, (uintptr_t)SIZE(records[i]));
+    }
+
+    /* the contents of every object. */
+    for(i = 0; i < recordCount; i++) {
+        struct object *obj = records[i];
+        uint32_t size = SIZE(obj);
+        uint32_t j;
+
+        put_word(fp, delta_ref(&map, obj));
+        put_word(fp, delta_ref(&map, obj->class));
+
+        if(IS_BINOBJ(obj)) {
+            put_bytes(fp, bytePtr(obj), (size_t)size);
+        } else {
+            for(j = 0; j < size; j++) {
+                put_word(fp, delta_ref(&map, obj->data[j]));
+            }
+        }
+    }
+
+    image_io_flush(&imageOut);
+
+    /* the image on disk now includes the delta, track from there. */
+    for(i = 0; i < (size_t)dirtyObjectCount; i++) {
+        if(dirtyObjects[i]) {
+            SET_TRACKED(dirtyObjects[i]);
+        }
+    }
+
+    dirtyObjectCount = 0;
+
+    for(i = newStart; i < recordCount; i++) {
+        trackObject(records[i]);
+    }
+
+    free(records);
+    object_map_free(&map);
+
+    elapsed = time_usec() - start;
+    info("Wrote delta of %" PRIu64 " changed and %" PRIu64 " new objects, %" PRIu64 " bytes in %d usec (%d KB/s).",
+         (uint64_t)newStart, header.new_count, imageOut.total, (int)elapsed, image_io_rate(imageOut.total, elapsed));
+
+    return (int)recordCount;
+}
+
+
+
+int fileIn_delta(FILE *fp)
+{
+    struct image_header_delta header;
+    uint64_t i;
+    int64_t start = time_usec();
+    int64_t elapsed;
+
+    if(fread(&header, sizeof(header), 1, fp) != 1) {
+        error("Unable to read delta image header!");
+    }
+
+    if(header.word_size != (uint32_t)BytesPerWord) {
+        error("Delta image was written with %u byte words, this VM uses %d byte words!", header.word_size, BytesPerWord);
+    }
+
+    if(header.base_count != (uint64_t)imageObjectCount) {
+        error("Delta image is based on an image with %" PRIu64 " objects, but the loaded image has %d!  Deltas must be read in order.", header.base_count, imageObjectCount);
+    }
+
+    image_io_reset(&imageIn, fp);
+
+    /* allocate the new objects, the object table keeps them safe from GC. */
+    for(i = 0; i < header.new_count; i++) {
+        uintptr_t flags = get_word(fp);
+        int size = (int)get_word(fp);
+        struct object *obj;
+
+        if(flags & (uintptr_t)FLAG_BIN) {
+            obj = gcialloc(size);
+        } else {
+            int j;
+
+            obj = gcalloc(size);
+
+            for(j = 0; j < size; j++) {
+                obj->data[j] = nilObject;
+            }
+        }
+
+        obj->class = nilObject;
+        trackObject(obj);
+    }
+
+    /* fill in the contents, nothing is allocated from here on. */
+    for(i = 0; i < header.record_count; i++) {
+        struct object *obj = delta_object(get_word(fp));
+        uint32_t size = SIZE(obj);
+        uint32_t j;
+
+        if(IS_SMALLINT(obj)) {
+            error("Delta image record %" PRIu64 " is not an object!", i);
+        }
+
+        obj->class = delta_object(get_word(fp));
+
+        if(IS_BINOBJ(obj)) {
+            get_bytes(fp, bytePtr(obj), (size_t)size);
+        } else {
+            for(j = 0; j < size; j++) {
+                obj->data[j] = delta_object(get_word(fp));
+            }
+        }
+    }
+
+    elapsed = time_usec() - start;
+    info("Read delta of %" PRIu64 " objects (%" PRIu64 " new), %" PRIu64 " bytes in %d usec (%d KB/s).",
+         header.record_count, header.new_count, image_io_read_total(), (int)elapsed, image_io_rate(image_io_read_total(), elapsed));
+
+    return (int)header.record_count;
+}
+
+
+
+
+/*
+ * Messages
+ *
+ * Isolates read the same image, so the objects in its table are the same
+ * objects in each of them and a message refers to them by index just as
+ * a delta image does.  Anything else the message reaches is copied: the
+ * message holds the shapes of the new objects and then their contents.
+ * Symbols made since the image was read arrive as copies.  The receiver
+ * puts its own Symbol in place of each copy it has one for, and adds the
+ * others to its symbol table, so a Symbol is identical to itself in
+ * every isolate it reaches.
+ */
+
+/* the index of each image object, rebuilt when objects have moved */
+static VM_LOCAL struct object_map messageBase;
+static VM_LOCAL int64_t messageBaseGC = -1;
+static VM_LOCAL int messageBaseCount = -1;
+
+/* the objects of the message being read, kept safe from GC */
+static VM_LOCAL struct object **messageObjects = NULL;
+static VM_LOCAL int messageObjectCount = 0;
+static VM_LOCAL int messageObjectCapacity = 0;
+static VM_LOCAL int messageObjectsReady = 0;
+
+/* set when a message names an image object collected here */
+static VM_LOCAL int messageObjectMissing = 0;
+
+
+static uintptr_t message_ref(struct object_map *copied, struct object *obj)
+{
+    size_t index;
+
+    if(obj == NULL) {
+        obj = nilObject;
+    }
+
+    if(IS_SMALLINT(obj)) {
+        return (uintptr_t)obj;
+    }
+
+    if(object_map_find(&messageBase, obj, &index)) {
+        return (uintptr_t)index << 1;
+    }
+
+    if(!object_map_find(copied, obj, &index)) {
+        error("Object %p is not in the message!", (void *)obj);
+    }
+
+    return (uintptr_t)(imageObjectCount + index) << 1;
+}
+
+
+static struct object *message_object(uintptr_t ref)
+{
+    uintptr_t index = ref >> 1;
+
+    if(ref & 1) {
+        return (struct object *)ref;
+    }
+
+    if(index < (uintptr_t)imageObjectCount) {
+        /* collected here though the sender still had it */
+        if(!imageObjects[index]) {
+            messageObjectMissing = 1;
+            return nilObject;
+        }
+
+        return imageObjects[index];
+    }
+
+    if(index - (uintptr_t)imageObjectCount >= (uintptr_t)messageObjectCount) {
+        error("Message refers to object %" PRIuPTR " but there are only %d!", index, imageObjectCount + messageObjectCount);
+    }
+
+    return messageObjects[index - (uintptr_t)imageObjectCount];
+}
+
+
+/* the receiver's own Symbol equal to sym, or NULL if it has none. */
+static struct object *message_symbol(struct object *sym)
+{
+    struct object *table;
+    struct object *node;
+
+    if(SIZE(SymbolClass) <= symbolsInSymbol) {
+        return NULL;
+    }
+
+    table = SymbolClass->data[symbolsInSymbol];
+
+    if(IS_SMALLINT(table) || IS_BINOBJ(table) || SIZE(table) <= rootInTree) {
+        return NULL;
+    }
+
+    node = treeFind(table->data[rootInTree], sym);
+
+    return (node && node != nilObject) ? node->data[valueInNode] : NULL;
+}
+
+
+/* a Symbol copy that the receiver has no Symbol of its own for. */
+static int message_new_symbol(struct object *obj)
+{
+    return obj->class == SymbolClass && IS_BINOBJ(obj) && !message_symbol(obj);
+}
+
+
+
+/*
+ * Write a message holding obj and everything it reaches.  Returns a
+ * malloc()ed buffer and sets *size, or returns NULL if there is no
+ * image to refer to.
+ */
+
+uint8_t *messageWrite(struct object *obj, size_t *size)
+{
+    struct image_header_delta header;
+    struct object_map copied;
+    struct object **records = NULL;
+    size_t recordCount = 0;
+    size_t recordCapacity = 1024;
+    size_t index;
+    size_t i;
+    char *data = NULL;
+    FILE *fp;
+
+    if(!imageObjectCount || imageObjectsExchanged) {
+        return NULL;
+    }
+
+    if(messageBaseGC != gc_count || messageBaseCount != imageObjectCount) {
+        if(messageBase.keys) {
+            object_map_free(&messageBase);
+        }
+
+        object_map_init(&messageBase, 4096);
+
+        for(i = 0; i < (size_t)imageObjectCount; i++) {
+            if(imageObjects[i]) {
+                object_map_add(&messageBase, imageObjects[i], i);
+            }
+        }
+
+        messageBaseGC = gc_count;
+        messageBaseCount = imageObjectCount;
+    }
+
+    /* find the objects to copy, nothing is allocated from here on. */
+    object_map_init(&copied, 256);
+    records = malloc(recordCapacity * sizeof(struct object *));
+
+    if(!records) {
+        error("Unable to allocate the message record list!");
+    }
+
+    if(!IS_SMALLINT(obj) && !object_map_find(&messageBase, obj, &index)) {
+        object_map_add(&copied, obj, recordCount);
+        records[recordCount++] = obj;
+    }
+
+    for(i = 0; i < recordCount; i++) {
+        struct object *rec = records[i];
+        uint32_t count = IS_BINOBJ(rec) ? 0 : SIZE(rec);
+        uint32_t j;
+
+        for(j = 0; j <= count; j++) {
+            struct object *ref = (j == 0) ? rec->class : rec->data[j - 1];
+
+            if(ref == NULL || IS_SMALLINT(ref) || object_map_find(&messageBase, ref, &index) || object_map_find(&copied, ref, &index)) {
+                continue;
+            }
+
+            if(recordCount >= recordCapacity) {
+                recordCapacity *= 2;
+                records = realloc(records, recordCapacity * sizeof(struct object *));
+
+                if(!records) {
+                    error("Unable to grow the message record list!");
+                }
+            }
+
+            object_map_add(&copied, ref, recordCount);
+            records[recordCount++] = ref;
+        }
+    }
+
+    if(!(fp = open_memstream(&data, size))) {
+        error("Unable to open a stream for a message!");
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.word_size = (uint32_t)BytesPerWord;
+    header.base_count = (uint64_t)imageObjectCount;
+    header.new_count = (uint64_t)recordCount;
+    header.record_count = (uint64_t)recordCount;
+
+    if(fwrite(&header, sizeof(header), 1, fp) != 1) {
+        error("Unable to write message header!");
+    }
+
+    image_io_reset(&imageOut, fp);
+
+    put_word(fp, message_ref(&copied, obj));
+
+    /* the shapes of the new objects. */
+    for(i = 0; i < recordCount; i++) {
+        put_word(fp, records[i]->header & (uintptr_t)FLAG_BIN);
+        put_word(fp, (uintptr_t)SIZE(records[i]));
+    }
+
+    /* and their contents. */
+    for(i = 0; i < recordCount; i++) {
+        struct object *rec = records[i];
+        uint32_t j;
+
+        put_word(fp, message_ref(&copied, rec->class));
+
+        if(IS_BINOBJ(rec)) {
+            put_bytes(fp, bytePtr(rec), (size_t)SIZE(rec));
+        } else {
+            for(j = 0; j < SIZE(rec); j++) {
+                put_word(fp, message_ref(&copied, rec->data[j]));
+            }
+        }
+    }
+
+    image_io_flush(&imageOut);
+    fclose(fp);
+
+    free(records);
+    object_map_free(&copied);
+
+    return (uint8_t *)data;
+}
+
+
+
+/*
+ * Read a message written by messageWrite() in another isolate.  Returns
+ * an Array of the object it holds and an Array of the Symbols in it that
+ * are still to be added to the symbol table, or NULL if it was written
+ * against another image.
+ */
+
+struct object *messageRead(const uint8_t *data, size_t size)
+{
+    struct image_header_delta header;
+    struct object *result, *symbols;
+    uintptr_t root;
+    uint64_t i;
+    int newSymbols = 0;
+    int j;
+    FILE *fp;
+
+    if(size < sizeof(header)) {
+        return NULL;
+    }
+
+    memcpy(&header, data, sizeof(header));
+
+    if(header.word_size != (uint32_t)BytesPerWord || header.base_count != (uint64_t)imageObjectCount || imageObjectsExchanged) {
+        return NULL;
+    }
+
+    if(!(fp = fmemopen((void *)(data + sizeof(header)), size - sizeof(header), "rb"))) {
+        error("Unable to open a stream for a message!");
+    }
+
+    image_io_reset(&imageIn, fp);
+
+    root = get_word(fp);
+
+    if(header.new_count > (uint64_t)messageObjectCapacity) {
+        messageObjectCapacity = (int)header.new_count;
+        messageObjects = realloc(messageObjects, (size_t)messageObjectCapacity * sizeof(struct object *));
+
+        if(!messageObjects) {
+            error("Unable to grow the message object table to %d entries!", messageObjectCapacity);
+        }
+    }
+
+    if(!messageObjectsReady) {
+        addRootVector(&messageObjects, &messageObjectCount);
+        messageObjectsReady = 1;
+    }
+
+    /* allocate the new objects. */
+    messageObjectCount = 0;
+
+    for(i = 0; i < header.new_count; i++) {
+        uintptr_t flags = get_word(fp);
+        int objSize = (int)get_word(fp);
+        struct object *obj;
+
+        if(flags & (uintptr_t)FLAG_BIN) {
+            obj = gcialloc(objSize);
+        } else {
+            int j;
+
+            obj = gcalloc(objSize);
+
+            for(j = 0; j < objSize; j++) {
+                obj->data[j] = nilObject;
+            }
+        }
+
+        obj->class = nilObject;
+        messageObjects[messageObjectCount++] = obj;
+    }
+
+    /*
+     * fill in the contents, nothing is allocated until the result.  The
+     * fields hold the references as written until the Symbols are known.
+     */
+    for(i = 0; i < header.new_count; i++) {
+        struct object *obj = messageObjects[i];
+        uint32_t k;
+
+        obj->class = message_object(get_word(fp));
+
+        if(IS_BINOBJ(obj)) {
+            get_bytes(fp, bytePtr(obj), (size_t)SIZE(obj));
+        } else {
+            for(k = 0; k < SIZE(obj); k++) {
+                obj->data[k] = (struct object *)get_word(fp);
+            }
+        }
+    }
+
+    /* the receiver's own Symbols stand in for their copies */
+    for(i = 0; i < header.new_count; i++) {
+        struct object *obj = messageObjects[i];
+        struct object *sym;
+
+        if(obj->class != SymbolClass || !IS_BINOBJ(obj)) {
+            continue;
+        }
+
+        if((sym = message_symbol(obj))) {
+            messageObjects[i] = sym;
+        } else {
+            newSymbols++;
+        }
+    }
+
+    for(i = 0; i < header.new_count; i++) {
+        struct object *obj = messageObjects[i];
+        uint32_t k;
+
+        if(!IS_BINOBJ(obj)) {
+            for(k = 0; k < SIZE(obj); k++) {
+                obj->data[k] = message_object((uintptr_t)obj->data[k]);
+            }
+        }
+    }
+
+    result = message_object(root);
+
+    fclose(fp);
+
+    if(messageObjectMissing) {
+        messageObjectMissing = 0;
+        messageObjectCount = 0;
+        return NULL;
+    }
+
+    /* the copies left are new here, the caller adds them to the table */
+    PUSH_ROOT(result);
+    symbols = gcalloc(newSymbols);
+    symbols->class = ArrayClass;
+
+    for(i = 0, j = 0; i < header.new_count && j < newSymbols; i++) {
+        if(message_new_symbol(messageObjects[i])) {
+            symbols->data[j++] = messageObjects[i];
+        }
+    }
+
+    while(j < newSymbols) {
+        symbols->data[j++] = nilObject;
+    }
+
+    messageObjectCount = 0;
+    PUSH_ROOT(symbols);
+    result = gcalloc(2);
+    result->class = ArrayClass;
+    result->data[1] = POP_ROOT();
+    result->data[0] = POP_ROOT();
+
+    return result;
+}
+
+
+
+/* free the tables of an isolate that is going away. */
+void imageRelease(void)
+{
+    free(imageObjects);
+    imageObjects = NULL;
+    imageObjectCount = imageObjectCapacity = 0;
+
+    free(dirtyObjects);
+    dirtyObjects = NULL;
+    dirtyObjectCount = dirtyObjectCapacity = 0;
+
+    free(messageObjects);
+    messageObjects = NULL;
+    messageObjectCount = messageObjectCapacity = 0;
+
+    if(messageBase.keys) {
+        object_map_free(&messageBase);
+    }
+
+    free(imageStack);
+    imageStack = NULL;
+    imageStackTop = imageStackSize = 0;
+
+    /* the root vectors go with the heap */
+    imageTrackingReady = 0;
+    messageObjectsReady = 0;
+    messageBaseGC = -1;
+}
+
+
+
+
+/*
+ * Compressed Images
+ *
+ * A compressed image wraps a version 3 or 4 image stream in blocks
+ * compressed with a small LZ77 codec that uses the LZ4 block format:
+ * each sequence is a token byte with the literal and match lengths,
+ * the literals, and a two byte offset back into the block.  Blocks are
+ * independent so they can be decompressed as the loader asks for more
+ * data.  Each block starts with its raw and packed sizes; a block that
+ * does not compress is stored as is, and a zero raw size ends the stream.
+ */
+
+#define LZ_BLOCK_SIZE (256 * 1024)
+#define LZ_HASH_BITS (14)
+#define LZ_MIN_MATCH (4)
+#define LZ_MAX_OFFSET (65535)
+#define LZ_LAST_LITERALS (5)
+#define LZ_MATCH_LIMIT (12)
+
+/* the worst case size of a block that does not compress at all. */
+#define LZ_PACKED_SIZE(raw) ((raw) + (raw) / 255 + 16)
+
+struct lz_stream {
+    FILE *fp;
+    uint8_t *raw;
+    uint8_t *packed;
+    uint32_t *hashTable;
+    size_t pos;
+    size_t len;
+    int eof;
+    uint64_t rawTotal;
+    uint64_t packedTotal;
+    int64_t codecTime;
+};
+
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+
+static uint8_t *lz_put_length(uint8_t *op, size_t len)
+{
+    while(len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+
+    *op++ = (uint8_t)len;
+
+    return op;
+}
+
+
+/* compress a block, returns the packed size or 0 if it does not fit in dstCap. */
+static size_t lz_compress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstCap, uint32_t *table)
+{
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t limit = srcSize > LZ_MATCH_LIMIT ? srcSize - LZ_MATCH_LIMIT : 0;
+    uint8_t *op = dst;
+    uint8_t *end = dst + dstCap;
+    size_t litLen;
+
+    memset(table, 0, sizeof(uint32_t) << LZ_HASH_BITS);
+
+    while(ip < limit) {
+        uint32_t seq = lz_read32(src + ip);
+        uint32_t h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+        size_t ref = table[h];
+        size_t matchLen;
+        uint8_t *token;
+
+        table[h] = (uint32_t)(ip + 1);
+
+        if(!ref || ip - (ref - 1) > LZ_MAX_OFFSET || lz_read32(src + ref - 1) != seq) {
+            ip++;
+            continue;
+        }
+
+        ref--;
+
+        /* extend the match, the last bytes are always literals. */
+        matchLen = LZ_MIN_MATCH;
+        while(ip + matchLen < srcSize - LZ_LAST_LITERALS && src[ref + matchLen] == src[ip + matchLen]) {
+            matchLen++;
+        }
+
+        litLen = ip - anchor;
+
+        if((size_t)(end - op) < litLen + litLen / 255 + matchLen / 255 + 8) {
+            return 0;
+        }
+
+        token = op++;
+        *token = (uint8_t)(((litLen >= 15 ? 15 : litLen) << 4) | (matchLen - LZ_MIN_MATCH >= 15 ? 15 : matchLen - LZ_MIN_MATCH));
+
+        if(litLen >= 15) {
+            op = lz_put_length(op, litLen - 15);
+        }
+
+        memcpy(op, src + anchor, litLen);
+        op += litLen;
+
+        *op++ = (uint8_t)((ip - ref) & 0xFF);
+        *op++ = (uint8_t)((ip - ref) >> 8);
+
+        if(matchLen - LZ_MIN_MATCH >= 15) {
+            op = lz_put_length(op, matchLen - LZ_MIN_MATCH - 15);
+        }
+
+        ip += matchLen;
+        anchor = ip;
+    }
+
+    /* the rest is a final run of literals. */
+    litLen = srcSize - anchor;
+
+    if((size_t)(end - op) < litLen + litLen / 255 + 2) {
+        return 0;
+    }
+
+    *op++ = (uint8_t)((litLen >= 15 ? 15 : litLen) << 4);
+
+    if(litLen >= 15) {
+        op = lz_put_length(op, litLen - 15);
+    }
+
+    memcpy(op, src + anchor, litLen);
+    op += litLen;
+
+    return (size_t)(op - dst);
+}
+
+
+/* copy len bytes, in 16 byte steps that may run past the end when wild is set. */
+static inline void lz_copy(uint8_t *dst, const uint8_t *src, size_t len, int wild)
+{
+    if(wild) {
+        uint8_t *end = dst + len;
+
+        do {
+            memcpy(dst, src, 16);
+            dst += 16;
+            src += 16;
+        } while(dst < end);
+    } else {
+        memcpy(dst, src, len);
+    }
+}
+
+
+/* decompress a block of exactly dstSize bytes, returns 0 on success. */
+static int lz_decompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstSize)
+{
+    const uint8_t *ip = src;
+    const uint8_t *ipEnd = src + srcSize;
+    uint8_t *op = dst;
+    uint8_t *opEnd = dst + dstSize;
+
+    while(ip < ipEnd) {
+        unsigned token = *ip++;
+        size_t litLen = token >> 4;
+        size_t matchLen = token & 15;
+        size_t offset;
+        uint8_t *match;
+
+        if(litLen == 15) {
+            unsigned b;
+
+            do {
+                if(ip >= ipEnd) {
+                    return -1;
+                }
+
+                b = *ip++;
+                litLen += b;
+            } while(b == 255);
+        }
+
+        if(litLen > (size_t)(ipEnd - ip) || litLen > (size_t)(opEnd - op)) {
+            return -1;
+        }
+
+        lz_copy(op, ip, litLen, (size_t)(ipEnd - ip) >= litLen + 16 && (size_t)(opEnd - op) >= litLen + 16);
+        ip += litLen;
+        op += litLen;
+
+        /* the last sequence has no match. */
+        if(ip == ipEnd) {
+            break;
+        }
+
+        if(ipEnd - ip < 2) {
+            return -1;
+        }
+
+        offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+
+        if(offset == 0 || offset > (size_t)(op - dst)) {
+            return -1;
+        }
+
+        if(matchLen == 15) {
+            unsigned b;
+
+            do {
+                if(ip >= ipEnd) {
+                    return -1;
+                }
+
+                b = *ip++;
+                matchLen += b;
+            } while(b == 255);
+        }
+
+        matchLen += LZ_MIN_MATCH;
+
+        if(matchLen > (size_t)(opEnd - op)) {
+            return -1;
+        }
+
+        match = op - offset;
+
+        if(offset >= matchLen || offset >= 16) {
+            lz_copy(op, match, matchLen, offset >= 16 && (size_t)(opEnd - op) >= matchLen + 16);
+            op += matchLen;
+        } else {
+            /* overlapping matches repeat the last offset bytes, copy the
+               repeated run in chunks that double each time. */
+            size_t run = offset;
+
+            while(matchLen) {
+                size_t chunk = run < matchLen ? run : matchLen;
+
+                memcpy(op, match, chunk);
+                op += chunk;
+                run += chunk;
+                matchLen -= chunk;
+            }
+        }
+    }
+
+    return (op == opEnd) ? 0 : -1;
+}
+
+
+static struct lz_stream *lz_stream_new(FILE *fp)
+{
+    struct lz_stream *lz = calloc(1, sizeof(*lz));
+
+    if(lz) {
+        lz->fp = fp;
+        lz->raw = malloc(LZ_BLOCK_SIZE);
+        lz->packed = malloc(LZ_PACKED_SIZE(LZ_BLOCK_SIZE));
+        lz->hashTable = malloc(sizeof(uint32_t) << LZ_HASH_BITS);
+    }
+
+    if(!lz || !lz->raw || !lz->packed || !lz->hashTable) {
+        error("Unable to allocate compressed image buffers!");
+    }
+
+    return lz;
+}
+
+
+static void lz_stream_free(struct lz_stream *lz)
+{
+    free(lz->raw);
+    free(lz->packed);
+    free(lz->hashTable);
+    free(lz);
+}
+
+
+static void lz_write_block(struct lz_stream *lz)
+{
+    uint32_t sizes[2];
+    size_t packed;
+    const uint8_t *data;
+    int64_t start = time_usec();
+
+    packed = lz_compress(lz->raw, lz->len, lz->packed, LZ_PACKED_SIZE(LZ_BLOCK_SIZE), lz->hashTable);
+    lz->codecTime += time_usec() - start;
+
+    /* store the block as is if it did not get smaller. */
+    if(!packed || packed >= lz->len) {
+        packed = lz->len;
+        data = lz->raw;
+    } else {
+        data = lz->packed;
+    }
+
+    sizes[0] = (uint32_t)lz->len;
+    sizes[1] = (uint32_t)packed;
+
+    if(fwrite(sizes, sizeof(sizes), 1, lz->fp) != 1 || fwrite(data, 1, packed, lz->fp) != packed) {
+        error("Unable to write compressed image block!");
+    }
+
+    lz->rawTotal += lz->len;
+    lz->packedTotal += packed + sizeof(sizes);
+    lz->len = 0;
+}
+
+
+static ssize_t lz_cookie_write(void *cookie, const char *buf, size_t size)
+{
+    struct lz_stream *lz = cookie;
+    size_t done = 0;
+
+    while(done < size) {
+        size_t chunk = LZ_BLOCK_SIZE - lz->len;
+
+        if(chunk > size - done) {
+            chunk = size - done;
+        }
+
+        memcpy(lz->raw + lz->len, buf + done, chunk);
+        lz->len += chunk;
+        done += chunk;
+
+        if(lz->len == LZ_BLOCK_SIZE) {
+            lz_write_block(lz);
+        }
+    }
+
+    return (ssize_t)size;
+}
+
+
+static int lz_read_block(struct lz_stream *lz)
+{
+    uint32_t sizes[2];
+    int64_t start;
+
+    if(fread(sizes, sizeof(sizes), 1, lz->fp) != 1) {
+        error("Unexpected EOF reading compressed image block header!");
+    }
+
+    if(sizes[0] == 0) {
+        lz->eof = 1;
+        return 0;
+    }
+
+    if(sizes[0] > LZ_BLOCK_SIZE || sizes[1] > sizes[0]) {
+        error("Corrupt compressed image block, %u bytes packed into %u!", sizes[0], sizes[1]);
+    }
+
+    lz->packedTotal += sizes[1] + sizeof(sizes);
+    lz->rawTotal += sizes[0];
+    lz->pos = 0;
+    lz->len = sizes[0];
+
+    /* stored blocks go straight into the raw buffer. */
+    if(sizes[1] == sizes[0]) {
+        if(fread(lz->raw, 1, sizes[0], lz->fp) != sizes[0]) {
+            error("Unexpected EOF reading compressed image block!");
+        }
+
+        return 1;
+    }
+
+    if(fread(lz->packed, 1, sizes[1], lz->fp) != sizes[1]) {
+        error("Unexpected EOF reading compressed image block!");
+    }
+
+    start = time_usec();
+
+    if(lz_decompress(lz->packed, sizes[1], lz->raw, sizes[0])) {
+        error("Corrupt compressed image block!");
+    }
+
+    lz->codecTime += time_usec() - start;
+
+    return 1;
+}
+
+
+static ssize_t lz_cookie_read(void *cookie, char *buf, size_t size)
+{
+    struct lz_stream *lz = cookie;
+    size_t done = 0;
+
+    while(done < size) {
+        size_t chunk;
+
+        if(lz->pos >= lz->len && (lz->eof || !lz_read_block(lz))) {
+            break;
+        }
+
+        chunk = lz->len - lz->pos;
+        if(chunk > size - done) {
+            chunk = size - done;
+        }
+
+        memcpy(buf + done, lz->raw + lz->pos, chunk);
+        lz->pos += chunk;
+        done += chunk;
+    }
+
+    return (ssize_t)done;
+}
+
+
+static int lz_cookie_close(void *cookie)
+{
+    (void)cookie;
+
+    /* the stream is freed by whoever opened it. */
+    return 0;
+}
+
+
+
+static int fileIn_compressed(FILE *fp)
+{
+    cookie_io_functions_t io = { lz_cookie_read, NULL, NULL, lz_cookie_close };
+    struct lz_stream *lz;
+    FILE *inner;
+    int count;
+    int64_t start = time_usec();
+    int64_t elapsed;
+
+    if(imageDecompressing) {
+        error("Compressed image contains another compressed image!");
+    }
+
+    lz = lz_stream_new(fp);
+    if(!(inner = fopencookie(lz, "r", io))) {
+        error("Unable to open the compressed image stream!");
+    }
+
+    imageDecompressing = 1;
+    count = fileIn(inner);
+    imageDecompressing = 0;
+
+    elapsed = time_usec() - start;
+    info("Decompressed %" PRIu64 " bytes into %" PRIu64 " bytes in %d usec (%d KB/s), total load %d usec.",
+         lz->packedTotal, lz->rawTotal, (int)lz->codecTime, image_io_rate(lz->rawTotal, lz->codecTime), (int)elapsed);
+
+    fclose(inner);
+    lz_stream_free(lz);
+
+    /* saves from this image are compressed too. */
+    imageCompressed = 1;
+
+    return count;
+}
+
+
+static int fileOut_compressed(FILE *fp, struct object *obj)
+{
+    cookie_io_functions_t io = { NULL, lz_cookie_write, NULL, lz_cookie_close };
+    struct lz_stream *lz = lz_stream_new(fp);
+    uint32_t end[2] = { 0, 0 };
+    FILE *inner;
+    int count;
+
+    put_image_version(fp, IMAGE_VERSION_COMPRESSED);
+
+    if(!(inner = fopencookie(lz, "w", io))) {
+        error("Unable to open the compressed image stream!");
+    }
+
+    count = fileOut_object_image(inner, obj);
+
+    /* flush everything through the codec and mark the end. */
+    if(fclose(inner) != 0) {
+        error("Unable to write the compressed image!");
+    }
+
+    if(lz->len) {
+        lz_write_block(lz);
+    }
+
+    if(fwrite(end, sizeof(end), 1, fp) != 1) {
+        error("Unable to write compressed image end marker!");
+    }
+
+    info("Compressed %" PRIu64 " bytes into %" PRIu64 " bytes in %d usec (%d KB/s).",
+         lz->rawTotal, lz->packedTotal + sizeof(end), (int)lz->codecTime, image_io_rate(lz->rawTotal, lz->codecTime));
+
+    lz_stream_free(lz);
+
+    return count;
+}
+
+
+
+
+/*
+ * Tree Shaking
+ *
+ * fileOutShaken() writes an image holding only the classes and methods
+ * that can be reached from an entry method.  Reachability is worked out
+ * conservatively from the literals of the methods kept so far: every
+ * Symbol or String literal is taken as a selector that may be sent to
+ * any kept class and as the name of a global that may be looked up, and
+ * every class in a literal, and the class of every other literal, is
+ * kept along with its meta class and super classes.  A method is kept
+ * once its selector may be sent, which brings in its literals, until
+ * nothing changes.  The classes the VM uses directly are always kept.
+ * The source text of the kept methods is dropped.
+ *
+ * Selectors and class names built at run time are not seen, so code
+ * that needs them will find them missing in the written image.  Code
+ * compiled at run time, as a doIt, can send anything at all: once the
+ * Parser is kept, so is the whole protocol of the classes the VM uses
+ * directly and of their super classes.
+ *
+ * The method dictionaries and the globals are cut down in place, so
+ * this is the last thing done before the VM exits.
+ */
+
+struct shake_state {
+    struct object *classClass;
+    struct object *methodClass;
+    struct object_map literalsSeen;
+    struct object_map objectsSeen;
+    struct object_map classes;
+    struct object_map methods;
+    struct object_map selectors;
+    struct object **classList;
+    size_t classCount;
+    size_t classCapacity;
+    struct object **names;
+    size_t nameCount;
+    struct object **stack;
+    size_t stackTop;
+    size_t stackSize;
+    int changed;
+};
+
+/* classes the VM creates instances of or looks up by name. */
+static const char *shakeCoreClasses[] = {
+    "Array", "Block", "ByteArray", "Char", "Class", "Context", "Dictionary", "Integer",
+    "Method", "OrderedArray", "Process", "SmallInt", "String", "Symbol", "Undefined", NULL
+};
+
+
+static int shake_is_class(struct shake_state *st, struct object *obj)
+{
+    if(!obj || IS_SMALLINT(obj) || !obj->class || IS_SMALLINT(obj->class)) {
+        return 0;
+    }
+
+    /* meta classes are instances of Class, classes are instances of their meta class. */
+    return obj->class == st->classClass || obj->class->class == st->classClass;
+}
+
+
+static int shake_name_compare(const void *left, const void *right)
+{
+    struct object *l = *(struct object * const *)left;
+    struct object *r = *(struct object * const *)right;
+    size_t size = SIZE(l) < SIZE(r) ? SIZE(l) : SIZE(r);
+    int result = memcmp(bytePtr(l), bytePtr(r), size);
+
+    if(result) {
+        return result;
+    }
+
+    return (SIZE(l) > SIZE(r)) - (SIZE(l) < SIZE(r));
+}
+
+
+/* the selector Symbol with the given name, or NULL if no method has it. */
+static struct object *shake_find_selector(struct shake_state *st, const uint8_t *name, size_t size)
+{
+    size_t low = 0;
+    size_t high = st->nameCount;
+
+    while(low < high) {
+        size_t mid = (low + high) / 2;
+        struct object *sel = st->names[mid];
+        size_t common = SIZE(sel) < size ? SIZE(sel) : size;
+        int result = memcmp(bytePtr(sel), name, common);
+
+        if(!result) {
+            result = (SIZE(sel) > size) - (SIZE(sel) < size);
+        }
+
+        if(!result) {
+            return sel;
+        }
+
+        if(result < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void shake_scan(struct shake_state *st, struct object *obj, int literal);
+
+
+static void shake_keep_class(struct shake_state *st, struct object *cls)
+{
+    size_t ignored;
+    uint32_t i;
+
+    while(shake_is_class(st, cls) && !object_map_find(&st->classes, cls, &ignored)) {
+        if(st->classCount == st->classCapacity) {
+            st->classCapacity = st->classCapacity ? st->classCapacity * 2 : 256;
+            st->classList = realloc(st->classList, st->classCapacity * sizeof(struct object *));
+
+            if(!st->classList) {
+                error("Unable to allocate tree shaking class list!");
+            }
+        }
+
+        st->classList[st->classCount] = cls;
+        object_map_add(&st->classes, cls, st->classCount++);
+        st->changed = 1;
+
+        shake_keep_class(st, cls->class);
+
+        /* class variables hold objects whose classes have to stay. */
+        for(i = variablesInClass + 1; i < SIZE(cls); i++) {
+            shake_scan(st, cls->data[i], 0);
+        }
+
+        cls = cls->data[parentClassInClass];
+    }
+}
+
+
+/* a name in a literal may be a selector or a global looked up by name. */
+static void shake_name(struct shake_state *st, struct object *str)
+{
+    struct object *sel = shake_find_selector(st, bytePtr(str), SIZE(str));
+    struct object *global;
+    char name[256];
+    size_t ignored;
+
+    if(sel && !object_map_find(&st->selectors, sel, &ignored)) {
+        object_map_add(&st->selectors, sel, 0);
+        st->changed = 1;
+    }
+
+    if(SIZE(str) > 0 && SIZE(str) < sizeof(name)) {
+        memcpy(name, bytePtr(str), SIZE(str));
+        name[SIZE(str)] = 0;
+
+        global = dictLookup(globalsObject, name);
+        if(shake_is_class(st, global)) {
+            shake_keep_class(st, global);
+        }
+    }
+}
+
+
+/*
+ * Walk an object graph keeping the classes found in it.  Names are
+ * only taken as selectors and globals in method literals.
+ */
+
+static void shake_scan(struct shake_state *st, struct object *obj, int literal)
+{
+    struct object_map *seen = literal ? &st->literalsSeen : &st->objectsSeen;
+    size_t base = st->stackTop;
+    size_t ignored;
+    uint32_t i;
+
+    st->stack[st->stackTop++] = obj;
+
+    while(st->stackTop > base) {
+        obj = st->stack[--st->stackTop];
+
+        if(!obj || IS_SMALLINT(obj) || object_map_find(seen, obj, &ignored)) {
+            continue;
+        }
+
+        object_map_add(seen, obj, 0);
+
+        if(shake_is_class(st, obj)) {
+            shake_keep_class(st, obj);
+            continue;
+        }
+
+        /* methods are kept by their selectors, not by being referenced. */
+        if(obj->class == st->methodClass) {
+            continue;
+        }
+
+        shake_keep_class(st, obj->class);
+
+        if(literal && (obj->class == SymbolClass || obj->class == StringClass)) {
+            shake_name(st, obj);
+        }
+
+        if(IS_BINOBJ(obj)) {
+            continue;
+        }
+
+        if(st->stackTop + SIZE(obj) > st->stackSize) {
+            st->stackSize = (st->stackTop + SIZE(obj)) * 2;
+            st->stack = realloc(st->stack, st->stackSize * sizeof(struct object *));
+
+            if(!st->stack) {
+                error("Unable to allocate tree shaking stack!");
+            }
+        }
+
+        for(i = 0; i < SIZE(obj); i++) {
+            st->stack[st->stackTop++] = obj->data[i];
+        }
+    }
+}
+
+
+/* take every selector of a class, its meta class and their super classes as sent. */
+static void shake_keep_protocol(struct shake_state *st, struct object *cls)
+{
+    size_t ignored;
+    uint32_t i;
+    int meta;
+
+    for(; shake_is_class(st, cls); cls = cls->data[parentClassInClass]) {
+        struct object *side = cls;
+
+        for(meta = 0; meta < 2 && shake_is_class(st, side); meta++, side = side->class) {
+            struct object *dict = side->data[methodsInClass];
+            struct object *keys;
+
+            if(IS_SMALLINT(dict) || dict == nilObject) {
+                continue;
+            }
+
+            keys = dict->data[keysInDictionary];
+
+            for(i = 0; i < SIZE(keys); i++) {
+                if(!object_map_find(&st->selectors, keys->data[i], &ignored)) {
+                    object_map_add(&st->selectors, keys->data[i], 0);
+                    st->changed = 1;
+                }
+            }
+        }
+    }
+}
+
+
+static void shake_keep_method(struct shake_state *st, struct object *method)
+{
+    object_map_add(&st->methods, method, 0);
+    st->changed = 1;
+
+    shake_scan(st, method->data[literalsInMethod], 1);
+}
+
+
+/* keep the methods of a class whose selectors may be sent. */
+static void shake_methods(struct shake_state *st, struct object *cls)
+{
+    struct object *dict = cls->data[methodsInClass];
+    struct object *keys;
+    size_t ignored;
+    uint32_t i;
+
+    if(IS_SMALLINT(dict) || dict == nilObject) {
+        return;
+    }
+
+    keys = dict->data[keysInDictionary];
+
+    for(i = 0; i < SIZE(keys); i++) {
+        struct object *method = dict->data[valuesInDictionary]->data[i];
+
+        if(!object_map_find(&st->methods, method, &ignored)
+           && object_map_find(&st->selectors, keys->data[i], &ignored)) {
+            shake_keep_method(st, method);
+        }
+    }
+}
+
+
+/* collect every selector that some class has a method for, sorted by name. */
+static void shake_collect_selectors(struct shake_state *st)
+{
+    struct object *globalKeys = globalsObject->data[keysInDictionary];
+    struct object *globalValues = globalsObject->data[valuesInDictionary];
+    size_t capacity = 0;
+    size_t i, j;
+
+    for(i = 0; i < SIZE(globalKeys); i++) {
+        struct object *cls = globalValues->data[i];
+        int meta;
+
+        for(meta = 0; meta < 2 && shake_is_class(st, cls); meta++, cls = cls->class) {
+            struct object *dict = cls->data[methodsInClass];
+            struct object *keys;
+
+            if(IS_SMALLINT(dict) || dict == nilObject) {
+                continue;
+            }
+
+            keys = dict->data[keysInDictionary];
+
+            for(j = 0; j < SIZE(keys); j++) {
+                if(st->nameCount == capacity) {
+                    capacity = capacity ? capacity * 2 : 1024;
+                    st->names = realloc(st->names, capacity * sizeof(struct object *));
+
+                    if(!st->names) {
+                        error("Unable to allocate tree shaking selector list!");
+                    }
+                }
+
+                st->names[st->nameCount++] = keys->data[j];
+            }
+        }
+    }
+
+    if(st->nameCount) {
+        qsort(st->names, st->nameCount, sizeof(struct object *), shake_name_compare);
+    }
+}
+
+
+/* replace the contents of a dictionary with the entries that are kept. */
+static void shake_dictionary(struct object *dict, const uint8_t *keep, uint32_t count)
+{
+    struct object *keys = dict->data[keysInDictionary];
+    struct object *values = dict->data[valuesInDictionary];
+    struct object *newKeys = gcalloc((int)count);
+    struct object *newValues = gcalloc((int)count);
+    uint32_t i, j;
+
+    newKeys->class = keys->class;
+    newValues->class = values->class;
+
+    for(i = 0, j = 0; i < SIZE(keys); i++) {
+        if(keep[i]) {
+            newKeys->data[j] = keys->data[i];
+            newValues->data[j] = values->data[i];
+            j++;
+        }
+    }
+
+    REMEMBER(dict);
+    dict->data[keysInDictionary] = newKeys;
+    dict->data[valuesInDictionary] = newValues;
+}
+
+
+int fileOutShaken(FILE *fp, struct object *entry)
+{
+    struct shake_state st;
+    struct object *globalValues;
+    struct object *parser;
+    int compiles = 0;
+    uint8_t *keep = NULL;
+    size_t keepSize = 0;
+    size_t words;
+    size_t methodCount = 0;
+    size_t ignored;
+    size_t i;
+    uint32_t j, count;
+    int64_t start;
+
+    /* nothing may move while the maps hold addresses, so start with all the room there is. */
+    PUSH_ROOT(entry);
+    do_gc();
+    entry = POP_ROOT();
+
+    start = time_usec();
+
+    memset(&st, 0, sizeof(st));
+    st.classClass = lookupGlobal("Class");
+    st.methodClass = lookupGlobal("Method");
+
+    object_map_init(&st.literalsSeen, 4096);
+    object_map_init(&st.objectsSeen, 4096);
+    object_map_init(&st.classes, 1024);
+    object_map_init(&st.methods, 4096);
+    object_map_init(&st.selectors, 4096);
+
+    st.stackSize = 1024;
+    st.stack = malloc(st.stackSize * sizeof(struct object *));
+    if(!st.stack) {
+        error("Unable to allocate tree shaking stack!");
+    }
+
+    shake_collect_selectors(&st);
+
+    /* the roots: the VM's classes, the other globals and the entry method. */
+    for(i = 0; shakeCoreClasses[i]; i++) {
+        shake_keep_class(&st, lookupGlobal((char *)shakeCoreClasses[i]));
+    }
+
+    globalValues = globalsObject->data[valuesInDictionary];
+    for(j = 0; j < SIZE(globalValues); j++) {
+        if(!shake_is_class(&st, globalValues->data[j]) && globalValues->data[j] != globalsObject) {
+            shake_scan(&st, globalValues->data[j], 1);
+        }
+    }
+
+    shake_keep_class(&st, entry->data[classInMethod]);
+    shake_name(&st, entry->data[nameInMethod]);
+    shake_keep_method(&st, entry);
+
+    parser = dictLookup(globalsObject, "Parser");
+
+    do {
+        st.changed = 0;
+
+        for(i = 0; i < st.classCount; i++) {
+            shake_methods(&st, st.classList[i]);
+        }
+
+        /* what a doIt sends can not be known, keep all of what it most likely reaches */
+        if(!compiles && shake_is_class(&st, parser) && object_map_find(&st.classes, parser, &ignored)) {
+            compiles = 1;
+
+            for(i = 0; shakeCoreClasses[i]; i++) {
+                shake_keep_protocol(&st, lookupGlobal((char *)shakeCoreClasses[i]));
+            }
+        }
+    } while(st.changed);
+
+    /* make sure the new dictionaries fit without a collection moving things. */
+    words = 2 * (SIZE(globalValues) + 2);
+    for(i = 0; i < st.classCount; i++) {
+        struct object *dict = st.classList[i]->data[methodsInClass];
+
+        if(!IS_SMALLINT(dict) && dict != nilObject) {
+            words += 2 * (SIZE(dict->data[keysInDictionary]) + 2);
+        }
+    }
+
+    if((size_t)((char *)memoryPointer - (char *)memoryBase) < words * BytesPerWord) {
+        error("Tree shaking needs %zu free words, use a larger dynamic space!", words);
+    }
+
+    for(i = 0; i < st.classCount; i++) {
+        struct object *dict = st.classList[i]->data[methodsInClass];
+        struct object *values;
+
+        if(IS_SMALLINT(dict) || dict == nilObject) {
+            continue;
+        }
+
+        values = dict->data[valuesInDictionary];
+
+        if(SIZE(values) > keepSize) {
+            keepSize = SIZE(values);
+            keep = realloc(keep, keepSize);
+            if(!keep) {
+                error("Unable to allocate tree shaking flags!");
+            }
+        }
+
+        for(j = 0, count = 0; j < SIZE(values); j++) {
+            keep[j] = (uint8_t)object_map_find(&st.methods, values->data[j], &ignored);
+
+            if(keep[j]) {
+                values->data[j]->data[textInMethod] = nilObject;
+                count++;
+            }
+        }
+
+        methodCount += count;
+        shake_dictionary(dict, keep, count);
+    }
+
+    if(SIZE(globalValues) > keepSize) {
+        keepSize = SIZE(globalValues);
+        keep = realloc(keep, keepSize);
+        if(!keep) {
+            error("Unable to allocate tree shaking flags!");
+        }
+    }
+
+    for(j = 0, count = 0; j < SIZE(globalValues); j++) {
+        struct object *value = globalValues->data[j];
+
+        keep[j] = (uint8_t)(!shake_is_class(&st, value) || object_map_find(&st.classes, value, &ignored));
+        count += keep[j];
+    }
+
+    info("Tree shaking kept %zu classes and %zu of %zu methods in %d usec.",
+         st.classCount, methodCount, st.nameCount, (int)(time_usec() - start));
+
+    shake_dictionary(globalsObject, keep, count);
+
+    free(keep);
+    free(st.stack);
+    free(st.names);
+    free(st.classList);
+    object_map_free(&st.literalsSeen);
+    object_map_free(&st.objectsSeen);
+    object_map_free(&st.classes);
+    object_map_free(&st.methods);
+    object_map_free(&st.selectors);
+
+    return fileOut(fp);
+}
+
+
+
+
 uint8_t get_image_version(FILE *fp)
 {
     uint8_t header[IMAGE_HEADER_SIZE];
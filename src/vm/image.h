@@ -13,6 +13,11 @@ extern int fileOut_object(FILE *fp, struct object *obj);
 
 extern int fileIn(FILE *fp);
 
+extern int fileOutDelta(FILE *fp);
+
+/* write only what can be reached from the entry method, see image.c */
+extern int fileOutShaken(FILE *fp, struct object *entry);
+
 /* used for bootstrap */
 //extern void objectWrite(FILE * fp, struct object *obj);
 
@@ -38,4 +43,60 @@ struct image_header {
 #define IMAGE_VERSION_1 (1)
 #define IMAGE_VERSION_2 (2)
 #define IMAGE_VERSION_3 (3)
+#define IMAGE_VERSION_4 (4)
+
+
+/*
+ * Version 4 images follow the 5 byte header with this one and
+ * then the raw heap cells and the relocation table.
+ */
+
+struct image_header_v4 {
+    uint32_t word_size;
+    uint32_t reserved;
+    uint64_t object_count;
+    uint64_t cell_count;
+    uint64_t reloc_count;
+    uint64_t root_offset;
+};
+
+/* the image version written by fileOut(), 3 or 4 */
+extern VM_LOCAL int imageWriteVersion;
+
+
+/*
+ * Delta images follow the 5 byte header with this one, then the flags
+ * and size of each new object and then the contents of every changed
+ * or new object.
+ */
+
+#define IMAGE_VERSION_DELTA (5)
+
+struct image_header_delta {
+    uint32_t word_size;
+    uint32_t reserved;
+    uint64_t base_count;
+    uint64_t new_count;
+    uint64_t record_count;
+};
+
+
+/*
+ * Compressed images follow the 5 byte header with blocks holding a
+ * version 3 or 4 image. Each block starts with its raw and packed
+ * sizes as uint32_t values and a zero raw size ends the image.
+ */
+
+#define IMAGE_VERSION_COMPRESSED (6)
+
+/* set to write compressed images, also set by reading one */
+extern VM_LOCAL int imageCompressed;
+
+
+/* copy objects between isolates, see image.c */
+extern uint8_t *messageWrite(struct object *obj, size_t *size);
+extern struct object *messageRead(const uint8_t *data, size_t size);
+
+/* free the tables of an isolate that is going away */
+extern void imageRelease(void);
 
@@ -23,12 +23,18 @@
 #include <stdio.h>
 #include <string.h> /* For bzero() */
 #include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
 #include "globals.h"
 #include "image.h"
 #include "interp.h"
 #include "memory.h"
 #include "prim.h"
 #include "err.h"
+#include "event.h"
 
 
 
@@ -43,7 +49,7 @@ typedef struct {
 
 #define METHOD_CACHE_SIZE (703)
 
-extern method_cache_entry cache[METHOD_CACHE_SIZE];
+extern VM_LOCAL method_cache_entry cache[METHOD_CACHE_SIZE];
 
 
 
@@ -52,10 +58,12 @@ extern method_cache_entry cache[METHOD_CACHE_SIZE];
     method cache for speeding method lookup
 */
 
-method_cache_entry cache[METHOD_CACHE_SIZE];
+VM_LOCAL method_cache_entry cache[METHOD_CACHE_SIZE];
 
-int64_t cache_hit = 0;
-int64_t cache_miss = 0;
+VM_LOCAL int64_t cache_hit = 0;
+VM_LOCAL int64_t cache_miss = 0;
+
+VM_LOCAL int64_t bytecode_count = 0;
 
 
 
@@ -81,7 +89,7 @@ void flushCache(void)
 #ifdef TRACE
 static void indent(struct object *ctx)
 {
-    static int oldlev = 0;
+    static VM_LOCAL int oldlev = 0;
     int lev = 0, x;
 
     while (ctx && (ctx != nilObject)) {
@@ -252,6 +260,8 @@ static int bulkReplace(struct object *dest, struct object *start,
         return(1);
     }
 
+    WRITE_BARRIER(dest);
+
     /*
      * If both source and dest are binary, do a bcopy()
      */
@@ -285,13 +295,649 @@ static int bulkReplace(struct object *dest, struct object *start,
     return(0);
 }
 
+/*
+ * Process scheduling
+ *
+ * Processes made ready to run wait on one list per priority.  The
+ * innermost execute() runs the active process and switches to the
+ * first process of the highest priority list when it waits on a
+ * Semaphore, yields, ends, or has run for a time slice while a process
+ * of at least its priority is ready.  A preempted process goes to the
+ * end of its list.  Processes are linked through their link field and
+ * their list field says which list they are on, so that they can be
+ * taken off it again.
+ *
+ * Processes from images older than the scheduler lack these fields;
+ * they can still be executed but not scheduled.
+ */
+
+#define LowestPriority 1
+#define HighestPriority 8
+#define DefaultPriority 4
+
+/*
+ * A time slice is measured in CPU time of the thread, so the timer does
+ * not go off while the VM sleeps.  Its signal is a real-time one that
+ * only the thread running the VM gets, and the VM takes it only if the
+ * program has left it alone.  Without the timer a slice is TimeSliceCount
+ * bytecodes, counted by interpret() at its check points.
+ */
+#define TimeSlice 4             /* ms */
+#define TimeSliceCount 10000
+#define SliceSignal (SIGRTMIN + 4)
+
+/* where interpret() ends the slice by count, never with the timer */
+#define SLICE_END(b) (sliceTimed ? INT64_MAX : (b) + TimeSliceCount)
+
+#define SCHEDULABLE(p) (!IS_SMALLINT(p) && SIZE(p) > listInProcess)
+
+VM_LOCAL struct object *activeProcess = NULL;
+
+static VM_LOCAL struct object *readyFirst[HighestPriority + 1];
+static VM_LOCAL struct object *readyLast[HighestPriority + 1];
+static VM_LOCAL int schedulerReady = 0;
+
+/* set when the active process can not go on and another must run */
+static VM_LOCAL int switchPending = 0;
+
+/* set when the active process has ended and has no state to save */
+static VM_LOCAL int activeTerminated = 0;
+
+VM_LOCAL volatile int interrupts = 0;
+
+/* the thread CPU time timer that ends time slices, see sliceStart() */
+static VM_LOCAL timer_t sliceTimer;
+static VM_LOCAL int sliceTimed = 0;
+
+/* set once the handler of SliceSignal is ours */
+static int sliceHandled = 0;
+
+/* the number of execute() calls running, and those with ticks */
+static VM_LOCAL int executeDepth = 0;
+static VM_LOCAL int tickedExecutes = 0;
+
+/* the counters when the last process was charged, see usageCharge() */
+static VM_LOCAL int64_t chargedBytecodes = 0;
+static VM_LOCAL int64_t chargedBytes = 0;
+static VM_LOCAL int64_t chargedTime = 0;
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+
+void interruptRequest(int reason)
+{
+    __atomic_or_fetch(&interrupts, reason, __ATOMIC_RELAXED);
+}
+
+
+volatile int *interruptFlag(void)
+{
+    return &interrupts;
+}
+
+
+static void sliceSignal(int sig)
+{
+    (void)sig;
+    interruptRequest(InterruptSlice);
+}
+
+
+/* take SliceSignal, unless the program has a use for it. */
+static void sliceInstall(void)
+{
+    struct sigaction action, old;
+
+    if (sigaction(SliceSignal, NULL, &old) != 0 ||
+            (old.sa_flags & SA_SIGINFO) || old.sa_handler != SIG_DFL) {
+        return;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sliceSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sliceHandled = sigaction(SliceSignal, &action, NULL) == 0;
+}
+
+
+/* have SliceSignal sent to this thread after each slice of its CPU time. */
+static void sliceStart(void)
+{
+    static pthread_once_t installed = PTHREAD_ONCE_INIT;
+    struct itimerspec slice;
+    struct sigevent ev;
+    sigset_t set;
+
+    pthread_once(&installed, sliceInstall);
+
+    sliceTimed = 0;
+    if (!sliceHandled) {
+        return;
+    }
+
+    /* isolates start with all signals blocked */
+    sigemptyset(&set);
+    sigaddset(&set, SliceSignal);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.sigev_notify = SIGEV_THREAD_ID;
+    ev.sigev_signo = SliceSignal;
+    ev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+
+    memset(&slice, 0, sizeof(slice));
+    slice.it_value.tv_nsec = slice.it_interval.tv_nsec = TimeSlice * 1000000L;
+
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &ev, &sliceTimer) == 0) {
+        if (timer_settime(sliceTimer, 0, &slice, NULL) == 0) {
+            sliceTimed = 1;
+        } else {
+            timer_delete(sliceTimer);
+        }
+    }
+}
+
+
+static void schedulerInit(void)
+{
+    int i;
+
+    for (i = 0; i <= HighestPriority; i++) {
+        readyFirst[i] = readyLast[i] = nilObject;
+        addStaticRoot(&readyFirst[i]);
+        addStaticRoot(&readyLast[i]);
+    }
+
+    addStaticRoot(&activeProcess);
+
+    sliceStart();
+
+    schedulerReady = 1;
+}
+
+
+/* forget the processes and methods of a heap that is going away. */
+void interpRelease(void)
+{
+    flushCache();
+    if (schedulerReady && sliceTimed) {
+        timer_delete(sliceTimer);
+    }
+    sliceTimed = 0;
+    schedulerReady = 0;
+    activeProcess = NULL;
+    interrupts = 0;
+    tickedExecutes = 0;
+    executeDepth = 0;
+}
+
+
+void interpForkChild(void)
+{
+    /* timers are not inherited */
+    if (schedulerReady) {
+        sliceStart();
+    }
+}
+
+
+/*
+ * Accounting
+ *
+ * What ran since the last charge is added to the usage of the active
+ * process when another one takes its place, when execute() returns and
+ * at the end of each time slice, which is also when its quotas are
+ * looked at.  Time the VM spends waiting for I/O is nobody's.
+ */
+
+/* the usage counters of a process, NULL if it has none. */
+static int64_t *usageOf(struct object *proc)
+{
+    struct object *usage;
+
+    if (!proc || IS_SMALLINT(proc) || SIZE(proc) <= usageInProcess) {
+        return NULL;
+    }
+
+    usage = proc->data[usageInProcess];
+    if (IS_SMALLINT(usage) || !IS_BINOBJ(usage) || SIZE(usage) < usageSize * sizeof(int64_t)) {
+        return NULL;
+    }
+
+    return (int64_t *)bytePtr(usage);
+}
+
+
+/* give a process its usage counters, which can move it. */
+static struct object *usageAttach(struct object *proc)
+{
+    struct object *usage;
+
+    if (IS_SMALLINT(proc) || SIZE(proc) <= usageInProcess ||
+            proc->data[usageInProcess] != nilObject || !isDynamicMemory(proc)) {
+        return proc;
+    }
+
+    PUSH_ROOT(proc);
+    usage = gcialloc(usageSize * (int)sizeof(int64_t));
+    usage->class = ByteArrayClass;
+    memset(bytePtr(usage), 0, usageSize * sizeof(int64_t));
+    proc = POP_ROOT();
+
+    WRITE_BARRIER(proc);
+    proc->data[usageInProcess] = usage;
+
+    return proc;
+}
+
+
+/* add what ran since the last charge to a process, NULL to drop it. */
+static void usageCharge(struct object *proc)
+{
+    int64_t *usage = usageOf(proc);
+    int64_t bytes = gcallocated();
+    int64_t now = time_usec();
+
+    if (usage) {
+        usage[bytecodesInUsage] += bytecode_count - chargedBytecodes;
+        usage[bytesInUsage] += bytes - chargedBytes;
+        usage[timeInUsage] += now - chargedTime;
+    }
+
+    chargedBytecodes = bytecode_count;
+    chargedBytes = bytes;
+    chargedTime = now;
+}
+
+
+/* the quota the active process has gone over, which is lifted, or NULL. */
+static const char *usageExceeded(void)
+{
+    static const char *names[] = { "bytecodes", "bytes allocated", "time" };
+    int64_t *usage = usageOf(activeProcess);
+    int i;
+
+    if (!usage) {
+        return NULL;
+    }
+
+    /* each quota is three counters after what it limits */
+    for (i = bytecodesInUsage; i <= timeInUsage; i++) {
+        if (usage[i + bytecodesQuotaInUsage] && usage[i] >= usage[i + bytecodesQuotaInUsage]) {
+            usage[i + bytecodesQuotaInUsage] = 0;
+            return names[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+int processUsage(struct object *proc, int64_t *bytecodes, int64_t *bytes, int64_t *usec)
+{
+    int64_t *usage;
+
+    if (executeDepth) {
+        usageCharge(activeProcess);
+    }
+
+    if (!(usage = usageOf(proc))) {
+        *bytecodes = *bytes = *usec = 0;
+        return 0;
+    }
+
+    *bytecodes = usage[bytecodesInUsage];
+    *bytes = usage[bytesInUsage];
+    *usec = usage[timeInUsage];
+
+    return 1;
+}
+
+
+struct object *processQuota(struct object *proc, int64_t bytecodes, int64_t bytes, int64_t usec)
+{
+    int64_t *usage;
+
+    if (executeDepth) {
+        usageCharge(activeProcess);
+    }
+
+    proc = usageAttach(proc);
+    if (!(usage = usageOf(proc))) {
+        return NULL;
+    }
+
+    usage[bytecodesQuotaInUsage] = bytecodes > 0 ? usage[bytecodesInUsage] + bytecodes : 0;
+    usage[bytesQuotaInUsage] = bytes > 0 ? usage[bytesInUsage] + bytes : 0;
+    usage[timeQuotaInUsage] = usec > 0 ? usage[timeInUsage] + usec : 0;
+
+    return proc;
+}
+
+
+static int processPriority(struct object *proc)
+{
+    struct object *priority = proc->data[priorityInProcess];
+    int value;
+
+    if (!IS_SMALLINT(priority)) {
+        return DefaultPriority;
+    }
+
+    value = integerValue(priority);
+
+    if (value < LowestPriority) {
+        return LowestPriority;
+    }
+
+    if (value > HighestPriority) {
+        return HighestPriority;
+    }
+
+    return value;
+}
+
+
+static void listAppend(struct object **first, struct object **last, struct object *proc, struct object *list)
+{
+    REMEMBER(proc);
+    REMEMBER(*last);
+
+    proc->data[linkInProcess] = nilObject;
+    proc->data[listInProcess] = list;
+
+    if (*last == nilObject) {
+        *first = proc;
+    } else {
+        (*last)->data[linkInProcess] = proc;
+    }
+
+    *last = proc;
+}
+
+
+static struct object *listTake(struct object **first, struct object **last)
+{
+    struct object *proc = *first;
+
+    if (proc == nilObject) {
+        return NULL;
+    }
+
+    *first = proc->data[linkInProcess];
+    if (*first == nilObject) {
+        *last = nilObject;
+    }
+
+    proc->data[linkInProcess] = nilObject;
+    proc->data[listInProcess] = nilObject;
+
+    return proc;
+}
+
+
+static void listRemove(struct object **first, struct object **last, struct object *proc)
+{
+    struct object *prev = nilObject;
+    struct object *cur = *first;
+
+    while (cur != nilObject && cur != proc) {
+        prev = cur;
+        cur = cur->data[linkInProcess];
+    }
+
+    if (cur == nilObject) {
+        return;
+    }
+
+    if (prev == nilObject) {
+        *first = proc->data[linkInProcess];
+    } else {
+        REMEMBER(prev);
+        prev->data[linkInProcess] = proc->data[linkInProcess];
+    }
+
+    if (*last == proc) {
+        *last = prev;
+    }
+
+    proc->data[linkInProcess] = nilObject;
+    proc->data[listInProcess] = nilObject;
+}
+
+
+/* put a process at the end of the ready list for its priority. */
+static void scheduleProcess(struct object *proc)
+{
+    int priority = processPriority(proc);
+
+    listAppend(&readyFirst[priority], &readyLast[priority], proc, newInteger(priority));
+}
+
+
+/* take a process off the ready list or Semaphore it is on, if any. */
+static void unscheduleProcess(struct object *proc)
+{
+    struct object *list = proc->data[listInProcess];
+
+    if (IS_SMALLINT(list)) {
+        listRemove(&readyFirst[integerValue(list)], &readyLast[integerValue(list)], proc);
+    } else if (list != nilObject) {
+        REMEMBER(list);
+        listRemove(&list->data[firstInSemaphore], &list->data[lastInSemaphore], proc);
+    }
+}
+
+
+/* the first process of the highest priority ready to run, or NULL. */
+static struct object *nextReadyProcess(void)
+{
+    struct object *proc;
+    int i;
+
+    for (i = HighestPriority; i >= LowestPriority; i--) {
+        if ((proc = listTake(&readyFirst[i], &readyLast[i]))) {
+            return proc;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* is a process of at least the given priority ready to run? */
+static int processReady(int priority)
+{
+    int i;
+
+    for (i = HighestPriority; i >= priority; i--) {
+        if (readyFirst[i] != nilObject) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* returns 1 if the active process has to wait for a signal. */
+static int semaphoreWait(struct object *sem)
+{
+    struct object *signals = sem->data[signalsInSemaphore];
+
+    if (IS_SMALLINT(signals) && integerValue(signals) > 0) {
+        sem->data[signalsInSemaphore] = newInteger(integerValue(signals) - 1);
+        return 0;
+    }
+
+    REMEMBER(sem);
+    listAppend(&sem->data[firstInSemaphore], &sem->data[lastInSemaphore], activeProcess, sem);
+
+    return 1;
+}
+
+
+/* returns 1 if the process it woke up should run before the active one. */
+static int semaphoreSignal(struct object *sem)
+{
+    struct object *signals = sem->data[signalsInSemaphore];
+    struct object *proc;
+
+    REMEMBER(sem);
+    proc = listTake(&sem->data[firstInSemaphore], &sem->data[lastInSemaphore]);
+
+    if (!proc) {
+        sem->data[signalsInSemaphore] = newInteger((IS_SMALLINT(signals) ? integerValue(signals) : 0) + 1);
+        return 0;
+    }
+
+    scheduleProcess(proc);
+
+    return SCHEDULABLE(activeProcess) && processPriority(proc) > processPriority(activeProcess);
+}
+
+
+/* used by the event loop to wake up processes waiting on I/O. */
+void signalSemaphore(struct object *sem)
+{
+    semaphoreSignal(sem);
+}
+
+
+/*
+ * Block>>ensure: links its ensure: block on the unwinds of the process
+ * and keeps the link before it in its mark temporary.  A ^ out of its
+ * receiver leaves the ensure: context behind without unlinking, so the
+ * VM sends Process>>unwindTo:answer: to run the blocks on the way.
+ */
+
+#define markInEnsure 1
+
+#define UNWINDING(p) (SIZE(p) > unwindsInProcess && (p)->data[unwindsInProcess] != nilObject)
+
+/* is sym spelled name? */
+static int symbolIs(struct object *sym, const char *name)
+{
+    size_t size = strlen(name);
+
+    return !IS_SMALLINT(sym) && SIZE(sym) == size && memcmp(bytePtr(sym), name, size) == 0;
+}
+
+
+/* the mark of the oldest ensure: left going from context to target, or NULL. */
+static struct object *unwindMark(struct object *context, struct object *target)
+{
+    struct object *mark = NULL, *method;
+
+    for (; context && context != nilObject && context != target;
+            context = context->data[previousContextInContext]) {
+        method = context->data[methodInContext];
+
+        if (symbolIs(method->data[nameInMethod], "ensure:") &&
+                symbolIs(method->data[classInMethod]->data[nameInClass], "Block")) {
+            mark = context->data[temporariesInContext]->data[markInEnsure];
+        }
+    }
+
+    return mark;
+}
+
+
+/* a process with one context to run method in, as the first thing a VM runs. */
+struct object *newRootProcess(struct object *method)
+{
+    struct object *aProcess, *aContext, *array;
+    int size, i;
+
+    PUSH_ROOT(method);
+
+    aProcess = gcalloc(processSize);
+    aProcess->class = lookupGlobal("Process");
+    for (i = 0; i < processSize; i++) {
+        aProcess->data[i] = nilObject;
+    }
+    PUSH_ROOT(aProcess);
+
+    /* the context, its stack and its temporaries, any of which can move the others */
+    aContext = gcalloc(contextSize);
+    aContext->class = ContextClass;
+    for (i = 0; i < contextSize; i++) {
+        aContext->data[i] = nilObject;
+    }
+    rootStack[rootTop - 1]->data[contextInProcess] = aContext;
+
+    size = integerValue(rootStack[rootTop - 2]->data[stackSizeInMethod]);
+    array = gcalloc(size);
+    array->class = ArrayClass;
+    for (i = 0; i < size; i++) {
+        array->data[i] = nilObject;
+    }
+    rootStack[rootTop - 1]->data[contextInProcess]->data[stackInContext] = array;
+
+    /* as many temporaries as the method has, which runs any method now */
+    size = integerValue(rootStack[rootTop - 2]->data[temporarySizeInMethod]);
+    array = gcalloc(size);
+    array->class = ArrayClass;
+    for (i = 0; i < size; i++) {
+        array->data[i] = nilObject;
+    }
+
+    aProcess = POP_ROOT();
+    method = POP_ROOT();
+    aContext = aProcess->data[contextInProcess];
+    aContext->data[temporariesInContext] = array;
+
+    /* no arguments */
+    aContext->data[argumentsInContext] = nilObject;
+    aContext->data[bytePointerInContext] = newInteger(0);
+    aContext->data[stackTopInContext] = newInteger(0);
+    aContext->data[previousContextInContext] = nilObject;
+    aContext->data[methodInContext] = method;
+
+    return aProcess;
+}
+
+
+/*
+ * The interpreter stores into the context it runs, its stack and its
+ * process without the write barrier, so while a region is open they are
+ * remembered whenever they start to run.  The ones that ran when the
+ * region was opened are reached from the roots, see regionOpen().
+ */
+#define REMEMBER_RUNNING() \
+    do { \
+        if (regionTop) { \
+            REMEMBER(activeProcess); \
+            REMEMBER(context); \
+            REMEMBER(stack); \
+        } \
+    } while (0)
+
+
+
+/*
+ * The bytecodes interpret() ran are counted in a local, which also ends
+ * the time slices when no timer does, and only added to bytecode_count
+ * where anything can look at it: at check points, around primitives and
+ * process switches, and on the way out.
+ */
+#define COUNT_BYTECODES() \
+    do { \
+        bytecode_count += bytecodes - counted; \
+        counted = bytecodes; \
+    } while (0)
+
 /* Code locations are extracted as VAL's */
 #define VAL (bp[bytePointer] | (bp[bytePointer+1] << 8))
 #define VALSIZE 2
 
-int execute(struct object *aProcess, int ticks)
+static int interpret(struct object *aProcess, int ticks)
 {
-    int low, high, x, stackTop, bytePointer;
+    int low, high, x, stackTop, bytePointer, pending, stop;
+    const char *exceeded;
     struct object *context, *method, *arguments, *temporaries,
             *instanceVariables, *literals, *stack,
             *returnedValue = nilObject, *messageSelector,
@@ -299,10 +945,32 @@ int execute(struct object *aProcess, int ticks)
     uint8_t *bp;
     int64_t l;
     int64_t *i64p;
+    int64_t bytecodes = 0, counted = 0, sliceEnd;
+    int homeRoot = rootTop;
+
+    if (!schedulerReady) {
+        schedulerInit();
+    }
+    sliceEnd = SLICE_END(0);
+
+    aProcess = usageAttach(aProcess);
 
     /* push process, so as to save it */
     rootStack[rootTop++] = aProcess;
 
+    /* the process runs now, unless it is waiting on a Semaphore */
+    activeProcess = aProcess;
+    switchPending = activeTerminated = 0;
+    if (SCHEDULABLE(aProcess)) {
+        if (IS_SMALLINT(aProcess->data[listInProcess])) {
+            unscheduleProcess(aProcess);
+        } else if (aProcess->data[listInProcess] != nilObject) {
+            /* its state was saved when it began to wait */
+            switchPending = activeTerminated = 1;
+            goto switchProcess;
+        }
+    }
+
     /* get current context information */
     context = aProcess->data[contextInProcess];
 
@@ -315,25 +983,14 @@ int execute(struct object *aProcess, int ticks)
     /* load stack */
     stack = context->data[stackInContext];
     stackTop = integerValue(context->data[stackTopInContext]);
+    REMEMBER_RUNNING();
 
     /* everything else can wait, as maybe won't be needed at all */
     temporaries = instanceVariables = arguments = literals = 0;
 
     for (;;) {
-        /*
-         * If we're running against a CPU tick count, stop execution
-         * when we expire the given number of ticks.
-         */
-        if (ticks && (--ticks == 0)) {
-            aProcess = rootStack[--rootTop];
-            aProcess->data[contextInProcess] = context;
-            aProcess->data[resultInProcess] = returnedValue;
-            context->data[bytePointerInContext] = newInteger(bytePointer);
-            context->data[stackTopInContext] = newInteger(stackTop);
-            return(ReturnTimeExpired);
-        }
-
-        /* Otherwise decode the instruction */
+        /* decode the instruction */
+        bytecodes++;
         low = (high = bp[bytePointer++] ) & 0x0F;
         high >>= 4;
         if (high == Extended) {
@@ -459,6 +1116,7 @@ int execute(struct object *aProcess, int ticks)
                     arguments->data[receiverInArguments];
                 /* don't pop stack, leave result there */
             }
+            WRITE_BARRIER(instanceVariables);
             instanceVariables->data[low] = stack->data[stackTop-1];
 
             /*
@@ -475,6 +1133,7 @@ int execute(struct object *aProcess, int ticks)
             if (! temporaries) {
                 temporaries = context->data[temporariesInContext];
             }
+            WRITE_BARRIER(temporaries);
             temporaries->data[low] = stack->data[stackTop-1];
             break;
 
@@ -540,12 +1199,14 @@ checkCache:
             /* see if we can optimize tail call */
             if (bp[bytePointer] == (DoSpecial * 16 + StackReturn)) {
                 high = 1;
-            } else if (bp[bytePointer] == (DoSpecial * 16 + BlockReturn)) {
+            } else if (bp[bytePointer] == (DoSpecial * 16 + BlockReturn) && !UNWINDING(activeProcess)) {
+                /* with ensure: blocks it may leave, it has to return itself */
                 high = 2;
             } else {
                 high = 0;
             }
 
+buildContext:
             /* build temporaries for new context */
             rootStack[rootTop++] = arguments;
             rootStack[rootTop++] = method;
@@ -626,6 +1287,11 @@ checkCache:
             // FIXME - why isn't this using bytePointer()?
             bp = (uint8_t *) (method->data[byteCodesInMethod]->data);
 
+            /* a check point, the new context holds all there is */
+            if (interrupts || bytecodes >= sliceEnd) {
+                goto handleInterrupts;
+            }
+
             /* now go execute new method */
             break;
 
@@ -773,6 +1439,7 @@ checkCache:
                     goto failPrimitive;
                 }
 
+                WRITE_BARRIER(returnedValue);
                 returnedValue->data[low]= stack->data[--stackTop];
                 /*
                  * If putting a non-static pointer
@@ -787,7 +1454,11 @@ checkCache:
             case 6:     /* new process execute */
                 low = integerValue(stack->data[--stackTop]);
                 op = stack->data[--stackTop];
+                rootStack[rootTop++] = activeProcess;
+                COUNT_BYTECODES();
                 low = execute(op, low);
+                activeProcess = rootStack[--rootTop];
+                switchPending = activeTerminated = 0;
 
                 /* return value as a SmallInt */
                 returnedValue = newInteger(low);
@@ -815,6 +1486,7 @@ checkCache:
                     stackTop -= (low+1);
                     goto failPrimitive;
                 }
+                REMEMBER(temporaries);
                 while (low >= 0) {
                     temporaries->data[high + low] =
                         stack->data[--stackTop];
@@ -827,6 +1499,7 @@ checkCache:
                                 literals = 0;
                 stack = context->data[stackInContext];
                 stackTop = 0;
+                REMEMBER_RUNNING();
                 method = context->data[methodInBlock];
                 bp = bytePtr(method->data[byteCodesInMethod]);
                 bytePointer = integerValue(
@@ -934,8 +1607,17 @@ checkCache:
 
             case 19:    /* error trap -- halt execution */
                 --rootTop; /* pop context */
+                if (activeProcess != rootStack[homeRoot]) {
+                    /* a forked process has no one to report to */
+                    printf("Backtrace:\n");
+                    backTrace(context);
+                    activeProcess->data[contextInProcess] = nilObject;
+                    activeTerminated = 1;
+                    goto switchProcess;
+                }
                 aProcess = rootStack[--rootTop];
                 aProcess->data[contextInProcess] = context;
+                COUNT_BYTECODES();
                 return(ReturnError);
 
             case 20:    /* byteArray allocation */
@@ -963,6 +1645,7 @@ checkCache:
                     stackTop -= 1;
                     goto failPrimitive;
                 }
+                WRITE_BARRIER(returnedValue);
                 bytePtr(returnedValue)[low] = (uint8_t)(uint32_t)integerValue(stack->data[--stackTop]);
                 break;
 
@@ -1048,6 +1731,7 @@ checkCache:
                     goto failPrimitive;
                 }
                 exchangeObjects(op, returnedValue, SIZE(op));
+                markAllDirty();
                 break;
 
             case 36:    /* bitOr: */
@@ -1140,6 +1824,90 @@ checkCache:
                 returnedValue = newInteger(x);
                 break;
 
+            case 114:   /* resume a process */
+                returnedValue = stack->data[--stackTop];
+                if (!SCHEDULABLE(returnedValue) || returnedValue == activeProcess ||
+                        returnedValue->data[contextInProcess] == nilObject ||
+                        returnedValue->data[listInProcess] != nilObject) {
+                    goto failPrimitive;
+                }
+                scheduleProcess(returnedValue);
+                if (SCHEDULABLE(activeProcess) &&
+                        processPriority(returnedValue) > processPriority(activeProcess)) {
+                    interruptRequest(InterruptSlice);
+                }
+                break;
+
+            case 115:   /* yield to processes of the same priority */
+                if (!SCHEDULABLE(activeProcess)) {
+                    goto failPrimitive;
+                }
+                if (processReady(processPriority(activeProcess))) {
+                    interruptRequest(InterruptSlice);
+                }
+                returnedValue = nilObject;
+                break;
+
+            case 116:   /* Semaphore wait */
+                returnedValue = stack->data[--stackTop];
+                if (IS_SMALLINT(returnedValue) || SIZE(returnedValue) < semaphoreSize ||
+                        !SCHEDULABLE(activeProcess)) {
+                    goto failPrimitive;
+                }
+                if (semaphoreWait(returnedValue)) {
+                    switchPending = 1;
+                    interruptRequest(InterruptSlice);
+                }
+                break;
+
+            case 117:   /* Semaphore signal */
+                returnedValue = stack->data[--stackTop];
+                if (IS_SMALLINT(returnedValue) || SIZE(returnedValue) < semaphoreSize) {
+                    goto failPrimitive;
+                }
+                if (semaphoreSignal(returnedValue)) {
+                    interruptRequest(InterruptSlice);
+                }
+                break;
+
+            case 118:   /* active process */
+                returnedValue = activeProcess;
+                break;
+
+            case 119:   /* terminate a process, or another one only once it ran aContext */
+                if (low == 2) {
+                    op = stack->data[--stackTop];
+                    returnedValue = stack->data[--stackTop];
+                    if (!SCHEDULABLE(returnedValue) || returnedValue == activeProcess ||
+                            returnedValue->data[contextInProcess] == nilObject || IS_SMALLINT(op)) {
+                        goto failPrimitive;
+                    }
+                    /* off whatever it waited on, it runs aContext and ends there */
+                    unscheduleProcess(returnedValue);
+                    WRITE_BARRIER(returnedValue);
+                    returnedValue->data[contextInProcess] = op;
+                    scheduleProcess(returnedValue);
+                    if (SCHEDULABLE(activeProcess) &&
+                            processPriority(returnedValue) > processPriority(activeProcess)) {
+                        interruptRequest(InterruptSlice);
+                    }
+                    break;
+                }
+                returnedValue = stack->data[--stackTop];
+                if (!SCHEDULABLE(returnedValue)) {
+                    goto failPrimitive;
+                }
+                returnedValue->data[contextInProcess] = nilObject;
+                if (returnedValue == activeProcess) {
+                    activeTerminated = 1;
+                    goto switchProcess;
+                }
+                unscheduleProcess(returnedValue);
+                if (returnedValue == rootStack[homeRoot]) {
+                    interruptRequest(InterruptSlice);
+                }
+                break;
+
             default:
                 /* pop arguments, try primitive */
                 rootStack[rootTop++] = stack;
@@ -1153,12 +1921,16 @@ checkCache:
                 {
                     int failed;
 
+                    COUNT_BYTECODES();
                     returnedValue = primitive(high, arguments, &failed);
+
+                    /* the cached arguments must not be the primitive's own */
+                    arguments = 0;
+
                     if (failed) {
                         goto failPrimitive;
                     }
                 }
-                arguments = 0;
                 break;
             }
 
@@ -1210,9 +1982,17 @@ doReturn:
                 context = context->data[previousContextInContext];
 doReturn2:
                 if ((context == 0) || (context == nilObject)) {
+                    if (switchPending || activeProcess != rootStack[homeRoot]) {
+                        activeProcess->data[contextInProcess] = nilObject;
+                        activeProcess->data[resultInProcess] = returnedValue;
+                        activeTerminated = 1;
+                        goto switchProcess;
+                    }
+
                     aProcess = rootStack[--rootTop];
                     aProcess->data[contextInProcess] = context;
                     aProcess->data[resultInProcess] = returnedValue;
+                    COUNT_BYTECODES();
                     return(ReturnReturned);
                 }
 
@@ -1220,14 +2000,43 @@ doReturn2:
 
                 stack = context->data[stackInContext];
                 stackTop = integerValue(context->data[stackTopInContext]);
+                REMEMBER_RUNNING();
                 stack->data[stackTop++] = returnedValue;
                 method = context->data[methodInContext];
                 bp = bytePtr(method->data[byteCodesInMethod]);
                 bytePointer = integerValue(context->data[bytePointerInContext]);
+
+                /* a check point, also the one after primitives */
+                if (interrupts || bytecodes >= sliceEnd) {
+                    goto handleInterrupts;
+                }
                 break;
 
             case BlockReturn:
                 returnedValue = stack->data[--stackTop];
+
+                /* the ensure: blocks of what it leaves run before it returns */
+                if (UNWINDING(activeProcess) &&
+                        (op = unwindMark(context, context->data[creatingContextInBlock]
+                                         ->data[previousContextInContext])) &&
+                        (method = dictLookup(CLASS(activeProcess)->data[methodsInClass], "unwindTo:answer:"))) {
+                    rootStack[rootTop++] = context;
+                    rootStack[rootTop++] = method;
+                    rootStack[rootTop++] = returnedValue;
+                    rootStack[rootTop++] = op;
+                    arguments = gcalloc(3);
+                    arguments->class = ArrayClass;
+                    arguments->data[0] = activeProcess;
+                    arguments->data[1] = rootStack[--rootTop];
+                    arguments->data[2] = returnedValue = rootStack[--rootTop];
+                    method = rootStack[--rootTop];
+                    context = rootStack[--rootTop];
+
+                    /* it answers the value to where the ^ goes */
+                    high = 2;
+                    goto buildContext;
+                }
+
                 context = context->data[creatingContextInBlock]
                           ->data[previousContextInContext];
                 goto doReturn2;
@@ -1243,27 +2052,33 @@ doReturn2:
 
             case Branch:
                 low = VAL;
-                bytePointer = low;
-                break;
+                goto takeBranch;
 
             case BranchIfTrue:
                 low = VAL;
                 returnedValue = stack->data[--stackTop];
                 if (returnedValue == trueObject) {
-                    bytePointer = low;
-                } else {
-                    bytePointer += VALSIZE;
+                    goto takeBranch;
                 }
+                bytePointer += VALSIZE;
                 break;
 
             case BranchIfFalse:
                 low = VAL;
                 returnedValue = stack->data[--stackTop];
                 if (returnedValue == falseObject) {
+                    goto takeBranch;
+                }
+                bytePointer += VALSIZE;
+                break;
+
+takeBranch:
+                /* backward branches are check points, every loop has one */
+                if (low < bytePointer && (interrupts || bytecodes >= sliceEnd)) {
                     bytePointer = low;
-                } else {
-                    bytePointer += VALSIZE;
+                    goto handleInterrupts;
                 }
+                bytePointer = low;
                 break;
 
             case SendToSuper:
@@ -1290,6 +2105,7 @@ doReturn2:
                 context->data[bytePointerInContext] =
                     newInteger(bytePointer);
                 context->data[stackTopInContext] = newInteger(stackTop);
+                COUNT_BYTECODES();
                 return(ReturnBreak);
 
             default:
@@ -1302,5 +2118,203 @@ doReturn2:
             error("invalid bytecode %d!", high);
             break;
         }
+
+        continue;
+
+handleInterrupts:
+        COUNT_BYTECODES();
+
+        /* the count bit stays for as long as some execute() counts */
+        pending = __atomic_fetch_and(&interrupts, InterruptCount, __ATOMIC_RELAXED);
+
+        stop = 0;
+        if ((pending & InterruptCount) && ticks && --ticks == 0) {
+            stop = ReturnTimeExpired;
+        }
+        if (bytecodes >= sliceEnd) {
+            sliceEnd = SLICE_END(bytecodes);
+            pending |= InterruptSlice;
+        }
+        if (pending & InterruptUser) {
+            stop = ReturnInterrupted;
+        }
+
+        /* stop where we are, to be executed again later */
+        if (stop) {
+            if (activeProcess != rootStack[homeRoot]) {
+                /* another process ran in its stead, keep that one ready */
+                activeProcess->data[contextInProcess] = context;
+                context->data[bytePointerInContext] = newInteger(bytePointer);
+                context->data[stackTopInContext] = newInteger(stackTop);
+                if (!switchPending) {
+                    scheduleProcess(activeProcess);
+                }
+
+                aProcess = rootStack[--rootTop];
+                if (SCHEDULABLE(aProcess) && IS_SMALLINT(aProcess->data[listInProcess])) {
+                    unscheduleProcess(aProcess);
+                }
+                return(stop);
+            }
+
+            aProcess = rootStack[--rootTop];
+            aProcess->data[contextInProcess] = context;
+            aProcess->data[resultInProcess] = returnedValue;
+            context->data[bytePointerInContext] = newInteger(bytePointer);
+            context->data[stackTopInContext] = newInteger(stackTop);
+            return(stop);
+        }
+
+        /* the heap ran low, everything we hold is reached from the context */
+        if (pending & InterruptGC) {
+            rootStack[rootTop++] = context;
+            do_gc();
+            context = rootStack[--rootTop];
+            method = context->data[methodInContext];
+            bp = bytePtr(method->data[byteCodesInMethod]);
+            stack = context->data[stackInContext];
+            arguments = temporaries = instanceVariables = literals = 0;
+            returnedValue = nilObject;
+        }
+
+        /* a process over its quota stops as if it had called error: */
+        if ((pending & InterruptSlice) && !switchPending) {
+            usageCharge(activeProcess);
+
+            if ((exceeded = usageExceeded())) {
+                printf("Quota exceeded: %s\n", exceeded);
+                if (activeProcess != rootStack[homeRoot]) {
+                    printf("Backtrace:\n");
+                    backTrace(context);
+                    activeProcess->data[contextInProcess] = nilObject;
+                    activeTerminated = 1;
+                    goto switchProcess;
+                }
+
+                aProcess = rootStack[--rootTop];
+                aProcess->data[contextInProcess] = context;
+                context->data[bytePointerInContext] = newInteger(bytePointer);
+                context->data[stackTopInContext] = newInteger(stackTop);
+                return(ReturnError);
+            }
+        }
+
+        /*
+         * Give another process the CPU if the active one can not go on
+         * or its time slice is used up.  Processes waiting on I/O become
+         * ready first.
+         */
+        if (pending & (InterruptSlice | InterruptPoll)) {
+            if (eventPending()) {
+                eventPoll(0);
+            }
+
+            if (switchPending || rootStack[homeRoot]->data[contextInProcess] == nilObject ||
+                    (SCHEDULABLE(activeProcess) &&
+                     processReady(processPriority(activeProcess) + !(pending & InterruptSlice)))) {
+switchProcess:
+                rootTop = homeRoot + 1;
+                COUNT_BYTECODES();
+                sliceEnd = SLICE_END(bytecodes);
+                usageCharge(activeProcess);
+                if (!activeTerminated) {
+                    activeProcess->data[contextInProcess] = context;
+                    context->data[bytePointerInContext] = newInteger(bytePointer);
+                    context->data[stackTopInContext] = newInteger(stackTop);
+                    if (!switchPending) {
+                        scheduleProcess(activeProcess);
+                    }
+                }
+                switchPending = activeTerminated = 0;
+
+                /* the process we were asked to run was terminated */
+                op = rootStack[homeRoot];
+                if (op->data[contextInProcess] == nilObject &&
+                        (!SCHEDULABLE(op) || op->data[listInProcess] == nilObject)) {
+                    rootTop = homeRoot;
+                    return(ReturnReturned);
+                }
+
+                /*
+                 * A process whose last act was to wait on a Semaphore
+                 * has no context left and ends once it is signaled.
+                 */
+                for (;;) {
+                    while ((op = nextReadyProcess()) && op->data[contextInProcess] == nilObject) {
+                        if (op == rootStack[homeRoot]) {
+                            rootTop = homeRoot;
+                            return(ReturnReturned);
+                        }
+                    }
+
+                    /* with nothing to run, sleep until I/O is ready */
+                    if (op || !eventPending() || (interrupts & InterruptUser)) {
+                        break;
+                    }
+                    eventPoll(-1);
+                }
+                usageCharge(NULL);
+
+                if (!op && (interrupts & InterruptUser)) {
+                    /* Ctrl-C while all wait, the home process stops waiting */
+                    __atomic_and_fetch(&interrupts, ~InterruptUser, __ATOMIC_RELAXED);
+                    if (SCHEDULABLE(rootStack[homeRoot])) {
+                        unscheduleProcess(rootStack[homeRoot]);
+                    }
+                    rootTop = homeRoot;
+                    return(ReturnInterrupted);
+                }
+                if (!op) {
+                    printf("All processes are waiting on a Semaphore\n");
+                    if (SCHEDULABLE(rootStack[homeRoot])) {
+                        unscheduleProcess(rootStack[homeRoot]);
+                    }
+                    rootTop = homeRoot;
+
+                    /* nothing is left to back trace if it was done anyway */
+                    if (rootStack[homeRoot]->data[contextInProcess] == nilObject) {
+                        return(ReturnReturned);
+                    }
+                    return(ReturnError);
+                }
+
+                activeProcess = op = usageAttach(op);
+                context = op->data[contextInProcess];
+                method = context->data[methodInContext];
+                bp = bytePtr(method->data[byteCodesInMethod]);
+                bytePointer = integerValue(context->data[bytePointerInContext]);
+                stack = context->data[stackInContext];
+                stackTop = integerValue(context->data[stackTopInContext]);
+                REMEMBER_RUNNING();
+                arguments = temporaries = instanceVariables = literals = 0;
+                __atomic_and_fetch(&interrupts, ~InterruptSlice, __ATOMIC_RELAXED);
+            }
+        }
     }
 }
+
+
+int execute(struct object *aProcess, int ticks)
+{
+    int result;
+
+    /* ticks are counted at every check point while any execute() counts */
+    if (ticks) {
+        tickedExecutes++;
+        interruptRequest(InterruptCount);
+    }
+
+    /* the caller's process is charged up to here, anything before is nobody's */
+    usageCharge(executeDepth++ ? activeProcess : NULL);
+
+    result = interpret(aProcess, ticks);
+
+    usageCharge(activeProcess);
+    executeDepth--;
+
+    if (ticks && --tickedExecutes == 0) {
+        __atomic_and_fetch(&interrupts, ~InterruptCount, __ATOMIC_RELAXED);
+    }
+
+    return result;
+}
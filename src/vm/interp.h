@@ -12,11 +12,53 @@
 //extern int64_t cache_hit;
 //extern int64_t cache_miss;
 
+/* ticks, if not 0, is the number of check points to run, see below */
 extern int execute(struct object *aProcess, int ticks);
+extern VM_LOCAL struct object *activeProcess;
+extern void signalSemaphore(struct object *sem);
 extern void flushCache(void);
+extern struct object *newRootProcess(struct object *method);
+extern void interpRelease(void);
 
-extern int64_t cache_hit;
-extern int64_t cache_miss;
+/* starts the time slices again in a forked child */
+extern void interpForkChild(void);
+
+
+/*
+ * The interpreter looks at interrupts only at its check points: when a
+ * method is entered, when a method or primitive returns and on backward
+ * branches, so every loop has one.  Anything that needs the interpreter
+ * to stop and look, a signal handler or another thread included, sets a
+ * bit with interruptRequest() or, for another thread's interpreter, an
+ * atomic or on the flag from interruptFlag().
+ */
+
+#define InterruptSlice 1    /* the time slice of the active process is over */
+#define InterruptPoll 2     /* I/O has completed or a message came in */
+#define InterruptGC 4       /* the heap ran low, collect garbage */
+#define InterruptUser 8     /* Ctrl-C, stop the innermost execute() */
+#define InterruptCount 16   /* count check points, see execute() */
+
+extern VM_LOCAL volatile int interrupts;
+
+/* safe to call from a signal handler */
+extern void interruptRequest(int reason);
+
+/* the flag of this thread's interpreter */
+extern volatile int *interruptFlag(void);
+
+/*
+ * What a Process has used so far: bytecodes run, bytes allocated and
+ * microseconds of wall time; 0 if it has never run.
+ */
+extern int processUsage(struct object *proc, int64_t *bytecodes, int64_t *bytes, int64_t *usec);
+
+/* limits on how much more it may use, 0 for none; answers proc, which can move */
+extern struct object *processQuota(struct object *proc, int64_t bytecodes, int64_t bytes, int64_t usec);
+
+extern VM_LOCAL int64_t bytecode_count;
+extern VM_LOCAL int64_t cache_hit;
+extern VM_LOCAL int64_t cache_miss;
 
 
 /*
@@ -65,4 +107,5 @@ extern int64_t cache_miss;
 #define ReturnReturned 4    /* Top level method returned */
 #define ReturnTimeExpired 5 /* Time quantum exhausted */
 #define ReturnBreak 6       /* Breakpoint instruction */
+#define ReturnInterrupted 7 /* Stopped by Ctrl-C */
 
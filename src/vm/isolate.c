@@ -0,0 +1,495 @@
+/*
+ * isolate.c
+ *	Isolated VMs on threads of their own
+ *
+ * An isolate reads the image into a heap of its own and runs its own
+ * interpreter on a thread of its own.  The state of the VM is thread
+ * local, so nothing in one heap is ever seen by another isolate and
+ * none of them takes a lock to run Smalltalk.
+ *
+ * What the isolates share is the table here, which holds the mailbox of
+ * each of them behind one lock.  A message is copied out of the heap of
+ * the sender by messageWrite() and into the heap of the receiver by
+ * messageRead(), so only bytes pass through the mailbox.  Each mailbox
+ * has a semaphore eventfd that is posted once per message, which the
+ * receiver waits on in its epoll set like on any other descriptor.
+ *
+ * Ids hold the slot of an isolate and how often the slot has been used,
+ * so an id is never reused for another isolate.  Each VM set up by main()
+ * or lstOpen() is an isolate too, the first of them is 0.  An isolate
+ * starts from the image of the VM that spawned it.  An error() in it ends
+ * only its own thread.
+ */
+
+#include <errno.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include "err.h"
+#include "event.h"
+#include "globals.h"
+#include "image.h"
+#include "interp.h"
+#include "memory.h"
+#include "prim.h"
+#include "isolate.h"
+
+#define ISOLATE_MAX 64
+
+struct message {
+    struct message *next;
+    uint8_t *data;
+    size_t size;
+};
+
+/* the image, its deltas, the memory sizes and settings isolates start with */
+struct origin {
+    int refs;
+    char *image;
+    char **deltas;
+    int deltaCount;
+    int staticSize;
+    int dynamicSize;
+    int writeVersion;
+    int uringDisabled;
+};
+
+struct isolate {
+    int used;
+    int id;
+    int uses;
+    int mailFd;
+    int pending;
+    volatile int *interrupts;   /* of its interpreter, once it runs */
+    struct message *first;
+    struct message *last;
+    struct origin *origin;
+};
+
+/* the table and every mailbox in it are guarded by isolateLock */
+static pthread_mutex_t isolateLock = PTHREAD_MUTEX_INITIALIZER;
+static struct isolate isolates[ISOLATE_MAX];
+
+/* the isolate running on this thread */
+static VM_LOCAL struct isolate *self = NULL;
+
+
+/* the isolate with this id, called with isolateLock held. */
+static struct isolate *isolateFind(int id)
+{
+    struct isolate *iso;
+
+    if (id < 0) {
+        return NULL;
+    }
+
+    iso = &isolates[id % ISOLATE_MAX];
+
+    return (iso->used && iso->id == id) ? iso : NULL;
+}
+
+
+/* add a message to a mailbox, called with isolateLock held. */
+static int isolatePost(struct isolate *iso, uint8_t *data, size_t size)
+{
+    struct message *msg = malloc(sizeof(*msg));
+    uint64_t one = 1;
+
+    if (!msg) {
+        return -1;
+    }
+
+    msg->next = NULL;
+    msg->data = data;
+    msg->size = size;
+
+    if (iso->last) {
+        iso->last->next = msg;
+    } else {
+        iso->first = msg;
+    }
+    iso->last = msg;
+    iso->pending++;
+
+    while (write(iso->mailFd, &one, sizeof(one)) == -1 && errno == EINTR)
+        ;
+
+    /* the receiver polls its mailbox at its next check point */
+    if (iso->interrupts) {
+        __atomic_or_fetch(iso->interrupts, InterruptPoll, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+
+/* a free slot from first on with a mailbox, called with isolateLock held. */
+static struct isolate *isolateClaim(int first)
+{
+    struct isolate *iso;
+    int i;
+
+    for (i = first; i < ISOLATE_MAX; i++) {
+        iso = &isolates[i];
+
+        if (!iso->used) {
+            if ((iso->mailFd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+                return NULL;
+            }
+
+            iso->used = 1;
+            iso->id = i + ISOLATE_MAX * iso->uses++;
+
+            return iso;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* drop a reference to an origin, called with isolateLock held. */
+static void originRelease(struct origin *origin)
+{
+    int i;
+
+    if (!origin || --origin->refs > 0) {
+        return;
+    }
+
+    for (i = 0; i < origin->deltaCount; i++) {
+        free(origin->deltas[i]);
+    }
+    free(origin->deltas);
+    free(origin->image);
+    free(origin);
+}
+
+
+/* give the slot back with whatever is still in its mailbox. */
+static void isolateFree(struct isolate *iso)
+{
+    struct message *msg, *next;
+
+    pthread_mutex_lock(&isolateLock);
+
+    for (msg = iso->first; msg; msg = next) {
+        next = msg->next;
+        free(msg->data);
+        free(msg);
+    }
+
+    close(iso->mailFd);
+    originRelease(iso->origin);
+    iso->origin = NULL;
+    iso->first = iso->last = NULL;
+    iso->interrupts = NULL;
+    iso->pending = 0;
+    iso->used = 0;
+
+    pthread_mutex_unlock(&isolateLock);
+}
+
+
+/* read the image, then run Isolate>>main until there is nothing left to do. */
+static void *isolateRun(void *arg)
+{
+    struct object *isolateClass, *aProcess;
+    struct origin *origin;
+    jmp_buf recovery;
+    FILE *volatile fp = NULL;
+    int i;
+
+    self = arg;
+    origin = self->origin;
+
+    pthread_mutex_lock(&isolateLock);
+    self->interrupts = interruptFlag();
+    pthread_mutex_unlock(&isolateLock);
+
+    imageWriteVersion = origin->writeVersion;
+    ioUringDisabled = origin->uringDisabled;
+
+    /* an error() ends this isolate, not the program */
+    if (setjmp(recovery)) {
+        if (fp) {
+            fclose(fp);
+        }
+        goto release;
+    }
+    errorRecovery = &recovery;
+
+    gcinit(origin->staticSize, origin->dynamicSize);
+
+    if (!(fp = fopen(origin->image, "rb"))) {
+        error("cannot open image file: %s!", origin->image);
+    }
+    fileIn(fp);
+    fclose(fp);
+    fp = NULL;
+
+    for (i = 0; i < origin->deltaCount; i++) {
+        if (!(fp = fopen(origin->deltas[i], "rb"))) {
+            error("cannot open delta image file: %s!", origin->deltas[i]);
+        }
+        fileIn(fp);
+        fclose(fp);
+        fp = NULL;
+    }
+
+    isolateClass = lookupGlobal("Isolate");
+    initialMethod = isolateClass ? dictLookup(isolateClass->data[methodsInClass], "main") : NULL;
+
+    if (initialMethod) {
+        addStaticRoot(&initialMethod);
+
+        aProcess = newRootProcess(initialMethod);
+        rootStack[rootTop++] = aProcess;
+
+        execute(aProcess, 0);
+    } else {
+        info("Unable to find method #main in Isolate class!");
+    }
+
+release:
+    errorRecovery = NULL;
+    eventShutdown();
+    primRelease();
+    imageRelease();
+    interpRelease();
+    gcrelease();
+
+    isolateFree(self);
+
+    return NULL;
+}
+
+
+/* the main isolate is the one set up here. */
+int isolateSetup(const char *image, const char **deltas, int deltaCount, int staticSize, int dynamicSize)
+{
+    struct origin *origin;
+    int i;
+
+    /* a second VM on this thread would take over the heap of the first */
+    if (self) {
+        return -1;
+    }
+
+    /* the isolates it spawns can outlive the VM */
+    if (!(origin = calloc(1, sizeof(*origin))) ||
+            !(origin->deltas = calloc((size_t)deltaCount + 1, sizeof(char *)))) {
+        free(origin);
+        return -1;
+    }
+    origin->refs = 1;
+    origin->image = strdup(image);
+    for (i = 0; i < deltaCount; i++) {
+        origin->deltas[i] = strdup(deltas[i]);
+    }
+    origin->deltaCount = deltaCount;
+    origin->staticSize = staticSize;
+    origin->dynamicSize = dynamicSize;
+    origin->writeVersion = imageWriteVersion;
+    origin->uringDisabled = ioUringDisabled;
+
+    pthread_mutex_lock(&isolateLock);
+
+    if (!(self = isolateClaim(0))) {
+        originRelease(origin);
+        pthread_mutex_unlock(&isolateLock);
+        return -1;
+    }
+    self->origin = origin;
+    self->interrupts = interruptFlag();
+
+    pthread_mutex_unlock(&isolateLock);
+
+    return 0;
+}
+
+
+void isolateRelease(void)
+{
+    if (self) {
+        isolateFree(self);
+        self = NULL;
+    }
+}
+
+
+int isolateSpawn(uint8_t *message, size_t size)
+{
+    struct isolate *iso;
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t all, old;
+    int id, rc;
+
+    if (!self) {
+        free(message);
+        return -1;
+    }
+
+    pthread_mutex_lock(&isolateLock);
+
+    if (!(iso = isolateClaim(1))) {
+        pthread_mutex_unlock(&isolateLock);
+        free(message);
+        return -1;
+    }
+
+    id = iso->id;
+
+    if (isolatePost(iso, message, size) == -1) {
+        close(iso->mailFd);
+        iso->used = 0;
+        pthread_mutex_unlock(&isolateLock);
+        free(message);
+        return -1;
+    }
+
+    /* it starts from the same image as its spawner */
+    iso->origin = self->origin;
+    iso->origin->refs++;
+
+    pthread_mutex_unlock(&isolateLock);
+
+    /* the thread leaves all signals to the main isolate */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rc = pthread_create(&thread, &attr, isolateRun, iso);
+    pthread_attr_destroy(&attr);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0) {
+        /* the message goes with the mailbox */
+        isolateFree(iso);
+        return -1;
+    }
+
+    return id;
+}
+
+
+int isolateCurrent(void)
+{
+    return self ? self->id : -1;
+}
+
+
+int isolateSend(int id, uint8_t *message, size_t size)
+{
+    struct isolate *iso;
+    int rc = -1;
+
+    pthread_mutex_lock(&isolateLock);
+
+    if ((iso = isolateFind(id))) {
+        rc = isolatePost(iso, message, size);
+    }
+
+    pthread_mutex_unlock(&isolateLock);
+
+    if (rc == -1) {
+        free(message);
+    }
+
+    return rc;
+}
+
+
+int isolatePending(void)
+{
+    int pending;
+
+    if (!self) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&isolateLock);
+    pending = self->pending;
+    pthread_mutex_unlock(&isolateLock);
+
+    return pending;
+}
+
+
+uint8_t *isolateTake(size_t *size)
+{
+    struct message *msg;
+    uint8_t *data;
+    uint64_t post;
+
+    if (!self) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&isolateLock);
+
+    if (!(msg = self->first)) {
+        pthread_mutex_unlock(&isolateLock);
+        return NULL;
+    }
+
+    self->first = msg->next;
+    if (!self->first) {
+        self->last = NULL;
+    }
+    self->pending--;
+
+    /* one post per message */
+    while (read(self->mailFd, &post, sizeof(post)) == -1 && errno == EINTR)
+        ;
+
+    pthread_mutex_unlock(&isolateLock);
+
+    data = msg->data;
+    *size = msg->size;
+    free(msg);
+
+    return data;
+}
+
+
+int isolateMailbox(void)
+{
+    return self ? self->mailFd : -1;
+}
+
+
+int isolateRunning(int id)
+{
+    int running;
+
+    pthread_mutex_lock(&isolateLock);
+    running = isolateFind(id) != NULL;
+    pthread_mutex_unlock(&isolateLock);
+
+    return running;
+}
+
+
+void isolateForkChild(void)
+{
+    int i;
+
+    /* only the forking thread lives on, maybe with isolateLock held */
+    pthread_mutex_init(&isolateLock, NULL);
+
+    /* the other isolates did not come along, nor do their mailboxes */
+    for (i = 0; i < ISOLATE_MAX; i++) {
+        if (isolates[i].used && &isolates[i] != self) {
+            isolateFree(&isolates[i]);
+        }
+    }
+}
@@ -0,0 +1,37 @@
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* makes the VM of this thread an isolate, which spawns isolates that
+   start from this image, its deltas and memory sizes; returns 0, or -1
+   if it can not or the thread already has a VM */
+extern int isolateSetup(const char *image, const char **deltas, int deltaCount, int staticSize, int dynamicSize);
+
+/* gives back the slot of the VM of this thread, which is going away */
+extern void isolateRelease(void);
+
+/* starts an isolate with message as its first message, returns its id or -1;
+   the message is taken over either way */
+extern int isolateSpawn(uint8_t *message, size_t size);
+
+/* the id of the isolate running on this thread, -1 if there is none */
+extern int isolateCurrent(void);
+
+/* takes over message, returns 0 or -1 if the isolate is not running */
+extern int isolateSend(int id, uint8_t *message, size_t size);
+
+/* the number of messages waiting for the current isolate */
+extern int isolatePending(void);
+
+/* the next message for the current isolate, or NULL, to be free()d */
+extern uint8_t *isolateTake(size_t *size);
+
+/* a descriptor readable while messages are waiting, -1 if there is none */
+extern int isolateMailbox(void);
+
+extern int isolateRunning(int id);
+
+/* forgets the other isolates in a forked child, their threads are gone */
+extern void isolateForkChild(void);
@@ -0,0 +1,276 @@
+/*
+ * lst.c
+ *	The C interface of liblst, see lst.h
+ *
+ * lstSend() runs the method it finds in a root process of its own, the
+ * way main() runs the start up method.  Other processes made ready get
+ * their turns as usual while it runs, and those still waiting when the
+ * method returns go on in later calls.
+ *
+ * Each VM is an isolate of its own.  While lstOpen() reads the image, an
+ * error() in the VM jumps back to it rather than ending the program, so
+ * a bad image is an error for the caller.
+ */
+
+#include <ctype.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+#include "err.h"
+#include "event.h"
+#include "globals.h"
+#include "image.h"
+#include "interp.h"
+#include "isolate.h"
+#include "memory.h"
+#include "prim.h"
+#include "lst.h"
+
+# define DefaultStaticSize 300000
+# define DefaultDynamicSize 300000
+
+
+int lstOpen(const char *image, int staticSize, int dynamicSize)
+{
+    jmp_buf recovery;
+    FILE *fp;
+
+    if (staticSize <= 0) {
+        staticSize = DefaultStaticSize;
+    }
+    if (dynamicSize <= 0) {
+        dynamicSize = DefaultDynamicSize;
+    }
+
+    if (!(fp = fopen(image, "rb"))) {
+        return -1;
+    }
+
+    if (isolateSetup(image, NULL, 0, staticSize, dynamicSize) == -1) {
+        fclose(fp);
+        return -1;
+    }
+
+    if (setjmp(recovery)) {
+        errorRecovery = NULL;
+        fclose(fp);
+        lstClose();
+        return -1;
+    }
+
+    errorRecovery = &recovery;
+    gcinit(staticSize, dynamicSize);
+    fileIn(fp);
+    errorRecovery = NULL;
+    fclose(fp);
+
+    return 0;
+}
+
+
+void lstClose(void)
+{
+    isolateRelease();
+    eventShutdown();
+    primRelease();
+    imageRelease();
+    interpRelease();
+    gcrelease();
+}
+
+
+struct object *lstEval(const char *source)
+{
+    return lstSend(lstString(source), "doIt", 0, NULL);
+}
+
+
+/* the number of arguments a selector takes. */
+static int selectorArity(const char *selector)
+{
+    int count = 0;
+
+    if (!isalpha((unsigned char)selector[0]) && selector[0] != '_') {
+        return 1;
+    }
+
+    for (; *selector; selector++) {
+        count += (*selector == ':');
+    }
+
+    return count;
+}
+
+
+struct object *lstSend(struct object *receiver, const char *selector, int argc, struct object **argv)
+{
+    struct object *cls, *method = NULL, *process, *args;
+    int base = rootTop;
+    int i, rc;
+
+    if (argc != selectorArity(selector) || rootTop + argc + 2 >= ROOTSTACKLIMIT) {
+        return NULL;
+    }
+
+    if (!receiver) {
+        receiver = nilObject;
+    }
+
+    for (cls = CLASS(receiver); cls && cls != nilObject && !method; cls = cls->data[parentClassInClass]) {
+        method = dictLookup(cls->data[methodsInClass], (char *)selector);
+    }
+
+    if (!method) {
+        return NULL;
+    }
+
+    /* the receiver and arguments can move while the process is made */
+    PUSH_ROOT(receiver);
+    for (i = 0; i < argc; i++) {
+        PUSH_ROOT(argv[i] ? argv[i] : nilObject);
+    }
+
+    process = newRootProcess(method);
+    PUSH_ROOT(process);
+
+    args = gcalloc(argc + 1);
+    args->class = ArrayClass;
+
+    process = POP_ROOT();
+    for (i = argc; i >= 0; i--) {
+        args->data[i] = POP_ROOT();
+    }
+    process->data[contextInProcess]->data[argumentsInContext] = args;
+
+    PUSH_ROOT(process);
+    rc = execute(process, 0);
+    process = rootStack[base];
+    rootTop = base;
+
+    return (rc == ReturnReturned) ? process->data[resultInProcess] : NULL;
+}
+
+
+int lstPushRoot(struct object *obj)
+{
+    if (rootTop >= ROOTSTACKLIMIT) {
+        return -1;
+    }
+
+    PUSH_ROOT(obj);
+
+    return 0;
+}
+
+
+struct object *lstPopRoot(void)
+{
+    if (rootTop <= 0) {
+        return NULL;
+    }
+
+    return POP_ROOT();
+}
+
+
+struct object *lstGlobal(const char *name)
+{
+    return lookupGlobal((char *)name);
+}
+
+
+struct object *lstNil(void)
+{
+    return nilObject;
+}
+
+
+struct object *lstBoolean(int value)
+{
+    return value ? trueObject : falseObject;
+}
+
+
+struct object *lstInteger(int64_t value)
+{
+    if (FITS_SMALLINT(value)) {
+        return newInteger(value);
+    }
+
+    return newLInteger(value);
+}
+
+
+struct object *lstString(const char *text)
+{
+    size_t size = strlen(text);
+    struct object *str;
+
+    str = gcialloc((int)size);
+    str->class = StringClass;
+    memcpy(bytePtr(str), text, size);
+
+    return str;
+}
+
+
+int lstIsNil(struct object *obj)
+{
+    return obj == NULL || obj == nilObject;
+}
+
+
+int lstIsTrue(struct object *obj)
+{
+    return obj == trueObject;
+}
+
+
+int lstIsInteger(struct object *obj)
+{
+    return IS_SMALLINT(obj) || (obj && obj->class == IntegerClass);
+}
+
+
+int64_t lstIntegerValue(struct object *obj)
+{
+    int64_t value;
+
+    if (IS_SMALLINT(obj)) {
+        return integerValue(obj);
+    }
+
+    if (!lstIsInteger(obj)) {
+        return 0;
+    }
+
+    memcpy(&value, bytePtr(obj), sizeof(value));
+
+    return value;
+}
+
+
+int lstIsString(struct object *obj)
+{
+    return obj && !IS_SMALLINT(obj) && IS_BINOBJ(obj) &&
+           (obj->class == StringClass || obj->class == SymbolClass);
+}
+
+
+int lstStringValue(struct object *obj, char *buffer, size_t size)
+{
+    size_t count;
+
+    if (!lstIsString(obj)) {
+        return -1;
+    }
+
+    if (size > 0) {
+        count = (SIZE(obj) < size - 1) ? SIZE(obj) : size - 1;
+        memcpy(buffer, bytePtr(obj), count);
+        buffer[count] = 0;
+    }
+
+    return (int)SIZE(obj);
+}
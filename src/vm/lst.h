@@ -0,0 +1,67 @@
+/*
+ * lst.h
+ *	The C interface of liblst, for programs that embed the VM
+ *
+ * A VM belongs to the thread that opened it.  The state of the VM is
+ * thread local, so each thread can run a VM of its own, and every call
+ * below works on the VM of the calling thread.  Each VM is an isolate,
+ * which Isolate current id names to the isolates it spawns; the first
+ * VM opened in a program is isolate 0.
+ *
+ * Any call that runs Smalltalk or makes an object can collect garbage,
+ * which moves objects.  An object pointer held across such a call has
+ * to be pushed on the root stack with lstPushRoot() and taken back with
+ * lstPopRoot() afterwards, just as PUSH_ROOT() and POP_ROOT() do inside
+ * the VM.  Arguments passed to lstSend() are rooted by it.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct object;
+
+/* liblst exports these and nothing else of the VM */
+#if defined(__GNUC__)
+# define LST_API __attribute__((visibility("default")))
+#else
+# define LST_API
+#endif
+
+/* read an image into a new VM, 0 for the default sizes; returns 0, or -1
+   if the image can not be read or this thread has a VM open already */
+extern LST_API int lstOpen(const char *image, int staticSize, int dynamicSize);
+
+/* free the VM of this thread */
+extern LST_API void lstClose(void);
+
+/* run source as a doIt, answers its value or NULL on an error */
+extern LST_API struct object *lstEval(const char *source);
+
+/* send selector with argc arguments, answers the result or NULL on an error */
+extern LST_API struct object *lstSend(struct object *receiver, const char *selector, int argc, struct object **argv);
+
+/* the root stack of the VM; a push answers -1 when the stack is full and
+   a pop answers NULL when it is empty, rather than ending the program */
+extern LST_API int lstPushRoot(struct object *obj);
+extern LST_API struct object *lstPopRoot(void);
+
+/* a global, such as a class, or NULL */
+extern LST_API struct object *lstGlobal(const char *name);
+
+/* C values to objects */
+extern LST_API struct object *lstNil(void);
+extern LST_API struct object *lstBoolean(int value);
+extern LST_API struct object *lstInteger(int64_t value);
+extern LST_API struct object *lstString(const char *text);
+
+/* objects to C values */
+extern LST_API int lstIsNil(struct object *obj);
+extern LST_API int lstIsTrue(struct object *obj);
+extern LST_API int lstIsInteger(struct object *obj);
+extern LST_API int64_t lstIntegerValue(struct object *obj);
+extern LST_API int lstIsString(struct object *obj);
+
+/* copies a String or Symbol like snprintf(), answers its size or -1 */
+extern LST_API int lstStringValue(struct object *obj, char *buffer, size_t size);
@@ -10,12 +10,16 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "err.h"
+#include "event.h"
 #include "globals.h"
+#include "image.h"
 #include "interp.h"
+#include "isolate.h"
 #include "memory.h"
 #include "prim.h"
 #include "version.h"
@@ -28,6 +32,7 @@
 # define DefaultStaticSize 300000
 # define DefaultDynamicSize 300000
 # define DefaultTmpdir "/tmp"
+# define MaxDeltaFiles 64
 
 /*
 --------------------
@@ -47,12 +52,32 @@ FILE *tempFile;
 
 static void find_initial_method(void);
 
+
+/* Ctrl-C stops what runs at the next check point, twice ends the VM. */
+static void interruptSignal(int sig)
+{
+    if (interrupts & InterruptUser) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+        return;
+    }
+
+    interruptRequest(InterruptUser);
+}
+
+
 int main(int argc, char **argv)
 {
     struct object *aProcess, *aContext, *o;
-    int size, i, staticSize, dynamicSize;
+    struct sigaction action;
+    int64_t bytecodes, bytes, usec;
+    int i, staticSize, dynamicSize;
     FILE *fp;
     char imageFileName[120], *p;
+    const char *deltaFiles[MaxDeltaFiles];
+    int deltaCount = 0;
+    const char *outputFile = NULL;
+    const char *shakenFile = NULL;
 
     printf("Little Smalltalk starting up...\n");
 
@@ -84,6 +109,19 @@ int main(int argc, char **argv)
         } else if (strcmp(argv[i], "-g") == 0) {
             info("Turning on debugging.");
             debugging = 1;
+        } else if (strcmp(argv[i], "-delta") == 0 && i + 1 < argc) {
+            if (deltaCount >= MaxDeltaFiles) {
+                error("too many delta images, at most %d can be read!", MaxDeltaFiles);
+            }
+            deltaFiles[deltaCount++] = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outputFile = argv[++i];
+        } else if (strcmp(argv[i], "-shake") == 0 && i + 1 < argc) {
+            shakenFile = argv[++i];
+        } else if (strcmp(argv[i], "-workers") == 0 && i + 1 < argc) {
+            preforkWorkers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-nouring") == 0) {
+            ioUringDisabled = 1;
         } else {
             strcpy(imageFileName, argv[i]);
         }
@@ -93,6 +131,11 @@ int main(int argc, char **argv)
     tempFile = fopen("/usr/tmp/counts", "w");
 # endif
 
+    /* isolates start from the same image */
+    if (isolateSetup(imageFileName, deltaFiles, deltaCount, staticSize, dynamicSize) == -1) {
+        error("cannot set up the main isolate!");
+    }
+
     info("Initializing GC memory pool.");
 
     gcinit(staticSize, dynamicSize);
@@ -108,61 +151,68 @@ int main(int argc, char **argv)
     info("%d objs/cells in image.", fileIn(fp));
     fclose(fp);
 
-    /* find the initial method. */
-    find_initial_method();
-    addStaticRoot(&initialMethod);
+    /* apply the delta images in the order they were written */
+    for (i = 0; i < deltaCount; i++) {
+        info("Reading in delta image from file %s.", deltaFiles[i]);
 
-    if(debugging) {
-        /* dump startup method */
-        dumpMethod(initialMethod, 0);
+        fp = fopen(deltaFiles[i], "rb");
+        if (! fp) {
+            error("cannot open delta image file: %s!", deltaFiles[i]);
+        }
+
+        info("%d objs in delta image.", fileIn(fp));
+        fclose(fp);
     }
 
-    /* build the root process with a context, make sure it is GC-proof */
+    /* merge the image and its deltas into one image and stop */
+    if (outputFile) {
+        fp = fopen(outputFile, "wb");
+        if (! fp) {
+            error("cannot open output image file: %s!", outputFile);
+        }
 
-    info("Setting up root process.");
+        i = fileOut(fp);
+        if (fclose(fp) != 0) {
+            error("cannot write output image file: %s!", outputFile);
+        }
 
-    aProcess = gcalloc(processSize);
-    aProcess->class = lookupGlobal("Process");
-    for(int i=0; i< processSize; i++) {
-        aProcess->data[i] = nilObject;
+        printf("%d objects written to \"%s\".\n", i, outputFile);
+
+        return 0;
     }
-    addStaticRoot(&aProcess);
 
-    info("Setting up root context.");
+    /* find the initial method. */
+    find_initial_method();
+    addStaticRoot(&initialMethod);
 
-    /* context should be dynamic */
-    aContext = gcalloc(contextSize);
-    aContext->class = ContextClass;
-    for(int i=0; i< contextSize; i++) {
-        aContext->data[i] = nilObject;
-    }
+    /* write a copy with only what the initial method can reach and stop */
+    if (shakenFile) {
+        fp = fopen(shakenFile, "wb");
+        if (! fp) {
+            error("cannot open output image file: %s!", shakenFile);
+        }
 
-    /* add the context to the process. */
-    aProcess->data[contextInProcess] = aContext;
+        i = fileOutShaken(fp, initialMethod);
+        if (fclose(fp) != 0) {
+            error("cannot write output image file: %s!", shakenFile);
+        }
 
-    /* set up context stack */
-    size = integerValue(initialMethod->data[stackSizeInMethod]);
-    aContext->data[stackInContext] = gcalloc(size);
-    aContext->data[stackInContext]->class = ArrayClass;
-    for(int i=0; i < size; i++) {
-        aContext->data[stackInContext]->data[i] = nilObject;
-    }
+        printf("%d objects written to \"%s\".\n", i, shakenFile);
 
-    /* set up arguments, none. */
-    aContext->data[argumentsInContext] = nilObject;
+        return 0;
+    }
 
-    /* set up temporary array. */
-    size = 19;  /* where is this number from? */
-    aContext->data[temporariesInContext] = gcalloc(size);
-    aContext->data[temporariesInContext]->class = ArrayClass;
-    for(int i=0; i < size; i++) {
-        aContext->data[temporariesInContext]->data[i] = nilObject;
+    if(debugging) {
+        /* dump startup method */
+        dumpMethod(initialMethod, 0);
     }
 
-    aContext->data[bytePointerInContext] = newInteger(0);
-    aContext->data[stackTopInContext] = newInteger(0);
-    aContext->data[previousContextInContext] = nilObject;
-    aContext->data[methodInContext] = initialMethod;
+    /* build the root process with a context, make sure it is GC-proof */
+
+    info("Setting up root process.");
+
+    aProcess = newRootProcess(initialMethod);
+    addStaticRoot(&aProcess);
 
     /* now go do it */
     rootStack[rootTop++] = aProcess;
@@ -171,6 +221,12 @@ int main(int argc, char **argv)
     take_samples(1);
 #endif
 
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = interruptSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+
     info("Starting execution.");
 
     switch(execute(aProcess, 0)) {
@@ -195,6 +251,10 @@ int main(int argc, char **argv)
         printf("time out\n");
         break;
 
+    case 7:
+        printf("interrupted\n");
+        break;
+
     default:
         printf("unknown return code\n");
         break;
@@ -217,6 +277,11 @@ int main(int argc, char **argv)
         printf("  %" PRId64 " maximum bytes copied during GC.\n", gc_mem_max_copied);
     }
 
+    processUsage(aProcess, &bytecodes, &bytes, &usec);
+    printf("\nProcess statistics:\n");
+    printf("  %" PRId64 " bytecodes, %" PRId64 " bytes allocated, %" PRId64 " microseconds in the root process.\n", bytecodes, bytes, usec);
+    printf("  %" PRId64 " bytecodes, %" PRId64 " bytes allocated in all processes.\n", bytecode_count, gcallocated());
+
     return(0);
 }
 
@@ -21,48 +21,82 @@
 #include "err.h"
 
 
-int64_t gc_count = 0;
-int64_t gc_total_time = 0;
-int64_t gc_max_time = 0;
-int64_t gc_total_mem_copied = 0;
-int64_t gc_mem_max_copied = 0;
+VM_LOCAL int64_t gc_count = 0;
+VM_LOCAL int64_t gc_total_time = 0;
+VM_LOCAL int64_t gc_max_time = 0;
+VM_LOCAL int64_t gc_total_mem_copied = 0;
+VM_LOCAL int64_t gc_mem_max_copied = 0;
+
+/* bytes allocated in the spaces before the last collection */
+static VM_LOCAL int64_t gc_allocated = 0;
 
 /*
     static memory space -- never recovered
 */
-static struct object *staticBase, *staticTop, *staticPointer;
+static VM_LOCAL struct object *staticBase, *staticTop, *staticPointer;
 
 /*
     dynamic (managed) memory space
     recovered using garbage collection
 */
 
-int spaceSize;
-struct object *spaceOne;
-struct object *spaceTwo;
-int inSpaceOne;
+VM_LOCAL int spaceSize;
+VM_LOCAL struct object *spaceOne;
+VM_LOCAL struct object *spaceTwo;
+VM_LOCAL int inSpaceOne;
 
-struct object *memoryBase;
-struct object *memoryPointer;
-struct object *memoryTop;
+VM_LOCAL struct object *memoryBase;
+VM_LOCAL struct object *memoryPointer;
+VM_LOCAL struct object *memoryTop;
+VM_LOCAL struct object *memoryLimit;
 
-static struct object *oldBase, *oldTop;
+static VM_LOCAL struct object *oldBase, *oldTop;
 
 /*
     roots for memory access
     used as bases for garbage collection algorithm
 */
-struct object *rootStack[ROOTSTACKLIMIT];
-int rootTop = 0;
+VM_LOCAL struct object *rootStack[ROOTSTACKLIMIT];
+VM_LOCAL int rootTop = 0;
 #define STATICROOTLIMIT (200)
-static struct object **staticRoots[STATICROOTLIMIT];
-static int staticRootTop = 0;
+static VM_LOCAL struct object **staticRoots[STATICROOTLIMIT];
+static VM_LOCAL int staticRootTop = 0;
+
+/*
+    growable C arrays of object pointers that are roots,
+    the arrays may be reallocated so we keep a pointer to them.
+    Weak ones follow their objects but do not keep them alive,
+    unless weak roots are held.
+*/
+#define ROOTVECTORLIMIT (8)
+static VM_LOCAL struct object ***rootVectors[ROOTVECTORLIMIT];
+static VM_LOCAL int *rootVectorCounts[ROOTVECTORLIMIT];
+static VM_LOCAL int rootVectorWeak[ROOTVECTORLIMIT];
+static VM_LOCAL int rootVectorTop = 0;
+static VM_LOCAL int weakRootsHeld = 0;
+
+#define ROOT_VECTOR_TRACED(i) (!rootVectorWeak[i] || weakRootsHeld)
+
+/*
+    regions -- what is allocated while one is open lies below regionTop,
+    the objects above it that were stored into are in a hash set
+*/
+VM_LOCAL struct object *regionTop = NULL;
+static VM_LOCAL int regionDepth = 0;
+static VM_LOCAL struct object **regionSet = NULL;
+static VM_LOCAL int regionSetSize = 0;
+static VM_LOCAL int regionSetCount = 0;
+
+/* where the objects that are kept go until the region is freed */
+static VM_LOCAL struct object *scratchBase, *scratchPointer;
 
 
 
 /* local routines */
 //static int64_t time_usec();
 void do_gc();
+static void regionRestart(void);
+static void addVector(struct object ***vector, int *count, int weak);
 
 
 /*
@@ -78,6 +112,15 @@ int isDynamicMemory(struct object *x)
            ((x >= spaceTwo) && (x <= (spaceTwo + spaceSize)));
 }
 
+/*
+    the low-water mark, a thirty-second of the space above memoryBase
+*/
+static void gcsetlimit(void)
+{
+    memoryLimit = (struct object *)((char *)memoryBase + ((char *)memoryTop - (char *)memoryBase) / 32);
+}
+
+
 /*
     gcinit -- initialize the memory management system
 */
@@ -99,6 +142,7 @@ void gcinit(int staticsz, int dynamicsz)
     memoryBase = spaceOne;
     memoryPointer = memoryBase + spaceSize;
     memoryTop = memoryPointer;
+    gcsetlimit();
 
     if (debugging) {
         info("space one 0x%p, top 0x%p,"
@@ -111,6 +155,31 @@ void gcinit(int staticsz, int dynamicsz)
 }
 
 
+/* give the memory areas back, when an isolate is done with them. */
+void gcrelease(void)
+{
+    free(staticBase);
+    free(spaceOne);
+    free(spaceTwo);
+
+    staticBase = staticTop = staticPointer = NULL;
+    spaceOne = spaceTwo = NULL;
+    memoryBase = memoryPointer = memoryTop = memoryLimit = NULL;
+    gc_allocated = 0;
+
+    rootTop = 0;
+    staticRootTop = 0;
+    rootVectorTop = 0;
+    weakRootsHeld = 0;
+
+    free(regionSet);
+    regionSet = NULL;
+    regionSetSize = regionSetCount = 0;
+    regionDepth = 0;
+    regionTop = NULL;
+}
+
+
 /*
     gc_move is the heart of the garbage collection algorithm.
     It takes as argument a pointer to a value in the old space,
@@ -121,6 +190,17 @@ void gcinit(int staticsz, int dynamicsz)
 #define IN_NEWSPACE(obj) (((intptr_t)obj >= (intptr_t)memoryBase) && ((intptr_t)obj <= (intptr_t)memoryTop))
 #define IN_OLDSPACE(obj) (((intptr_t)obj >= (intptr_t)oldBase) && ((intptr_t)obj <= (intptr_t)oldTop))
 
+/* where an object that was moved went, see the forwarding in gc_move(). */
+static struct object *gc_forward(struct mobject *old_address)
+{
+    if (IS_BINOBJ(old_address)) {
+        return (struct object *) old_address->data[0];
+    }
+
+    return (struct object *) old_address->data[SIZE(old_address)];
+}
+
+
 static struct object *gc_move(struct mobject *ptr)
 {
     struct mobject *old_address = ptr, *previous_object = 0,*new_address = 0, *replacement  = 0;
@@ -181,6 +261,9 @@ static struct object *gc_move(struct mobject *ptr)
                 new_address = (struct mobject *)memoryPointer;
                 SET_SIZE(new_address, isz);
                 SET_BINOBJ(new_address);
+                if (IS_TRACKED(old_address)) {
+                    SET_TRACKED(new_address);
+                }
                 /* FIXME - use memcpy */
                 while (sz) {
                     new_address->data[sz] =
@@ -201,6 +284,9 @@ static struct object *gc_move(struct mobject *ptr)
                                           sz + 2);
                 new_address = (struct mobject *)memoryPointer;
                 SET_SIZE(new_address, sz);
+                if (IS_TRACKED(old_address)) {
+                    SET_TRACKED(new_address);
+                }
                 SET_GCDONE(old_address);
                 new_address->data[sz] = previous_object;
                 previous_object = old_address;
@@ -271,6 +357,9 @@ void do_gc()
     int64_t start = time_usec();
     int64_t end = 0;
 
+    /* what was allocated since the last collection, the survivors are not */
+    gc_allocated += (char *)memoryTop - (char *)memoryPointer;
+
     /* first change spaces */
     if (inSpaceOne) {
         memoryBase = spaceTwo;
@@ -285,6 +374,10 @@ void do_gc()
     memoryPointer = memoryTop = memoryBase + spaceSize;
     oldTop = oldBase + spaceSize;
 
+    /* a collection asked of the interpreter is done now */
+    gcsetlimit();
+    __atomic_and_fetch(&interrupts, ~InterruptGC, __ATOMIC_RELAXED);
+
     /* then do the collection */
     for (i = 0; i < rootTop; i++) {
         rootStack[i] = gc_move((struct mobject *) rootStack[i]);
@@ -293,10 +386,44 @@ void do_gc()
         (* staticRoots[i]) =  gc_move((struct mobject *)
                                       *staticRoots[i]);
     }
+    for (i = 0; i < rootVectorTop; i++) {
+        struct object **vector = *rootVectors[i];
+        int j;
+
+        if (!ROOT_VECTOR_TRACED(i)) {
+            continue;
+        }
+
+        for (j = 0; j < *rootVectorCounts[i]; j++) {
+            vector[j] = gc_move((struct mobject *) vector[j]);
+        }
+    }
+
+    /* weak roots follow what was moved and drop what was not */
+    for (i = 0; i < rootVectorTop; i++) {
+        struct object **vector = *rootVectors[i];
+        int j;
+
+        if (ROOT_VECTOR_TRACED(i)) {
+            continue;
+        }
+
+        for (j = 0; j < *rootVectorCounts[i]; j++) {
+            if (!IS_SMALLINT(vector[j]) && IN_OLDSPACE(vector[j])) {
+                vector[j] = IS_GCDONE(vector[j]) ? gc_forward((struct mobject *) vector[j]) : NULL;
+            }
+        }
+    }
 
     flushCache();
 
+    /* everything is old now, an open region starts over */
+    if (regionTop) {
+        regionRestart();
+    }
+
     /* FIXME - pointer comparisons are NOT portable. */
+    gc_allocated -= (char *)memoryTop - (char *)memoryPointer;
     gc_total_mem_copied += ((char *)memoryTop - (char *)memoryPointer);
     if(((char *)memoryTop - (char *)memoryPointer) > gc_mem_max_copied) {
         gc_mem_max_copied = ((char *)memoryTop - (char *)memoryPointer);
@@ -321,7 +448,16 @@ void do_gc()
 
 struct object *gcollect(int sz)
 {
-    /* force a GC */
+    /* past the low-water mark there is still room, collect at a check point */
+    if (memoryLimit != memoryBase && (intptr_t)memoryPointer >= (intptr_t)memoryBase) {
+        memoryLimit = memoryBase;
+        interruptRequest(InterruptGC);
+        SET_SIZE(memoryPointer, sz);
+        return(memoryPointer);
+    }
+
+    /* force a GC, the object is counted once it is allocated */
+    memoryPointer = WORDSUP(memoryPointer, sz + 2);
     do_gc();
 
     /* then see if there is room for allocation */
@@ -334,6 +470,294 @@ struct object *gcollect(int sz)
     return(memoryPointer);
 }
 
+/* the bytes allocated in the spaces so far, by gcalloc() and the like */
+int64_t gcallocated(void)
+{
+    return gc_allocated + ((char *)memoryTop - (char *)memoryPointer);
+}
+
+
+/*
+    regions -- a region holds what is allocated from the time it is
+    opened to the time it is closed.  Most of that is garbage by then,
+    so instead of waiting for a collection, closing the region copies
+    out what the roots and the remembered objects still refer to, then
+    puts it back at the top of the region and frees the rest at once.
+    The other space, which is free between collections, takes the
+    copies meanwhile.
+
+    A region is shared by whatever opens one while it is open, and it
+    is only closed with the last of them.  A collection, or anything
+    else that can make old objects refer to new ones unnoticed, starts
+    the region over with what is allocated from then on.
+*/
+
+#define REGION_HASH(obj) ((((uintptr_t)(obj)) >> 4) * (uintptr_t)0x9E3779B97F4A7C15ULL)
+
+static void regionGrow(void)
+{
+    struct object **old = regionSet;
+    int oldSize = regionSetSize, i, j;
+
+    regionSetSize = oldSize ? oldSize * 2 : 1024;
+    regionSet = calloc((size_t)regionSetSize, sizeof(struct object *));
+    if (!regionSet) {
+        error("regionGrow(): not enough memory for %d remembered objects!", regionSetSize);
+    }
+
+    for (i = 0; i < oldSize; i++) {
+        if (old[i]) {
+            j = (int)(REGION_HASH(old[i]) & (uintptr_t)(regionSetSize - 1));
+            while (regionSet[j]) {
+                j = (j + 1) & (regionSetSize - 1);
+            }
+            regionSet[j] = old[i];
+        }
+    }
+
+    free(old);
+}
+
+
+void regionRemember(struct object *obj)
+{
+    int i;
+
+    if (!obj) {
+        return;
+    }
+
+    if (regionSetCount * 2 >= regionSetSize) {
+        regionGrow();
+    }
+
+    i = (int)(REGION_HASH(obj) & (uintptr_t)(regionSetSize - 1));
+    while (regionSet[i]) {
+        if (regionSet[i] == obj) {
+            return;
+        }
+        i = (i + 1) & (regionSetSize - 1);
+    }
+
+    regionSet[i] = obj;
+    regionSetCount++;
+}
+
+
+/* a root may be stored into at any time, a context through its stack too. */
+static void regionRememberRoot(struct object *obj)
+{
+    if (!obj || IS_SMALLINT(obj)) {
+        return;
+    }
+
+    REMEMBER(obj);
+    if (obj->class == ContextClass || obj->class == BlockClass) {
+        REMEMBER(obj->data[stackInContext]);
+    }
+}
+
+
+/* what is allocated from now on is in the region, nothing before it. */
+static void regionRestart(void)
+{
+    int i;
+
+    if (regionSetCount) {
+        memset(regionSet, 0, (size_t)regionSetSize * sizeof(struct object *));
+        regionSetCount = 0;
+    }
+
+    regionTop = memoryPointer;
+
+    for (i = 0; i < rootTop; i++) {
+        regionRememberRoot(rootStack[i]);
+    }
+    for (i = 0; i < staticRootTop; i++) {
+        regionRememberRoot(*staticRoots[i]);
+    }
+}
+
+
+int regionOpen(void)
+{
+    if (!regionDepth) {
+        regionRestart();
+    }
+
+    return ++regionDepth;
+}
+
+
+/* copy an object of the region out, once, and answer where it went. */
+static struct object *regionCopy(struct object *obj)
+{
+    struct object *copy;
+    uint32_t words;
+
+    if (IS_SMALLINT(obj) || !IN_REGION(obj)) {
+        return obj;
+    }
+
+    if (IS_GCDONE(obj)) {
+        return obj->class;
+    }
+
+    words = (IS_BINOBJ(obj) ? TO_WORDS(SIZE(obj)) : SIZE(obj)) + 2;
+    copy = scratchPointer;
+    memcpy(copy, obj, (size_t)words * BytesPerWord);
+    scratchPointer = WORDSUP(scratchPointer, words);
+
+    SET_GCDONE(obj);
+    obj->class = copy;
+
+    return copy;
+}
+
+
+/* copy out what an object refers to in the region. */
+static void regionCopyFields(struct object *obj)
+{
+    int i;
+
+    obj->class = regionCopy(obj->class);
+
+    if (!IS_BINOBJ(obj)) {
+        for (i = SIZE(obj) - 1; i >= 0; i--) {
+            obj->data[i] = regionCopy(obj->data[i]);
+        }
+    }
+}
+
+
+/* point what refers to a copy at where it ends up. */
+#define REGION_RELOCATE(p, delta) \
+    do { \
+        if ((intptr_t)(p) >= (intptr_t)scratchBase && (intptr_t)(p) < (intptr_t)scratchPointer) { \
+            (p) = (struct object *)((char *)(p) + (delta)); \
+        } \
+    } while (0)
+
+static void regionRelocateFields(struct object *obj, ptrdiff_t delta)
+{
+    int i;
+
+    REGION_RELOCATE(obj->class, delta);
+
+    if (!IS_BINOBJ(obj)) {
+        for (i = SIZE(obj) - 1; i >= 0; i--) {
+            REGION_RELOCATE(obj->data[i], delta);
+        }
+    }
+}
+
+
+/*
+ * the roots and the remembered objects, which is what keeps a copy alive,
+ * and the weak roots too if they are to be relocated
+ */
+#define REGION_EACH_SOURCE(ROOT, OBJECT, WEAK) \
+    do { \
+        int i_, j_; \
+        for (i_ = 0; i_ < rootTop; i_++) { \
+            ROOT(rootStack[i_]); \
+        } \
+        for (i_ = 0; i_ < staticRootTop; i_++) { \
+            ROOT(*staticRoots[i_]); \
+        } \
+        for (i_ = 0; i_ < rootVectorTop; i_++) { \
+            struct object **vector_ = *rootVectors[i_]; \
+            if (!(WEAK) && !ROOT_VECTOR_TRACED(i_)) { \
+                continue; \
+            } \
+            for (j_ = 0; j_ < *rootVectorCounts[i_]; j_++) { \
+                ROOT(vector_[j_]); \
+            } \
+        } \
+        for (i_ = 0; i_ < regionSetSize; i_++) { \
+            if (regionSet[i_]) { \
+                OBJECT(regionSet[i_]); \
+            } \
+        } \
+    } while (0)
+
+int64_t regionClose(void)
+{
+    struct object *scan, *dest;
+    ptrdiff_t delta;
+    int64_t freed;
+    uint32_t words;
+    int i, j;
+
+    if (!regionDepth) {
+        return -1;
+    }
+
+    if (--regionDepth) {
+        return 0;
+    }
+
+    scratchBase = scratchPointer = inSpaceOne ? spaceTwo : spaceOne;
+
+    /* copy out what is kept, breadth first */
+#define COPY_ROOT(p) ((p) = regionCopy(p))
+    REGION_EACH_SOURCE(COPY_ROOT, regionCopyFields, 0);
+#undef COPY_ROOT
+
+    for (scan = scratchBase; scan < scratchPointer; scan = WORDSUP(scan, words)) {
+        words = (IS_BINOBJ(scan) ? TO_WORDS(SIZE(scan)) : SIZE(scan)) + 2;
+        regionCopyFields(scan);
+    }
+
+    /* weak roots follow what was kept and drop the rest */
+    for (i = 0; i < rootVectorTop; i++) {
+        struct object **vector = *rootVectors[i];
+
+        if (ROOT_VECTOR_TRACED(i)) {
+            continue;
+        }
+
+        for (j = 0; j < *rootVectorCounts[i]; j++) {
+            if (!IS_SMALLINT(vector[j]) && IN_REGION(vector[j])) {
+                vector[j] = IS_GCDONE(vector[j]) ? vector[j]->class : NULL;
+            }
+        }
+    }
+
+    /* then move it to the top of the region, where it is out of the way */
+    dest = (struct object *)((char *)regionTop - ((char *)scratchPointer - (char *)scratchBase));
+    delta = (char *)dest - (char *)scratchBase;
+
+#define RELOCATE_ROOT(p) REGION_RELOCATE(p, delta)
+#define RELOCATE_OBJECT(o) regionRelocateFields(o, delta)
+    REGION_EACH_SOURCE(RELOCATE_ROOT, RELOCATE_OBJECT, 1);
+#undef RELOCATE_ROOT
+#undef RELOCATE_OBJECT
+
+    for (scan = scratchBase; scan < scratchPointer; scan = WORDSUP(scan, words)) {
+        words = (IS_BINOBJ(scan) ? TO_WORDS(SIZE(scan)) : SIZE(scan)) + 2;
+        regionRelocateFields(scan, delta);
+    }
+
+    memmove(dest, scratchBase, (size_t)((char *)scratchPointer - (char *)scratchBase));
+
+    /* what was freed was allocated all the same */
+    freed = (char *)dest - (char *)memoryPointer;
+    gc_allocated += freed;
+    memoryPointer = dest;
+
+    if (regionSetCount) {
+        memset(regionSet, 0, (size_t)regionSetSize * sizeof(struct object *));
+        regionSetCount = 0;
+    }
+    regionTop = NULL;
+
+    flushCache();
+
+    return freed;
+}
+
+
 /*
     static allocation -- tries to allocate values in an area
     that will not be subject to garbage collection
@@ -349,7 +773,7 @@ struct object *gcalloc(int sz)
     struct object *result;
 
     memoryPointer = WORDSDOWN(memoryPointer, sz + 2);
-    if (memoryPointer < memoryBase) {
+    if (memoryPointer < memoryLimit) {
         return gcollect(sz);
     }
     SET_SIZE(memoryPointer, sz);
@@ -395,6 +819,59 @@ void addStaticRoot(struct object **objp)
     staticRoots[staticRootTop++] = objp;
 }
 
+
+/*
+ * addRootVector()
+ *  Add a C array of object pointers as roots
+ *
+ * Every entry of *vector up to *count is traced during garbage
+ * collection.  The array may be reallocated as it grows, so we keep
+ * a pointer to the array pointer.
+ */
+void addRootVector(struct object ***vector, int *count)
+{
+    addVector(vector, count, 0);
+}
+
+
+/*
+ * addWeakRootVector()
+ *  Add a C array of object pointers that do not keep them alive
+ *
+ * After a collection each entry points where its object went, or is
+ * NULL if nothing else kept the object.  While weak roots are held,
+ * see holdWeakRoots(), they are traced like any other.
+ */
+void addWeakRootVector(struct object ***vector, int *count)
+{
+    addVector(vector, count, 1);
+}
+
+
+void holdWeakRoots(int hold)
+{
+    weakRootsHeld += hold ? 1 : -1;
+}
+
+
+static void addVector(struct object ***vector, int *count, int weak)
+{
+    int i;
+
+    for (i = 0; i < rootVectorTop; ++i) {
+        if (vector == rootVectors[i]) {
+            return;
+        }
+    }
+    if (rootVectorTop >= ROOTVECTORLIMIT) {
+        error("addRootVector(): too many root vectors (max %d)!", ROOTVECTORLIMIT);
+    }
+    rootVectors[rootVectorTop] = vector;
+    rootVectorCounts[rootVectorTop] = count;
+    rootVectorWeak[rootVectorTop] = weak;
+    rootVectorTop++;
+}
+
 /*
  * map()
  *  Fix an OOP if needed, based on values to be exchanged
@@ -503,6 +980,18 @@ void exchangeObjects(struct object *array1, struct object *array2, int size)
     for (x = 0; x < staticRootTop; x++) {
         map(staticRoots[x], array1, array2, size);
     }
+    for (x = 0; x < rootVectorTop; x++) {
+        int j;
+
+        for (j = 0; j < *rootVectorCounts[x]; j++) {
+            map(&((*rootVectors[x])[j]), array1, array2, size);
+        }
+    }
+
+    /* any object may refer to the region now */
+    if (regionTop) {
+        regionRestart();
+    }
 }
 
 
@@ -36,6 +36,12 @@
 #include <stdio.h>
 #include <sys/types.h>
 
+/*
+ * Each isolate runs its own interpreter on a thread of its own, so the
+ * state of the VM is thread local, see isolate.c.
+ */
+#define VM_LOCAL __thread
+
 /* ints must be at least 32-bit in size! */
 
 struct object {
@@ -88,10 +94,10 @@ struct mobject {
 #define newInteger(x) ((struct object *)((((intptr_t)(x)) * 2) | 0x01))
 
 /*
- * The "size" field is the top 30 bits; the bottom two are flags
+ * The "size" field is the top 29 bits; the bottom three are flags
  */
-#define SIZE(op) ((uint32_t)(((struct object *)(op))->header) >> 2)
-#define SET_SIZE(op, val) (((struct object *)(op))->header = (uintptr_t)((uint32_t)(val) << 2))
+#define SIZE(op) ((uint32_t)(((struct object *)(op))->header) >> 3)
+#define SET_SIZE(op, val) (((struct object *)(op))->header = (uintptr_t)((uint32_t)(val) << 3))
 
 /* handle the other flags in the header. */
 #define FLAG_GCDONE (0x01)
@@ -102,6 +108,47 @@ struct mobject {
 #define IS_BINOBJ(o) (((struct object *)(o))->header & (uintptr_t)FLAG_BIN)
 #define SET_BINOBJ(o) (((struct object *)(o))->header |= (uintptr_t)FLAG_BIN)
 
+/* objects from the last image read or written that have not been changed since. */
+#define FLAG_TRACKED (0x04)
+#define IS_TRACKED(o) (((struct object *)(o))->header & (uintptr_t)FLAG_TRACKED)
+#define SET_TRACKED(o) (((struct object *)(o))->header |= (uintptr_t)FLAG_TRACKED)
+#define CLEAR_TRACKED(o) (((struct object *)(o))->header &= ~(uintptr_t)FLAG_TRACKED)
+
+/*
+ * Regions.  While a region is open, what is allocated goes below
+ * regionTop, and closing it keeps only what the rest of memory still
+ * refers to.  Objects from before the region that are stored into are
+ * remembered, as their fields are where that happens.
+ */
+extern VM_LOCAL struct object *regionTop;
+
+#define IN_REGION(o) (((intptr_t)(o) >= (intptr_t)memoryBase) && ((intptr_t)(o) < (intptr_t)regionTop))
+#define REMEMBER(o) do { if(regionTop && !IS_SMALLINT(o) && !IN_REGION(o)) { regionRemember(o); } } while(0)
+
+extern void regionRemember(struct object *obj);
+
+/* returns how many are open, counting this one */
+extern int regionOpen(void);
+
+/* returns the bytes freed, 0 while others are still open, -1 if none was */
+extern int64_t regionClose(void);
+
+/*
+ * Stores into objects go through the write barrier so that delta images
+ * know what changed and regions know what to keep.  Only the first store
+ * into a tracked object, and stores into old objects while a region is
+ * open, cost more than the flag tests.
+ */
+#define WRITE_BARRIER(o) do { \
+        if(!IS_SMALLINT(o)) { \
+            if(IS_TRACKED(o)) { markDirty(o); } \
+            if(regionTop && !IN_REGION(o)) { regionRemember(o); } \
+        } \
+    } while(0)
+
+extern void markDirty(struct object *obj);
+extern void markAllDirty(void);
+
 #define NOT_NIL(o) ((o) && ((o) != nilObject))
 
 /*
@@ -109,17 +156,19 @@ struct mobject {
     memoryPointer is the pointer into this space.
     To allocate, decrement memoryPointer by the correct amount.
     If the result is less than memoryBase, then garbage collection
-    must take place
+    must take place.  Below memoryLimit, the low-water mark, it is
+    asked of the interpreter instead, to run at its next check point.
 */
 
-extern int spaceSize;
-extern struct object *spaceOne;
-extern struct object *spaceTwo;
-extern int inSpaceOne;
+extern VM_LOCAL int spaceSize;
+extern VM_LOCAL struct object *spaceOne;
+extern VM_LOCAL struct object *spaceTwo;
+extern VM_LOCAL int inSpaceOne;
 
-extern struct object *memoryBase;
-extern struct object *memoryPointer;
-extern struct object *memoryTop;
+extern VM_LOCAL struct object *memoryBase;
+extern VM_LOCAL struct object *memoryPointer;
+extern VM_LOCAL struct object *memoryTop;
+extern VM_LOCAL struct object *memoryLimit;
 
 
 /*
@@ -130,8 +179,8 @@ extern struct object *memoryTop;
     dynamic values
 */
 # define ROOTSTACKLIMIT 2000
-extern struct object *rootStack[];
-extern int rootTop;
+extern VM_LOCAL struct object *rootStack[];
+extern VM_LOCAL int rootTop;
 
 
 #define PUSH_ROOT(o) (rootStack[rootTop++] = (o))
@@ -139,6 +188,9 @@ extern int rootTop;
 #define POP_ROOT()   (rootStack[--rootTop])
 
 extern void addStaticRoot(struct object **);
+extern void addRootVector(struct object ***vector, int *count);
+extern void addWeakRootVector(struct object ***vector, int *count);
+extern void holdWeakRoots(int hold);
 
 /* image reading/writing */
 extern int fileIn(FILE *fp);
@@ -149,6 +201,7 @@ extern int fileOut(FILE *fp);
 */
 
 extern void gcinit(int, int);
+extern void gcrelease(void);
 extern struct object *gcollect(int);
 extern struct object *staticAllocate(int);
 extern struct object *staticIAllocate(int);
@@ -162,7 +215,7 @@ extern int isDynamicMemory(struct object *);
 #ifndef BOOTSTRAP
 
     #define gcalloc(sz) (((intptr_t)(memoryPointer = WORDSDOWN(memoryPointer, (sz) + 2)) < \
-                          (intptr_t)memoryBase) ? gcollect(sz) : \
+                          (intptr_t)memoryLimit) ? gcollect(sz) : \
                          (SET_SIZE(memoryPointer, (sz)), memoryPointer))
 
 
@@ -173,8 +226,10 @@ extern struct object *gcalloc(int);
 #endif
 
 
-extern int64_t gc_count;
-extern int64_t gc_total_time;
-extern int64_t gc_max_time;
-extern int64_t gc_total_mem_copied;
-extern int64_t gc_mem_max_copied;
+extern int64_t gcallocated(void);
+
+extern VM_LOCAL int64_t gc_count;
+extern VM_LOCAL int64_t gc_total_time;
+extern VM_LOCAL int64_t gc_max_time;
+extern VM_LOCAL int64_t gc_total_mem_copied;
+extern VM_LOCAL int64_t gc_mem_max_copied;
@@ -1,3 +1,6 @@
+/* for memmem() */
+#define _GNU_SOURCE
+
 #include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -9,6 +12,10 @@
 #include <inttypes.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
@@ -18,6 +25,10 @@
 #include "interp.h"
 #include "memory.h"
 #include "globals.h"
+#include "image.h"
+#include "event.h"
+#include "isolate.h"
+#include "timer.h"
 
 
 /* temporary directory is shared. */
@@ -26,24 +37,76 @@
 char *tmpdir = NULL;
 
 
-#define SOCK_BUF_SIZE 1024
-static uint8_t socketReadBuffer[SOCK_BUF_SIZE] = {0,};
+#define SOCK_BUF_SIZE 16384
+static VM_LOCAL uint8_t socketReadBuffer[SOCK_BUF_SIZE] = {0,};
 
 #define FILEMAX 200
-static FILE *filePointers[FILEMAX] = {0,};
+static VM_LOCAL FILE *filePointers[FILEMAX] = {0,};
 
 /*
-These static character strings are used for URL conversion
+These static character strings are used for URL conversion.  They are
+expanded into 256-entry tables the first time a URL is converted.
 */
 
 static char * badURLChars = ";/?:@&=+!*'(),$-_.<>#%\"\t\n\r";
 static char * hexDigits = "0123456789ABCDEF";
 
+#define URL_ESCAPE (1)                  /* the byte becomes %XX */
+#define URL_SPACE (2)                   /* the byte becomes + */
+static VM_LOCAL uint8_t urlEscapeTable[256];     /* how each byte is encoded, 0 if it is kept */
+static VM_LOCAL int8_t urlHexTable[256];         /* value of a hex digit, -1 if not one */
+static VM_LOCAL int urlTablesReady = 0;
+
+/*
+The canonical Char instances for byte values, built on first use.
+*/
+
+#define CHAR_TABLE_SIZE (256)
+static VM_LOCAL struct object * charTable = NULL;
+
+/*
+The child process writing a background snapshot of the image, 0 if
+there is none.  It is only reaped when the image polls for it.
+*/
+
+static VM_LOCAL pid_t snapshotPid = 0;
+
+/*
+The number of worker processes to fork once the server socket is
+bound, 0 to keep serving from this process.  Set by the -workers
+option.
+*/
+
+int preforkWorkers = 0;
+
 
 /* forward refs for helper functions. */
 static void getUnixString(char * to, int size, struct object * from);
 static struct object * stringToUrl(struct byteObject * from);
 static struct object * urlToString(struct byteObject * from);
+static void urlTablesInit(void);
+static struct object * urlDecodeRange(struct object * from, int start, int size);
+static struct object * formToArray(struct object * body);
+static struct object * bufferAppend(struct object * buf, struct object * src);
+static struct object * bufferContents(struct object * buf);
+static int byteCompare(struct object * left, struct object * right);
+static struct object * charObject(int value);
+static int bytePattern(struct object * pat, uint8_t * byte, const uint8_t ** bytes, size_t * size);
+static struct object * stringIndexOf(struct object * str, struct object * pat, struct object * start);
+static struct object * stringOccurrencesOf(struct object * str, struct object * pat);
+static struct object * stringIndexOfByte(struct object * str, struct object * byte, struct object * from, struct object * to);
+static struct object * snapshotStart(struct object * name);
+static struct object * snapshotPoll(void);
+static struct object * sourceRead(struct object * path, struct object * offset);
+static struct object * sourceAppend(struct object * path, struct object * text);
+static void preforkStart(int sock);
+static struct object * asyncStart(struct object * args);
+static struct object * asyncFinish(struct object * args);
+static struct object * isolatePrimitive(struct object * args);
+static struct object * timerPrimitive(struct object * args);
+static struct object * usagePrimitive(struct object * args);
+static struct object * regionPrimitive(struct object * args);
+static int editWork(uint8_t ** buffer, size_t size);
 
 
 
@@ -56,7 +119,6 @@ struct object *primitive(int primitiveNumber, struct object *args, int *failed)
 {
     struct object *returnedValue = nilObject;
     int i, j;
-    int rc;
     FILE *fp;
     uint8_t *p;
     struct byteObject *stringReturn;
@@ -134,6 +196,7 @@ struct object *primitive(int primitiveNumber, struct object *args, int *failed)
             break;
         }
         fclose(fp);
+        filePointers[i] = NULL;
         break;
 
     case 104:	/* file out image */
@@ -148,78 +211,24 @@ struct object *primitive(int primitiveNumber, struct object *args, int *failed)
     case 105:
     {
         /* edit a string */
-        char *tmpFileName = NULL;
-        size_t tmpFileNameSize = 0;
-
-        /* first get the size needed for the temporary path */
-        tmpFileNameSize = (size_t)snprintf(tmpFileName, 0, "%s/lsteditXXXXXX", tmpdir) + 1;
-
-        info("temporary file name size is %d", (int)tmpFileNameSize);
-
-        /* allocate it on the stack and write the string into it. */
-        tmpFileName = (char *)alloca((size_t)tmpFileNameSize + 1);
-        memset(tmpFileName, 0, tmpFileNameSize + 1);
-        snprintf(tmpFileName, tmpFileNameSize + 1, "%s/lsteditXXXXXX", tmpdir);
-
-        info("DEBUG: temp file name pattern: %s",tmpFileName);
-
-        rc = mkstemp(tmpFileName);
-        /* copy string to file */
-        if(rc == -1) {
-            error("error making temporary file name: errno=%d!", errno);
-        }
-
-        fp = fopen(tmpFileName, "w");
-        if (fp == NULL) {
-            error("cannot open temp edit file %s!", tmpFileName);
-        }
+        uint8_t *text;
 
         j = SIZE(args->data[0]);
-        p = ((struct byteObject *) args->data[0])->bytes;
-
-        for (i = 0; i < j; i++) {
-            fputc(*p++, fp);
+        text = (uint8_t *)malloc((size_t)j + 1);
+        if (text == NULL) {
+            error("cannot allocate a buffer to edit %d bytes!", j);
         }
-        fputc('\n', fp);
+        memcpy(text, bytePtr(args->data[0]), (size_t)j);
 
-        fclose(fp);
-
-        /* call the editor */
-        size_t cmdBufSize = tmpFileNameSize + strlen("vi ");
-        char *cmdBuf = (char*)alloca(cmdBufSize + 1);
-        memset(cmdBuf, 0, cmdBufSize + 1);
-
-        strcpy(cmdBuf,"vi ");
-        strcat(cmdBuf, tmpFileName);
-        rc = system(cmdBuf);
-
-        if(rc == -1) {
-            error("error starting editor: %d!",(int)errno);
+        j = editWork(&text, (size_t)j);
+        if (j < 0) {
+            error("cannot edit a string, errno=%d!", -j);
         }
 
-        /* copy back to new string */
-        fp = fopen(tmpFileName, "r");
-        if (fp == NULL) {
-            error("cannot open temp edit file %s!", tmpFileName);
-        }
-
-        /* get length of file */
-        fseek(fp, 0, 2);
-        j = (int) ftell(fp);
-
         returnedValue = (struct object *)(stringReturn = (struct byteObject *)gcialloc(j));
         returnedValue->class = args->data[0]->class;
-
-        /* reset to beginning, and read values */
-        fseek(fp, 0, 0);
-
-        /* FIXME - check for EOF! */
-        for (i = 0; i < j; i++) {
-            stringReturn->bytes[i] = (uint8_t)fgetc(fp);
-        }
-        /* now clean up files */
-        fclose(fp);
-        unlink(tmpFileName);
+        memcpy(stringReturn->bytes, text, (size_t)j);
+        free(text);
     }
 
     break;
@@ -247,6 +256,7 @@ struct object *primitive(int primitiveNumber, struct object *args, int *failed)
         }
 
         /* Do the I/O */
+        WRITE_BARRIER(returnedValue);
         i = (int)fread(bytePtr(returnedValue), sizeof(char), (size_t)i, fp);
         if (i < 0) {
             *failed = 1;
@@ -305,63 +315,128 @@ struct object *primitive(int primitiveNumber, struct object *args, int *failed)
         returnedValue = newInteger(i);
         break;
 
+    case 109:	/* write a snapshot of the image from a child process */
+        returnedValue = snapshotStart(args->data[0]);
+        if(!returnedValue) {
+            *failed = 1;
+            returnedValue = nilObject;
+        }
+        break;
+
+    case 110:	/* poll the background snapshot */
+        returnedValue = snapshotPoll();
+        break;
 
-    case 150:	/* match substring in a string. Return index of substring or fail. */
-        /* make sure we've got strings */
-        if(!IS_BINOBJ(args->data[0])) {
-            printf("#position: failed, first arg is not a binary object.\n");
+    case 111:	/* file out the objects changed since the last image */
+        i = integerValue(args->data[0]);
+        if ((i < 0) || (i >= FILEMAX) || !(fp = filePointers[i])) {
             *failed = 1;
             break;
         }
-
-        if(!IS_BINOBJ(args->data[1])) {
-            printf("#position: failed, second arg is not a binary object.\n");
+        i = fileOutDelta(fp);
+        if (i < 0) {
             *failed = 1;
             break;
         }
+        returnedValue = newInteger(i);
+        break;
+
+    case 112:	/* read method text from a source file, args: path, offset */
+        returnedValue = sourceRead(args->data[0], args->data[1]);
+        if(!returnedValue) {
+            *failed = 1;
+            returnedValue = nilObject;
+        }
+        break;
+
+    case 113:	/* append method text to a source file, args: path, string */
+        returnedValue = sourceAppend(args->data[0], args->data[1]);
+        if(!returnedValue) {
+            *failed = 1;
+            returnedValue = nilObject;
+        }
+        break;
+
+    case 120:	/* start asynchronous I/O, args: op, file or socket, arg, arg, semaphore */
+        returnedValue = asyncStart(args);
+        if(!returnedValue) {
+            *failed = 1;
+            returnedValue = nilObject;
+        }
+        break;
+
+    case 121:	/* result of asynchronous I/O, args: request, op, file or socket, buffer */
+        returnedValue = asyncFinish(args);
+        if(!returnedValue) {
+            *failed = 1;
+            returnedValue = nilObject;
+        }
+        break;
+
+    case 122:	/* isolates, args: op, arg, arg */
+        returnedValue = isolatePrimitive(args);
+        if(!returnedValue) {
+            *failed = 1;
+            returnedValue = nilObject;
+        }
+        break;
 
-        /* get the sizes of the strings */
-        i = SIZE(args->data[0]);
-        j = SIZE(args->data[1]);
+    case 123:	/* timers, args: op, arg, arg */
+        returnedValue = timerPrimitive(args);
+        if(!returnedValue) {
+            *failed = 1;
+            returnedValue = nilObject;
+        }
+        break;
 
-        /*
-         * don't bother to compare if either string has a zero length
-         * or the second string is longer than the first
-         */
+    case 124:	/* process usage, args: op, process, arg, arg, arg */
+        returnedValue = usagePrimitive(args);
+        if(!returnedValue) {
+            *failed = 1;
+            returnedValue = nilObject;
+        }
+        break;
 
-        if((i > 0) && (j > 0) && (i>=j)) {
-            /* using alloca to make sure that the memory is freed automatically */
-            char *p = (char *)alloca((size_t)i+1);
-            char *q = (char *)alloca((size_t)j+1);
-            char *r = (char *)0;
+    case 125:	/* regions, args: op */
+        returnedValue = regionPrimitive(args);
+        if(!returnedValue) {
+            *failed = 1;
+            returnedValue = nilObject;
+        }
+        break;
 
-            getUnixString(p,i+1,args->data[0]);
-            getUnixString(q,j+1,args->data[1]);
 
-            /* find the pointer to the substring */
-            r = strstr(p,q);
+    case 150: /* this is a set of primitives for searching byte objects */
+        if(!IS_SMALLINT(args->data[0])) {
+            *failed = 1;
+            break;
+        }
 
-            if(r != NULL) {
-                /* the string was found */
-                returnedValue = newInteger((r-p)+1);
-            } else {
-                returnedValue = nilObject;
-            }
+        subPrim = integerValue(args->data[0]);
 
-            /* success */
+        switch(subPrim) {
+        case 0: /* index of a substring or byte at or after an offset, args: string, pattern, start */
+            returnedValue = stringIndexOf(args->data[1], args->data[2], args->data[3]);
             break;
-        } else {
-            if((i<0) || (j<0)) {
-                printf("#position: failed due to unusable string sizes, string 1 size %d, string 2 size %d.\n", i, j);
-            } else {
-                /* i==0 or j==0 or i<j in which case we have no match but no error. */
-                returnedValue = nilObject;
-                break;
-            }
+
+        case 1: /* count of non-overlapping occurrences, args: string, pattern */
+            returnedValue = stringOccurrencesOf(args->data[1], args->data[2]);
+            break;
+
+        case 2: /* index of a byte value within a range, args: string, byte, from, to */
+            returnedValue = stringIndexOfByte(args->data[1], args->data[2], args->data[3], args->data[4]);
+            break;
+
+        default:
+            returnedValue = NULL;
+            break;
+        }
+
+        if(!returnedValue) {
+            *failed = 1;
+            returnedValue = nilObject;
         }
 
-        /* if we get here, we've failed */
-        *failed = 1;
         break;
 
     case 151: /* convert a string to URL encoding, returns nil or string */
@@ -375,6 +450,81 @@ struct object *primitive(int primitiveNumber, struct object *args, int *failed)
 
         break;
 
+    case 153: /* append a byte object or a single byte value to a StringBuffer */
+        returnedValue = bufferAppend(args->data[0], args->data[1]);
+
+        if(!returnedValue) {
+            *failed = 1;
+            returnedValue = nilObject;
+        }
+
+        break;
+
+    case 154: /* return the contents of a StringBuffer as a new String */
+        returnedValue = bufferContents(args->data[0]);
+
+        if(!returnedValue) {
+            *failed = 1;
+            returnedValue = nilObject;
+        }
+
+        break;
+
+    case 155: /* three-way compare of two byte objects, returns -1, 0 or 1 */
+        if(IS_SMALLINT(args->data[0]) || !IS_BINOBJ(args->data[0]) ||
+           IS_SMALLINT(args->data[1]) || !IS_BINOBJ(args->data[1])) {
+            *failed = 1;
+            break;
+        }
+
+        returnedValue = newInteger(byteCompare(args->data[0], args->data[1]));
+
+        break;
+
+    case 156: /* find the Node holding a byte object key, returns the Node or nil */
+        returnedValue = treeFind(args->data[0], args->data[1]);
+
+        if(!returnedValue) {
+            *failed = 1;
+            returnedValue = nilObject;
+        }
+
+        break;
+
+    case 157: /* return the shared Char for a byte value */
+        if(!IS_SMALLINT(args->data[0]) || !(returnedValue = charObject(integerValue(args->data[0])))) {
+            *failed = 1;
+            returnedValue = nilObject;
+        }
+
+        break;
+
+    case 158: /* return the shared Char at an index in a byte object */
+        if(IS_SMALLINT(args->data[0]) || !IS_BINOBJ(args->data[0]) || !IS_SMALLINT(args->data[1])) {
+            *failed = 1;
+            break;
+        }
+
+        i = integerValue(args->data[1]) - 1;
+
+        if((i < 0) || ((uint32_t)i >= SIZE(args->data[0])) ||
+           !(returnedValue = charObject(bytePtr(args->data[0])[i]))) {
+            *failed = 1;
+            returnedValue = nilObject;
+        }
+
+        break;
+
+    case 159: /* decode a form-urlencoded string into an Array of key, value Strings */
+        returnedValue = formToArray(args->data[0]);
+
+        if(!returnedValue) {
+            *failed = 1;
+            returnedValue = nilObject;
+        }
+
+        break;
+
     /* large timestamps */
     case 160: /* print out a microsecond timestamp and message string. */
         {
@@ -440,7 +590,8 @@ struct object *primitive(int primitiveNumber, struct object *args, int *failed)
         /* 200-250 socket handling */
         switch(subPrim) {
         case 0: /* open a TCP socket */
-            sock = socket(PF_INET,SOCK_STREAM,0);
+            /* sockets never block the VM, see the wait primitive */
+            sock = socket(PF_INET,SOCK_STREAM | SOCK_NONBLOCK,0);
 
             if(sock == -1) {
                 error("Cannot open TCP socket.");
@@ -464,7 +615,7 @@ struct object *primitive(int primitiveNumber, struct object *args, int *failed)
         case 1: /* accept on a socket */
             sock = integerValue(args->data[1]);
 
-            if(listen(sock, 10) == -1) {
+            if(listen(sock, SOMAXCONN) == -1) {
                 error("Error listening on TCP socket.");
             }
 
@@ -473,9 +624,16 @@ struct object *primitive(int primitiveNumber, struct object *args, int *failed)
 
             /* printf("accept(%d, %p, %d)\n", sock, &myAddr, myAddrSize); */
 
-            sock = accept(sock, &myAddr, &myAddrSize);
+            /* nil when no connection is waiting */
+            sock = accept4(sock, &myAddr, &myAddrSize, SOCK_NONBLOCK);
             if(sock == -1) {
-                error("Error accepting on TCP socket.  Errno=%d", errno);
+                if((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ECONNABORTED) || (errno == EINTR)) {
+                    break;
+                }
+
+                info("accept on TCP socket failed, errno=%d", errno);
+                *failed = 1;
+                break;
             }
 
             returnedValue = newInteger(sock);
@@ -487,6 +645,7 @@ struct object *primitive(int primitiveNumber, struct object *args, int *failed)
 
             info("closing socket %d.", sock);
 
+            eventForget(sock);
             close(sock);
 
             returnedValue = trueObject;
@@ -520,19 +679,25 @@ struct object *primitive(int primitiveNumber, struct object *args, int *failed)
                 error("Cannot bind TCP socket to address.");
             }
 
+            /* the workers all accept on this socket from here on */
+            if(preforkWorkers > 0) {
+                preforkStart(sock);
+            }
+
             returnedValue = trueObject;
 
             break;
 
         case 7: /* read from a TCP socket.  This returns a byte array. */
+            /* nil if there is nothing to read yet, empty at the end */
             sock = integerValue(args->data[1]);
 
-            for(i=0; i<SOCK_BUF_SIZE; i++) {
-                socketReadBuffer[i]=(char)0;
-            }
-
             i = (int)read(sock,(void *)socketReadBuffer,(size_t)SOCK_BUF_SIZE);
-            if((i < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            if(i < 0) {
+                if((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+                    break;
+                }
+
                 info("socket read returned an error: %d (%d)!", i, errno);
                 *failed = 1;
                 break;
@@ -544,34 +709,59 @@ struct object *primitive(int primitiveNumber, struct object *args, int *failed)
             ba->class = ByteArrayClass;
 
             /* copy data into the new ByteArray */
-            for(j=0; j<i; j++) {
-                bytePtr(ba)[j] = socketReadBuffer[j];
-            }
+            memcpy(bytePtr(ba), socketReadBuffer, i);
 
             returnedValue = (struct object *)ba;
 
             break;
 
-        case 8: /* write to a socket, args: sock, data */
+        case 8: /* write to a socket, args: sock, data, optional offset */
             sock = integerValue(args->data[1]);
             p = (uint8_t *)bytePtr(args->data[2]);
             i = SIZE(args->data[2]);
 
+            if(SIZE(args) > 3) {
+                j = integerValue(args->data[3]);
+                if((j < 0) || (j > i)) {
+                    *failed = 1;
+                    break;
+                }
+                p += j;
+                i -= j;
+            }
+
             /*printf("Writing: ");
             snprintf(socketReadBuffer,i,"%s",p);
             socketReadBuffer[i] = (char)0;
             printf("%s\n",socketReadBuffer);
             */
 
-            j = (int)write(sock,(void *)p,(size_t)i);
+            /* a client that went away must not take the VM with it */
+            j = (int)send(sock,(void *)p,(size_t)i,MSG_NOSIGNAL);
 
-            if(j>0)
+            /* 0 if the socket can not take more yet, nil on error */
+            if(j>=0)
                 returnedValue = newInteger(j);
+            else if((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+                returnedValue = newInteger(0);
             else
                 returnedValue = nilObject;
 
             break;
 
+        case 10: /* signal a Semaphore once a socket is ready, args: sock, mode, semaphore */
+            sock = integerValue(args->data[1]);
+
+            if(eventWaitFor(sock, integerValue(args->data[2]), args->data[3]) == -1) {
+                info("cannot wait on socket %d, errno=%d", sock, errno);
+                *failed = 1;
+                break;
+            }
+
+            returnedValue = trueObject;
+
+            break;
+
         default: /* unknown socket primitive */
             error("Unknown socket primitive operation: %d!",subPrim);
             break;
@@ -676,34 +866,81 @@ struct object *do_Integer(int op, struct object *low, struct object *high)
 
 
 
+/**
+ * urlTablesInit
+ *
+ * Fill in the URL conversion tables.  Everything in badURLChars is
+ * escaped, as are control characters and bytes outside of 7-bit ASCII.
+ * Spaces become plusses.
+ */
+
+void urlTablesInit(void)
+{
+    int i;
+    char *p;
+
+    for(i = 0; i < 256; i++) {
+        urlEscapeTable[i] = ((i < 0x20) || (i >= 0x7F)) ? URL_ESCAPE : 0;
+        urlHexTable[i] = -1;
+    }
+
+    for(p = badURLChars; *p; p++) {
+        urlEscapeTable[(uint8_t)*p] = URL_ESCAPE;
+    }
+
+    urlEscapeTable[' '] = URL_SPACE;
+
+    for(i = 0; i < 16; i++) {
+        urlHexTable[(uint8_t)hexDigits[i]] = (int8_t)i;
+        urlHexTable[tolower((uint8_t)hexDigits[i])] = (int8_t)i;
+    }
+
+    urlTablesReady = 1;
+}
+
+
+
+
 /**
  * stringToUrl
  *
  * convert the passed string object to a URL safe set of characters.
- * Returns a String object.
+ * Runs of bytes that need no escaping are copied as a block.
+ * Returns a String object, or nil if the argument is not a byte object.
  */
 
 struct object * stringToUrl(struct byteObject * from)
 {
-    int i,j;
+    int i, j, run;
     struct byteObject *newStr = NULL;
     int new_size = 0;
     int bad_chars = 0;
-    int fsize = SIZE(from);
-    char *from_ptr = (char *)bytePtr(from);
-    char *to_ptr = NULL;
-    char c;
+    int fsize;
+    uint8_t *from_ptr;
+    uint8_t *to_ptr;
+    uint8_t c;
+
+    if(IS_SMALLINT(from) || !IS_BINOBJ(from)) {
+        return nilObject;
+    }
+
+    if(!urlTablesReady) {
+        urlTablesInit();
+    }
+
+    fsize = (int)SIZE(from);
+    from_ptr = bytePtr(from);
 
     /* count bad chars */
     for(i=0; i<fsize; i++) {
-        if(NULL != strchr(badURLChars,from_ptr[i])) {
+        if(urlEscapeTable[from_ptr[i]] == URL_ESCAPE) {
             bad_chars++;
         }
     }
 
     /* we're going to allocate, so we need to make sure that nothing can
     move out from underneath us. */
-    rootStack[rootTop++] = (struct object *)from;
+    PUSH_ROOT((struct object *)from);
 
     /* allocate enough space for the new string.  Note that
     the size is increased by two for every bad char.  This is
@@ -716,31 +953,35 @@ struct object * stringToUrl(struct byteObject * from)
     newStr->class = StringClass;
 
     /* OK, now done with allocation, get the from string back */
-    from = (struct byteObject *)rootStack[--rootTop];
-    from_ptr = (char *)from->bytes;
-
-    /* did allocation succeed? */
-    if(NULL == newStr) {
-        error("stringToUrl(): unable to allocate string!");
-        return nilObject;
-    }
+    from = (struct byteObject *)POP_ROOT();
+    from_ptr = bytePtr(from);
 
     /* copy the characters */
     j = 0;
-    to_ptr = (char *)newStr->bytes;
+    to_ptr = bytePtr(newStr);
 
-    for(i=0; i<fsize && j<new_size; i++) {
-        if(strchr(badURLChars,from_ptr[i])) {
-            to_ptr[j++] = '%';
-            to_ptr[j++] = hexDigits[0x0F & ((from_ptr[i])>>4)];
-            to_ptr[j++] = hexDigits[0x0F & (from_ptr[i])];
-        } else {
-            /* convert spaces to plusses too, but this doesn't change the string size. */
-            c = from_ptr[i];
+    for(i=0; i<fsize; ) {
+        /* copy the run of characters that are safe as they are */
+        for(run = i; run < fsize && !urlEscapeTable[from_ptr[run]]; run++) {
+            /* nothing */
+        }
 
-            if(c == ' ')
-                c = '+';
-            to_ptr[j++] = c;
+        if(run > i) {
+            memcpy(to_ptr + j, from_ptr + i, (size_t)(run - i));
+            j += run - i;
+            i = run;
+            continue;
+        }
+
+        c = from_ptr[i++];
+
+        if(urlEscapeTable[c] == URL_SPACE) {
+            /* convert spaces to plusses, this doesn't change the string size. */
+            to_ptr[j++] = '+';
+        } else {
+            to_ptr[j++] = '%';
+            to_ptr[j++] = (uint8_t)hexDigits[0x0F & (c >> 4)];
+            to_ptr[j++] = (uint8_t)hexDigits[0x0F & c];
         }
     }
 
@@ -751,121 +992,1749 @@ struct object * stringToUrl(struct byteObject * from)
 
 
 /**
- * urlToString
+ * urlDecodedSize
  *
- * convert the passed string object from a URL safe set of characters.
- * Returns a String object.
+ * Work out how many bytes a URL encoded range decodes to.
+ * Returns -1 if the range has a malformed % escape.
  */
 
-struct object * urlToString(struct byteObject * from)
+static int urlDecodedSize(const uint8_t *src, int size)
 {
-    int i,j;
-    struct byteObject *newStr = NULL;
-    int new_size = 0;
-    int url_chars = 0;
-    int fsize = (int)SIZE(from);
-    char *from_ptr = (char *)bytePtr(from);
-    char *to_ptr = NULL;
-    int is_hex=0;
-    int hex_val;
-    char c;
-
-    /* count unpacked chars */
-    for(i=0; i<fsize; i++) {
-        if('%' == from_ptr[i]) {
-            url_chars++;
+    int i;
+    int count = 0;
+
+    for(i = 0; i < size; i++) {
+        if(src[i] == '%') {
+            if((i + 2 >= size) || (urlHexTable[src[i+1]] < 0) || (urlHexTable[src[i+2]] < 0)) {
+                return -1;
+            }
+
+            i += 2;
         }
-    }
 
-    /* we're going to allocate, so we need to make sure that nothing can
-    move out from underneath us. */
-    rootStack[rootTop++] = (struct object *)from;
+        count++;
+    }
 
-    /* allocate enough space for the new string.  Note that
-    the size is decreased by two for every URL char.  This is
-    because a URL-safe replacement is a "%" char followed by two
-    hex digits. The "%" replaces the original character and the two
-    hex digits are added. */
+    return count;
+}
 
-    new_size = fsize - (url_chars * 2);
 
-    if(new_size<0)
-        new_size = 0;
 
-    newStr = (struct byteObject *)gcialloc(new_size);
-    newStr->class = StringClass;
+/**
+ * urlDecodeRange
+ *
+ * Decode size bytes of the byte object from, starting at the zero-based
+ * index start, into a new String.  Plusses become spaces and %XX escapes
+ * become the byte they name; runs of other bytes are copied as a block.
+ *
+ * Returns the String, or NULL if the range has a malformed escape.
+ */
 
-    /* OK, now done with allocation, get the from string back */
-    from = (struct byteObject *)rootStack[--rootTop];
-    from_ptr = (char *)bytePtr(from);
+struct object * urlDecodeRange(struct object * from, int start, int size)
+{
+    struct object *newStr;
+    const uint8_t *src;
+    uint8_t *dst;
+    int new_size;
+    int i, j, run;
+
+    if(!urlTablesReady) {
+        urlTablesInit();
+    }
 
-    /* Did allocation succeed? */
-    if(NULL == newStr) {
-        error("urlToString(): unable to allocate string!");
-        return nilObject;
+    new_size = urlDecodedSize(bytePtr(from) + start, size);
+    if(new_size < 0) {
+        return NULL;
     }
 
-    /* copy the characters */
-    j = 0;
-    to_ptr = (char *)bytePtr(newStr);
-    is_hex = 0;
+    /* we're going to allocate, so we need to make sure that nothing can
+    move out from underneath us. */
+    PUSH_ROOT(from);
+
+    newStr = gcialloc(new_size);
+    newStr->class = StringClass;
+
+    from = POP_ROOT();
+
+    src = bytePtr(from) + start;
+    dst = bytePtr(newStr);
+    j = 0;
+
+    for(i = 0; i < size; ) {
+        for(run = i; run < size && src[run] != '%' && src[run] != '+'; run++) {
+            /* nothing */
+        }
+
+        if(run > i) {
+            memcpy(dst + j, src + i, (size_t)(run - i));
+            j += run - i;
+            i = run;
+            continue;
+        }
+
+        if(src[i] == '+') {
+            dst[j++] = ' ';
+            i++;
+        } else {
+            dst[j++] = (uint8_t)((urlHexTable[src[i+1]] << 4) | urlHexTable[src[i+2]]);
+            i += 3;
+        }
+    }
+
+    return newStr;
+}
+
+
+
+
+/**
+ * urlToString
+ *
+ * convert the passed string object from a URL safe set of characters.
+ * Returns a String object, or nil if the string is not validly encoded.
+ */
+
+struct object * urlToString(struct byteObject * from)
+{
+    struct object *result;
+
+    if(IS_SMALLINT(from) || !IS_BINOBJ(from)) {
+        return nilObject;
+    }
+
+    result = urlDecodeRange((struct object *)from, 0, (int)SIZE(from));
+
+    return result ? result : nilObject;
+}
+
+
+
+
+/**
+ * formToArray
+ *
+ * Decode an application/x-www-form-urlencoded string, key=value fields
+ * separated by ampersands, in one pass.  Empty fields are skipped.  A
+ * field without an = or with nothing after it has a nil value.
+ *
+ * Returns an Array of alternating key and value Strings, or NULL if the
+ * argument is not a byte object or a field is not validly encoded.
+ */
+
+struct object * formToArray(struct object * body)
+{
+    struct object *result;
+    struct object *str;
+    const uint8_t *bytes;
+    const uint8_t *amp;
+    const uint8_t *eq;
+    int size;
+    int fields = 0;
+    int start, end, keyEnd;
+    int index;
+    int i;
+
+    if(IS_SMALLINT(body) || !IS_BINOBJ(body)) {
+        return NULL;
+    }
+
+    /* count the non-empty fields to size the result */
+    size = (int)SIZE(body);
+    bytes = bytePtr(body);
+
+    for(start = 0; start < size; start = end + 1) {
+        amp = memchr(bytes + start, '&', (size_t)(size - start));
+        end = amp ? (int)(amp - bytes) : size;
+
+        if(end > start) {
+            fields++;
+        }
+    }
+
+    PUSH_ROOT(body);
+
+    result = gcalloc(fields * 2);
+    result->class = ArrayClass;
+    for(i = 0; i < fields * 2; i++) {
+        result->data[i] = nilObject;
+    }
+
+    PUSH_ROOT(result);
+
+    /* the body and result are on the root stack and may move as we go. */
+    index = 0;
+
+    for(start = 0; start < size; start = end + 1) {
+        bytes = bytePtr(rootStack[rootTop - 2]);
+        amp = memchr(bytes + start, '&', (size_t)(size - start));
+        end = amp ? (int)(amp - bytes) : size;
+
+        if(end == start) {
+            continue;
+        }
+
+        eq = memchr(bytes + start, '=', (size_t)(end - start));
+        keyEnd = eq ? (int)(eq - bytes) : end;
+
+        str = urlDecodeRange(rootStack[rootTop - 2], start, keyEnd - start);
+        if(!str) {
+            rootTop -= 2;
+            return NULL;
+        }
+
+        rootStack[rootTop - 1]->data[index] = str;
+
+        if(keyEnd + 1 < end) {
+            str = urlDecodeRange(rootStack[rootTop - 2], keyEnd + 1, end - (keyEnd + 1));
+            if(!str) {
+                rootTop -= 2;
+                return NULL;
+            }
+
+            rootStack[rootTop - 1]->data[index + 1] = str;
+        }
+
+        index += 2;
+    }
+
+    result = POP_ROOT();
+    --rootTop;
+
+    return result;
+}
+
+
+
+
+/* smallest backing store allocated for a StringBuffer that has none. */
+#define STRING_BUFFER_MIN_CAPACITY (32)
+
+/* largest backing store, the most bytes an object's size can hold. */
+#define STRING_BUFFER_MAX_CAPACITY ((int)(UINT32_MAX >> 3))
+
+/**
+ * bufferAppend
+ *
+ * append the bytes of a binary object, or a single byte given as a
+ * SmallInt, to the end of a StringBuffer.  The backing String is
+ * doubled in size when it fills up so that appends are amortized O(1).
+ * Returns the buffer or NULL if the arguments are not usable or the
+ * bytes would not fit in the largest String there can be.
+ */
+
+struct object * bufferAppend(struct object * buf, struct object * src)
+{
+    struct object *bytes;
+    struct object *newBytes;
+    int count;
+    int srcSize;
+    int capacity;
+    int newCapacity;
+
+    if(IS_SMALLINT(buf) || IS_BINOBJ(buf) || SIZE(buf) <= countInStringBuffer) {
+        return NULL;
+    }
+
+    if(!IS_SMALLINT(buf->data[countInStringBuffer])) {
+        return NULL;
+    }
+
+    count = integerValue(buf->data[countInStringBuffer]);
+
+    /* a SmallInt is a single byte, anything else must be binary */
+    if(IS_SMALLINT(src)) {
+        if((integerValue(src) < 0) || (integerValue(src) > 255)) {
+            return NULL;
+        }
+
+        srcSize = 1;
+    } else if(IS_BINOBJ(src)) {
+        srcSize = SIZE(src);
+    } else {
+        return NULL;
+    }
+
+    bytes = buf->data[bufferInStringBuffer];
+    if(NOT_NIL(bytes)) {
+        if(IS_SMALLINT(bytes) || !IS_BINOBJ(bytes)) {
+            return NULL;
+        }
+
+        capacity = SIZE(bytes);
+    } else {
+        capacity = 0;
+    }
+
+    if((count < 0) || (count > capacity)) {
+        return NULL;
+    }
+
+    WRITE_BARRIER(buf);
+
+    /* grow geometrically if the new bytes will not fit. */
+    if(srcSize > capacity - count) {
+        if(srcSize > STRING_BUFFER_MAX_CAPACITY - count) {
+            return NULL;
+        }
+
+        newCapacity = (capacity > 0) ? capacity : STRING_BUFFER_MIN_CAPACITY;
+
+        /* doubling stops at the largest size, which is known to fit */
+        while(newCapacity - count < srcSize) {
+            newCapacity = (newCapacity > STRING_BUFFER_MAX_CAPACITY / 2) ? STRING_BUFFER_MAX_CAPACITY : newCapacity * 2;
+        }
+
+        /* we're going to allocate, keep the buffer and the source safe. */
+        PUSH_ROOT(buf);
+        PUSH_ROOT(src);
+
+        newBytes = gcialloc(newCapacity);
+        newBytes->class = StringClass;
+
+        src = POP_ROOT();
+        buf = POP_ROOT();
+
+        bytes = buf->data[bufferInStringBuffer];
+        if(count > 0) {
+            memcpy(bytePtr(newBytes), bytePtr(bytes), (size_t)count);
+        }
+
+        buf->data[bufferInStringBuffer] = newBytes;
+        bytes = newBytes;
+    }
+
+    WRITE_BARRIER(bytes);
+
+    if(IS_SMALLINT(src)) {
+        bytePtr(bytes)[count] = (uint8_t)integerValue(src);
+    } else if(srcSize > 0) {
+        memcpy(bytePtr(bytes) + count, bytePtr(src), (size_t)srcSize);
+    }
+
+    buf->data[countInStringBuffer] = newInteger(count + srcSize);
+
+    return buf;
+}
+
+
+
+
+/**
+ * bufferContents
+ *
+ * copy the used part of a StringBuffer's backing store into a new String.
+ * Returns NULL if the buffer is not usable.
+ */
+
+struct object * bufferContents(struct object * buf)
+{
+    struct object *result;
+    struct object *bytes;
+    int count;
+
+    if(IS_SMALLINT(buf) || IS_BINOBJ(buf) || SIZE(buf) <= countInStringBuffer) {
+        return NULL;
+    }
+
+    if(!IS_SMALLINT(buf->data[countInStringBuffer])) {
+        return NULL;
+    }
+
+    count = integerValue(buf->data[countInStringBuffer]);
+    bytes = buf->data[bufferInStringBuffer];
+
+    if(count < 0) {
+        return NULL;
+    }
+
+    if(count > 0 && (!NOT_NIL(bytes) || IS_SMALLINT(bytes) || !IS_BINOBJ(bytes) || (int)SIZE(bytes) < count)) {
+        return NULL;
+    }
+
+    PUSH_ROOT(buf);
+    result = gcialloc(count);
+    result->class = StringClass;
+    buf = POP_ROOT();
+
+    if(count > 0) {
+        memcpy(bytePtr(result), bytePtr(buf->data[bufferInStringBuffer]), (size_t)count);
+    }
+
+    return result;
+}
+
+
+
+
+/**
+ * byteCompare
+ *
+ * Compare two byte objects the way String>>< does: byte by byte, with
+ * a shorter string sorting before any longer one that it prefixes.
+ *
+ * Returns -1, 0 or 1 as left sorts before, equal to or after right.
+ */
+
+int byteCompare(struct object * left, struct object * right)
+{
+    uint32_t leftSize = SIZE(left);
+    uint32_t rightSize = SIZE(right);
+    int rc;
+
+    rc = memcmp(bytePtr(left), bytePtr(right), (size_t)(leftSize < rightSize ? leftSize : rightSize));
+
+    if(rc != 0) {
+        return (rc < 0) ? -1 : 1;
+    }
+
+    if(leftSize == rightSize) {
+        return 0;
+    }
+
+    return (leftSize < rightSize) ? -1 : 1;
+}
+
+
+
+
+/**
+ * treeFind
+ *
+ * Walk down a Tree of Nodes looking for a value equal to the key.  This
+ * is the lookup loop of Node>>find: for the common case of Symbol and
+ * String keys, which is what the Symbol table does on every intern.
+ *
+ * Returns the Node, nilObject if the key is not present, or NULL if the
+ * key or any value on the path is not a byte object and the Smalltalk
+ * code must do the comparisons itself.
+ */
+
+struct object * treeFind(struct object * node, struct object * key)
+{
+    struct object *value;
+    int rc;
+
+    if(IS_SMALLINT(key) || !IS_BINOBJ(key)) {
+        return NULL;
+    }
+
+    while(node != nilObject) {
+        if(IS_SMALLINT(node) || IS_BINOBJ(node) || SIZE(node) <= rightInNode) {
+            return NULL;
+        }
+
+        value = node->data[valueInNode];
+
+        if(IS_SMALLINT(value) || !IS_BINOBJ(value)) {
+            return NULL;
+        }
+
+        rc = byteCompare(value, key);
+
+        if(rc == 0) {
+            return node;
+        }
+
+        node = (rc < 0) ? node->data[rightInNode] : node->data[leftInNode];
+    }
+
+    return nilObject;
+}
+
+
+
+
+/**
+ * charObject
+ *
+ * Return the shared Char instance for a byte value, so that reading a
+ * String does not allocate an object per character.  The table is
+ * allocated the first time it is needed and kept as a static root.
+ *
+ * Returns NULL if the value is out of range or there is no Char class.
+ */
+
+struct object * charObject(int value)
+{
+    struct object *charClass;
+    struct object *c;
+    int i;
+
+    if((value < 0) || (value >= CHAR_TABLE_SIZE)) {
+        return NULL;
+    }
+
+    if(!charTable) {
+        charClass = lookupGlobal("Char");
+
+        if(!NOT_NIL(charClass)) {
+            return NULL;
+        }
+
+        /* the class has to survive the allocations below. */
+        PUSH_ROOT(charClass);
+
+        charTable = gcalloc(CHAR_TABLE_SIZE);
+        charTable->class = ArrayClass;
+        for(i = 0; i < CHAR_TABLE_SIZE; i++) {
+            charTable->data[i] = nilObject;
+        }
+
+        addStaticRoot(&charTable);
+
+        for(i = 0; i < CHAR_TABLE_SIZE; i++) {
+            c = gcalloc(1);
+            c->class = PEEK_ROOT();
+            c->data[0] = newInteger(i);
+            charTable->data[i] = c;
+        }
+
+        --rootTop;
+    }
+
+    return charTable->data[value];
+}
+
+
+/* close the files of a VM that is going away and forget its objects. */
+void primRelease(void)
+{
+    int i;
+
+    for(i = 0; i < FILEMAX; i++) {
+        if(filePointers[i]) {
+            fclose(filePointers[i]);
+            filePointers[i] = NULL;
+        }
+    }
+
+    charTable = NULL;
+}
+
+
+
+
+/**
+ * bytePattern
+ *
+ * Get the bytes to search for out of a search primitive argument.  This
+ * is either a byte object, or a SmallInt byte value standing for a
+ * single character.  The byte is used as the storage in the latter case.
+ *
+ * Returns 0 if the argument cannot be searched for.
+ */
+
+int bytePattern(struct object * pat, uint8_t * byte, const uint8_t ** bytes, size_t * size)
+{
+    if(IS_SMALLINT(pat)) {
+        if((integerValue(pat) < 0) || (integerValue(pat) > 255)) {
+            return 0;
+        }
+
+        *byte = (uint8_t)integerValue(pat);
+        *bytes = byte;
+        *size = 1;
+
+        return 1;
+    }
+
+    if(!IS_BINOBJ(pat)) {
+        return 0;
+    }
+
+    *bytes = bytePtr(pat);
+    *size = SIZE(pat);
+
+    return 1;
+}
+
+
+
+
+/**
+ * stringIndexOf
+ *
+ * Find the first occurrence of a pattern in a byte object at or after a
+ * one-based start index.  This searches the object in place with
+ * memchr()/memmem(), so embedded NULs are fine and nothing is copied.
+ *
+ * Returns the one-based index as a SmallInt, nilObject if there is no
+ * match, or NULL if the arguments are not usable.
+ */
+
+struct object * stringIndexOf(struct object * str, struct object * pat, struct object * start)
+{
+    const uint8_t *patBytes;
+    const uint8_t *found;
+    uint8_t patByte;
+    size_t patSize;
+    size_t strSize;
+    int offset;
+
+    if(IS_SMALLINT(str) || !IS_BINOBJ(str) || !IS_SMALLINT(start)) {
+        return NULL;
+    }
+
+    if(!bytePattern(pat, &patByte, &patBytes, &patSize)) {
+        return NULL;
+    }
+
+    offset = integerValue(start) - 1;
+    if(offset < 0) {
+        return NULL;
+    }
+
+    strSize = SIZE(str);
+
+    /* no match, but no error, if nothing can fit. */
+    if((patSize == 0) || ((size_t)offset >= strSize) || (patSize > strSize - (size_t)offset)) {
+        return nilObject;
+    }
+
+    if(patSize == 1) {
+        found = memchr(bytePtr(str) + offset, patBytes[0], strSize - (size_t)offset);
+    } else {
+        found = memmem(bytePtr(str) + offset, strSize - (size_t)offset, patBytes, patSize);
+    }
+
+    if(!found) {
+        return nilObject;
+    }
+
+    return newInteger((found - bytePtr(str)) + 1);
+}
+
+
+
+
+/**
+ * stringOccurrencesOf
+ *
+ * Count the non-overlapping occurrences of a pattern in a byte object.
+ * The pattern is a byte object or a Char; a SmallInt is not an element
+ * of a String, so it is left to Collection like any other object.
+ *
+ * Returns the count as a SmallInt, or NULL if the arguments are not usable.
+ */
+
+struct object * stringOccurrencesOf(struct object * str, struct object * pat)
+{
+    const uint8_t *patBytes;
+    const uint8_t *cur;
+    const uint8_t *end;
+    uint8_t patByte;
+    size_t patSize;
+    int count = 0;
+
+    if(IS_SMALLINT(str) || !IS_BINOBJ(str) || IS_SMALLINT(pat)) {
+        return NULL;
+    }
+
+    /* a Char stands for its byte value */
+    if(!IS_BINOBJ(pat) && SIZE(pat) == 1 && pat->class == lookupGlobal("Char")) {
+        pat = pat->data[0];
+    }
+
+    if(!bytePattern(pat, &patByte, &patBytes, &patSize)) {
+        return NULL;
+    }
+
+    if(patSize == 0) {
+        return newInteger(0);
+    }
+
+    cur = bytePtr(str);
+    end = cur + SIZE(str);
+
+    while((size_t)(end - cur) >= patSize) {
+        if(patSize == 1) {
+            cur = memchr(cur, patBytes[0], (size_t)(end - cur));
+        } else {
+            cur = memmem(cur, (size_t)(end - cur), patBytes, patSize);
+        }
+
+        if(!cur) {
+            break;
+        }
+
+        count++;
+        cur += patSize;
+    }
+
+    return newInteger(count);
+}
+
+
+
+
+/**
+ * stringIndexOfByte
+ *
+ * Find a byte value between two one-based indices, inclusive.  The range
+ * is clipped to the object.
+ *
+ * Returns the one-based index as a SmallInt, nilObject if the byte is not
+ * there, or NULL if the arguments are not usable.
+ */
+
+struct object * stringIndexOfByte(struct object * str, struct object * byte, struct object * from, struct object * to)
+{
+    const uint8_t *found;
+    int low;
+    int high;
+
+    if(IS_SMALLINT(str) || !IS_BINOBJ(str) || !IS_SMALLINT(byte) ||
+       !IS_SMALLINT(from) || !IS_SMALLINT(to)) {
+        return NULL;
+    }
+
+    if((integerValue(byte) < 0) || (integerValue(byte) > 255)) {
+        return NULL;
+    }
+
+    low = integerValue(from) - 1;
+    high = integerValue(to) - 1;
+
+    if(low < 0) {
+        low = 0;
+    }
+
+    if(high >= (int)SIZE(str)) {
+        high = (int)SIZE(str) - 1;
+    }
+
+    if(high < low) {
+        return nilObject;
+    }
+
+    found = memchr(bytePtr(str) + low, integerValue(byte), (size_t)(high - low + 1));
+
+    if(!found) {
+        return nilObject;
+    }
+
+    return newInteger((found - bytePtr(str)) + 1);
+}
+
+
+
+/*
+Fork a child that writes the image to a temporary file next to the
+named one and renames it into place when it is complete.  The child
+writes from its copy-on-write view of the heap while the parent keeps
+running.  Returns the pid of the child, or NULL if the name is not a
+string, a snapshot is already running or the fork failed.
+*/
+
+static struct object * snapshotStart(struct object * name)
+{
+    char path[PATH_MAX];
+    char tmpPath[PATH_MAX + 32];
+    pid_t pid;
+
+    if(IS_SMALLINT(name) || !IS_BINOBJ(name) || SIZE(name) == 0 || SIZE(name) >= sizeof(path)) {
+        return NULL;
+    }
+
+    /* do not throw away a result nobody has seen yet. */
+    if(snapshotPid) {
+        return NULL;
+    }
+
+    getUnixString(path, (int)sizeof(path), name);
+
+    /* anything buffered would be written twice otherwise. */
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+
+    if(pid < 0) {
+        return NULL;
+    }
+
+    if(pid == 0) {
+        FILE *fp;
+        int ok;
+
+        snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", path, (int)getpid());
+
+        if(!(fp = fopen(tmpPath, "w"))) {
+            _exit(1);
+        }
+
+        fileOut(fp);
+
+        ok = (fflush(fp) == 0) && (fsync(fileno(fp)) == 0);
+        ok = (fclose(fp) == 0) && ok;
+
+        if(!ok || rename(tmpPath, path) != 0) {
+            unlink(tmpPath);
+            _exit(2);
+        }
+
+        _exit(0);
+    }
+
+    snapshotPid = pid;
+
+    return newInteger(pid);
+}
+
+
+
+/*
+Report on the background snapshot: nil if none was started, -1 while it
+is still being written, otherwise the exit status of the child, which
+is 0 if the image was written and renamed into place.  A finished
+result is returned once.
+*/
+
+static struct object * snapshotPoll(void)
+{
+    int status;
+    int result;
+    pid_t rc;
+
+    if(!snapshotPid) {
+        return nilObject;
+    }
+
+    rc = waitpid(snapshotPid, &status, WNOHANG);
+
+    if(rc == 0) {
+        return newInteger(-1);
+    }
+
+    if(rc < 0) {
+        result = 127;
+    } else if(WIFEXITED(status)) {
+        result = WEXITSTATUS(status);
+    } else {
+        result = 128 + (WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+    }
+
+    snapshotPid = 0;
+
+    return newInteger(result);
+}
+
+
+
+/*
+Method source files hold the text of methods that only keep an offset
+in the image.  The file starts with SOURCE_FILE_MAGIC and each record
+is the length of the text as a native uint32_t followed by the text.
+The offset of a record is its index.  Records are only ever appended,
+so the offsets held by older images stay valid.
+*/
+
+#define SOURCE_FILE_MAGIC "lst$"
+#define SOURCE_FILE_MAGIC_SIZE (4)
+
+static FILE * sourceOpen(struct object * path, const char * mode)
+{
+    char pathBuffer[PATH_MAX];
+
+    if(IS_SMALLINT(path) || !IS_BINOBJ(path) || SIZE(path) == 0 || SIZE(path) >= sizeof(pathBuffer)) {
+        return NULL;
+    }
+
+    getUnixString(pathBuffer, (int)sizeof(pathBuffer), path);
+
+    return fopen(pathBuffer, mode);
+}
+
+
+static int sourceCheckMagic(FILE * fp)
+{
+    char magic[SOURCE_FILE_MAGIC_SIZE];
+
+    return fseek(fp, 0, SEEK_SET) == 0
+           && fread(magic, 1, sizeof(magic), fp) == sizeof(magic)
+           && memcmp(magic, SOURCE_FILE_MAGIC, sizeof(magic)) == 0;
+}
+
+
+
+/*
+Read the text of the record at the given offset into a new String.
+Returns NULL if the file cannot be read or the offset does not point
+at a record.
+*/
+
+static struct object * sourceRead(struct object * path, struct object * offset)
+{
+    struct object * text;
+    struct stat info;
+    uint32_t size;
+    long pos;
+    FILE * fp;
+
+    if(!IS_SMALLINT(offset) || integerValue(offset) < SOURCE_FILE_MAGIC_SIZE) {
+        return NULL;
+    }
+
+    if(!(fp = sourceOpen(path, "rb"))) {
+        return NULL;
+    }
+
+    pos = (long)integerValue(offset);
+
+    if(!sourceCheckMagic(fp)
+       || fstat(fileno(fp), &info) != 0
+       || fseek(fp, pos, SEEK_SET) != 0
+       || fread(&size, sizeof(size), 1, fp) != 1
+       || (off_t)size > info.st_size - pos - (off_t)sizeof(size)) {
+        fclose(fp);
+        return NULL;
+    }
+
+    /* nothing here can move, the path is not used after this. */
+    text = gcialloc((int)size);
+    text->class = StringClass;
+
+    if(fread(bytePtr(text), 1, size, fp) != size) {
+        fclose(fp);
+        return NULL;
+    }
+
+    fclose(fp);
+
+    return text;
+}
+
+
+
+/*
+Append the text of a String as a new record, creating the file if
+needed.  Returns the offset of the record, or NULL if it could not be
+written or the offset does not fit in a SmallInt.
+*/
+
+static struct object * sourceAppend(struct object * path, struct object * text)
+{
+    uint32_t size;
+    long pos;
+    FILE * fp;
+    int ok;
+
+    if(IS_SMALLINT(text) || !IS_BINOBJ(text)) {
+        return NULL;
+    }
+
+    if(!(fp = sourceOpen(path, "ab+"))) {
+        return NULL;
+    }
+
+    if(fseek(fp, 0, SEEK_END) != 0 || (pos = ftell(fp)) < 0) {
+        fclose(fp);
+        return NULL;
+    }
+
+    if(pos == 0) {
+        ok = fwrite(SOURCE_FILE_MAGIC, 1, SOURCE_FILE_MAGIC_SIZE, fp) == SOURCE_FILE_MAGIC_SIZE;
+        pos = SOURCE_FILE_MAGIC_SIZE;
+    } else {
+        /* a read has to be followed by a seek before writing. */
+        ok = sourceCheckMagic(fp) && fseek(fp, 0, SEEK_END) == 0;
+    }
+
+    size = (uint32_t)SIZE(text);
+
+    ok = ok && FITS_SMALLINT(pos)
+         && fwrite(&size, sizeof(size), 1, fp) == 1
+         && fwrite(bytePtr(text), 1, size, fp) == size;
+
+    ok = (fclose(fp) == 0) && ok;
+
+    return ok ? newInteger((int)pos) : NULL;
+}
+
+
+
+/*
+Prefork serving.  Once the server socket is bound, the process that
+loaded the image starts listening and forks the workers, which return
+from the bind primitive and go on to accept on the shared socket with
+the heap shared copy-on-write.  The parent never returns: it waits on
+the workers and forks a new one from its own untouched state when one
+crashes.  A worker that exits cleanly, as after a request to stop the
+server, stops the others and the parent exits with it.
+
+The parent keeps SIGTERM, SIGINT and SIGCHLD blocked and takes them
+with sigwaitinfo(), so a stop request can not slip in between looking
+for one and going to sleep.
+*/
+
+/* the signals the parent waits on, blocked in it from the start */
+static void preforkSignals(sigset_t *set)
+{
+    sigemptyset(set);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGCHLD);
+}
+
+
+/* ask the workers still running to stop. */
+static void preforkStop(pid_t *workers)
+{
+    int i;
+
+    for(i = 0; i < preforkWorkers; i++) {
+        if(workers[i]) {
+            kill(workers[i], SIGTERM);
+        }
+    }
+}
+
+
+/* returns the pid, or 0 in the new worker. */
+static pid_t preforkSpawn(void)
+{
+    pid_t pid;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+
+    if(pid < 0) {
+        error("Unable to fork server worker, errno=%d!", errno);
+    }
+
+    if(pid == 0) {
+        sigset_t set;
+
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        preforkSignals(&set);
+        sigprocmask(SIG_UNBLOCK, &set, NULL);
+
+        /* the epoll set and the ring belong to the supervisor */
+        eventForkChild();
+        isolateForkChild();
+        interpForkChild();
+    }
+
+    return pid;
+}
+
+
+static void preforkStart(int sock)
+{
+    sigset_t set;
+    siginfo_t info;
+    pid_t *workers;
+    time_t *started;
+    int stopping = 0;
+    int live = 0;
+    int status;
+    int i;
+    pid_t pid;
+
+    if(listen(sock, SOMAXCONN) == -1) {
+        error("Error listening on TCP socket.");
+    }
+
+    workers = calloc((size_t)preforkWorkers, sizeof(pid_t));
+    started = calloc((size_t)preforkWorkers, sizeof(time_t));
+    if(!workers || !started) {
+        error("Unable to allocate server worker table!");
+    }
+
+    /* held until sigwaitinfo() takes them, the workers unblock them */
+    preforkSignals(&set);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
+    for(i = 0; i < preforkWorkers; i++) {
+        if(!(pid = preforkSpawn())) {
+            free(workers);
+            free(started);
+            return;
+        }
 
-    for(i=0; i<fsize && j<new_size; i++) {
-        c = from_ptr[i];
+        workers[i] = pid;
+        started[i] = time(NULL);
+        live++;
+    }
+
+    info("Started %d server workers on socket %d.", preforkWorkers, sock);
+
+    while(live > 0) {
+        pid = waitpid(-1, &status, WNOHANG);
+
+        if(pid < 0) {
+            break;
+        }
+
+        /* nothing has ended, sleep until a worker does or a stop request */
+        if(pid == 0) {
+            if(sigwaitinfo(&set, &info) == -1) {
+                continue;
+            }
+
+            if(info.si_signo != SIGCHLD && !stopping) {
+                stopping = 1;
+                preforkStop(workers);
+            }
+
+            continue;
+        }
+
+        for(i = 0; i < preforkWorkers && workers[i] != pid; i++) {
+        }
+
+        if(i == preforkWorkers) {
+            continue;
+        }
+
+        workers[i] = 0;
+        live--;
+
+        if(stopping) {
+            continue;
+        }
+
+        if(WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            info("Server worker %d stopped, stopping the others.", (int)pid);
+            stopping = 1;
+            preforkStop(workers);
+
+            continue;
+        }
+
+        info("Server worker %d died, starting another.", (int)pid);
+
+        /* do not spin if the workers die as soon as they start. */
+        if(time(NULL) - started[i] < 1) {
+            sleep(1);
+        }
+
+        if(!(pid = preforkSpawn())) {
+            free(workers);
+            free(started);
+            return;
+        }
+
+        workers[i] = pid;
+        started[i] = time(NULL);
+        live++;
+    }
+
+    close(sock);
+    exit(0);
+}
+
+
+
+/*
+Asynchronous I/O.  Primitive 120 starts a request and answers its id, or
+fails if it can not run asynchronously, in which case the caller does
+the I/O the usual way.  The Semaphore passed in is signaled when the
+request completes and primitive 121 then answers its result: the count
+read into the buffer for files, a ByteArray for sockets, the count
+written, the accepted socket, true for a close, the file opened or the
+edited string.  It answers nil if the socket was not ready after all and
+fails if the I/O did.
+
+Opening files and editing block whatever the kernel has, so they always
+run on the thread pool, with copies of their arguments.
+*/
+
+#define AsyncFileRead 0
+#define AsyncSocketRead 1
+#define AsyncSocketWrite 2
+#define AsyncAccept 3
+#define AsyncClose 4
+#define AsyncFileOpen 5
+#define AsyncFileWrite 6
+#define AsyncEdit 7
+
+/* the stream and descriptor of a file or socket argument */
+static int asyncTarget(int op, struct object * target, FILE ** fp)
+{
+    int i;
+
+    if(!IS_SMALLINT(target)) {
+        return -1;
+    }
+
+    i = integerValue(target);
+
+    if((op != AsyncFileRead) && (op != AsyncFileWrite)) {
+        return i;
+    }
+
+    if((i < 0) || (i >= FILEMAX) || !(*fp = filePointers[i])) {
+        return -1;
+    }
+
+    return fileno(*fp);
+}
+
+
+/* the open(2) flags for an fopen() mode, or -1 */
+static int openFlags(const char * mode)
+{
+    int flags;
+
+    switch(mode[0]) {
+    case 'r':
+        flags = O_RDONLY;
+        break;
+    case 'w':
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+        break;
+    case 'a':
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+        break;
+    default:
+        return -1;
+    }
+
+    if(strchr(mode, '+')) {
+        flags = (flags & ~(O_RDONLY | O_WRONLY)) | O_RDWR;
+    }
+
+    return flags;
+}
+
+
+/* pool work opening a file, the buffer holds the path and mode */
+static int openWork(uint8_t ** buffer, size_t size)
+{
+    const char * path = (const char *)*buffer;
+    int flags, fd;
+
+    (void)size;
+
+    if((flags = openFlags(path + strlen(path) + 1)) == -1) {
+        return -EINVAL;
+    }
+
+    if((fd = open(path, flags, 0666)) == -1) {
+        return -errno;
+    }
+
+    return fd;
+}
+
+
+/*
+ * run vi on a file and wait for it.  A pool thread blocks every signal,
+ * so the child lets them through again before it runs the editor.
+ */
+static int editRun(const char * path)
+{
+    sigset_t none;
+    pid_t pid;
+    int status;
+
+    if((pid = fork()) == -1) {
+        return -errno;
+    }
+
+    if(pid == 0) {
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        execlp("vi", "vi", path, (char *)NULL);
+        _exit(127);
+    }
+
+    while(waitpid(pid, &status, 0) == -1) {
+        if(errno != EINTR) {
+            return -errno;
+        }
+    }
+
+    return 0;
+}
+
+
+/* pool work editing the text in the buffer, answers the new size */
+static int editWork(uint8_t ** buffer, size_t size)
+{
+    char tmpFileName[PATH_MAX];
+    uint8_t * text;
+    FILE * fp;
+    long j;
+    int fd;
+
+    snprintf(tmpFileName, sizeof(tmpFileName), "%s/lsteditXXXXXX", tmpdir);
+
+    /* copy string to file */
+    if((fd = mkstemp(tmpFileName)) == -1) {
+        return -errno;
+    }
+
+    if(!(fp = fdopen(fd, "w"))) {
+        close(fd);
+        unlink(tmpFileName);
+        return -errno;
+    }
+
+    if(size > 0) {
+        fwrite(*buffer, 1, size, fp);
+    }
+    fputc('\n', fp);
+    fclose(fp);
+
+    /* call the editor */
+    if((j = editRun(tmpFileName)) < 0) {
+        unlink(tmpFileName);
+        return (int)j;
+    }
+
+    /* copy back to new string */
+    if(!(fp = fopen(tmpFileName, "r"))) {
+        unlink(tmpFileName);
+        return -errno;
+    }
+
+    /* get length of file */
+    fseek(fp, 0, SEEK_END);
+    j = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if(!(text = malloc((size_t)j + 1))) {
+        fclose(fp);
+        unlink(tmpFileName);
+        return -ENOMEM;
+    }
+    j = (long)fread(text, 1, (size_t)j, fp);
+
+    /* now clean up files */
+    fclose(fp);
+    unlink(tmpFileName);
+
+    free(*buffer);
+    *buffer = text;
+
+    return (int)j;
+}
+
+
+static struct object * asyncStart(struct object * args)
+{
+    struct object * sem = args->data[4];
+    FILE * fp = NULL;
+    int op, fd = -1, id = -1, offset, pathSize, modeSize;
+    off_t position;
+    char * spec;
+
+    if(!IS_SMALLINT(args->data[0]) || IS_SMALLINT(sem) || (SIZE(sem) < semaphoreSize)) {
+        return NULL;
+    }
+
+    op = integerValue(args->data[0]);
+    if((op != AsyncFileOpen) && (op != AsyncEdit) && ((fd = asyncTarget(op, args->data[1], &fp)) < 0)) {
+        return NULL;
+    }
+
+    switch(op) {
+    case AsyncFileRead: /* arg: count */
+        /* pipes and terminals are read the usual way */
+        if(!IS_SMALLINT(args->data[2]) || (integerValue(args->data[2]) <= 0) || ((position = ftello(fp)) < 0)) {
+            return NULL;
+        }
+
+        /* anything the stream has buffered is ahead of the descriptor */
+        fflush(fp);
+        id = ioSubmit(IoRead, fd, NULL, (size_t)integerValue(args->data[2]), position, sem);
+        break;
+
+    case AsyncSocketRead:
+        id = ioSubmit(IoRead, fd, NULL, SOCK_BUF_SIZE, -1, sem);
+        break;
+
+    case AsyncSocketWrite: /* args: data, offset */
+        if(IS_SMALLINT(args->data[2]) || !IS_BINOBJ(args->data[2]) || !IS_SMALLINT(args->data[3])) {
+            return NULL;
+        }
+        offset = integerValue(args->data[3]);
+        if((offset < 0) || (offset >= (int)SIZE(args->data[2]))) {
+            return NULL;
+        }
+        id = ioSubmit(IoSend, fd, bytePtr(args->data[2]) + offset, SIZE(args->data[2]) - offset, -1, sem);
+        break;
+
+    case AsyncAccept:
+        if(listen(fd, SOMAXCONN) == -1) {
+            return NULL;
+        }
+        id = ioSubmit(IoAccept, fd, NULL, 0, 0, sem);
+        break;
+
+    case AsyncClose:
+        eventForget(fd);
+        id = ioSubmit(IoClose, fd, NULL, 0, 0, sem);
+        break;
+
+    case AsyncFileOpen: /* target: path, arg: mode */
+        if(IS_SMALLINT(args->data[1]) || !IS_BINOBJ(args->data[1]) ||
+                IS_SMALLINT(args->data[2]) || !IS_BINOBJ(args->data[2])) {
+            return NULL;
+        }
+        pathSize = SIZE(args->data[1]) + 1;
+        modeSize = SIZE(args->data[2]) + 1;
+        spec = (char *)alloca((size_t)(pathSize + modeSize));
+        getUnixString(spec, pathSize, args->data[1]);
+        getUnixString(spec + pathSize, modeSize, args->data[2]);
+        if(openFlags(spec + pathSize) == -1) {
+            return NULL;
+        }
+        id = ioSubmitWork(openWork, spec, (size_t)(pathSize + modeSize), sem);
+        break;
+
+    case AsyncFileWrite: /* args: data, count */
+        if(IS_SMALLINT(args->data[2]) || !IS_BINOBJ(args->data[2]) || !IS_SMALLINT(args->data[3])) {
+            return NULL;
+        }
+        offset = integerValue(args->data[3]);
+        if((offset <= 0) || (offset > (int)SIZE(args->data[2])) || ((position = ftello(fp)) < 0)) {
+            return NULL;
+        }
+
+        /* what the stream has buffered goes first */
+        fflush(fp);
+        id = ioSubmit(IoWrite, fd, bytePtr(args->data[2]), (size_t)offset, position, sem);
+        break;
+
+    case AsyncEdit: /* target: string */
+        if(IS_SMALLINT(args->data[1]) || !IS_BINOBJ(args->data[1])) {
+            return NULL;
+        }
+        id = ioSubmitWork(editWork, bytePtr(args->data[1]), SIZE(args->data[1]), sem);
+        break;
+    }
+
+    if(id < 0) {
+        return NULL;
+    }
+
+    return newInteger(id);
+}
+
+
+static struct object * asyncFinish(struct object * args)
+{
+    struct object * returnedValue = NULL;
+    struct object * buf = args->data[3];
+    FILE * fp = NULL;
+    uint8_t * buffer;
+    int id, op, result, i, modeSize;
+    char * mode;
+
+    if(!IS_SMALLINT(args->data[0]) || !IS_SMALLINT(args->data[1])) {
+        return NULL;
+    }
 
-        /* first convert plusses to spaces */
-        if(c == '+')
-            c = ' ';
+    id = integerValue(args->data[0]);
+    op = integerValue(args->data[1]);
+    if(!ioResult(id, &result, &buffer)) {
+        return NULL;
+    }
 
-        /* is this a hex string starting? */
-        if('%' == c)
-            is_hex = 3;
+    if(result == -EAGAIN) {
+        ioRelease(id);
+        return nilObject;
+    }
 
-        switch(is_hex) {
-        case 3:
-            /* this is the % character, ignore it */
-            is_hex--;
+    if(result < 0) {
+        info("asynchronous I/O failed, errno=%d", -result);
+        ioRelease(id);
+        return NULL;
+    }
 
+    switch(op) {
+    case AsyncFileRead:
+        if((asyncTarget(op, args->data[2], &fp) < 0) || IS_SMALLINT(buf) || !IS_BINOBJ(buf) || ((int)SIZE(buf) < result)) {
             break;
+        }
+        WRITE_BARRIER(buf);
+        memcpy(bytePtr(buf), buffer, result);
+
+        /* the stream reads on after what was read here */
+        fseeko(fp, ftello(fp) + result, SEEK_SET);
+        returnedValue = newInteger(result);
+        break;
 
-        case 2:
-            /* this is the first hex char, convert it */
-            is_hex--;
+    case AsyncSocketRead:
+        returnedValue = gcialloc(result);
+        returnedValue->class = ByteArrayClass;
+        memcpy(bytePtr(returnedValue), buffer, result);
+        break;
 
-            hex_val = (int)(strchr(hexDigits,toupper(c)) - hexDigits);
+    case AsyncSocketWrite:
+    case AsyncAccept:
+        returnedValue = newInteger(result);
+        break;
 
-            if(hex_val>=0)
-                to_ptr[j] = (char)(hex_val<<4);
-            else
-                /* this is an error! */
-                return nilObject;
+    case AsyncClose:
+        returnedValue = trueObject;
+        break;
+
+    case AsyncFileOpen: /* buffer: mode */
+        if(IS_SMALLINT(buf) || !IS_BINOBJ(buf)) {
+            close(result);
+            break;
+        }
+        modeSize = SIZE(buf) + 1;
+        mode = (char *)alloca((size_t)modeSize);
+        getUnixString(mode, modeSize, buf);
+
+        for(i = 0; (i < FILEMAX) && filePointers[i]; i++)
+            ;
+        if(i >= FILEMAX) {
+            error("too many open files");
+        }
+        if(!(filePointers[i] = fdopen(result, mode))) {
+            close(result);
+            break;
+        }
+        returnedValue = newInteger(i);
+        break;
 
+    case AsyncFileWrite:
+        if(asyncTarget(op, args->data[2], &fp) < 0) {
             break;
+        }
+
+        /* the stream writes on after what was written here */
+        fseeko(fp, ftello(fp) + result, SEEK_SET);
+        returnedValue = newInteger(result);
+        break;
+
+    case AsyncEdit: /* target: the string edited */
+        returnedValue = gcialloc(result);
+        returnedValue->class = args->data[2]->class;
+        memcpy(bytePtr(returnedValue), buffer, result);
+        break;
+    }
+
+    ioRelease(id);
+
+    return returnedValue;
+}
+
+
+
+/*
+Isolates.  Primitive 122 starts an isolate running the source string it
+is given, answers the id of the current isolate, sends a copy of an
+object to an isolate, answers how many messages are waiting, takes the
+next one, has a Semaphore signaled when one comes in or answers whether
+an isolate is still running.
+*/
+
+#define IsolateSpawn 0
+#define IsolateCurrent 1
+#define IsolateSend 2
+#define IsolatePending 3
+#define IsolateTake 4
+#define IsolateWait 5
+#define IsolateRunning 6
+
+static struct object * isolatePrimitive(struct object * args)
+{
+    struct object * result;
+    uint8_t * message;
+    size_t size;
+    int id;
+
+    if(!IS_SMALLINT(args->data[0])) {
+        return NULL;
+    }
+
+    switch(integerValue(args->data[0])) {
+    case IsolateSpawn: /* arg: source */
+        if((SIZE(args) < 2) || IS_SMALLINT(args->data[1]) || !IS_BINOBJ(args->data[1]) ||
+                !(message = messageWrite(args->data[1], &size)) || ((id = isolateSpawn(message, size)) < 0)) {
+            return NULL;
+        }
+        return newInteger(id);
+
+    case IsolateCurrent:
+        return ((id = isolateCurrent()) < 0) ? NULL : newInteger(id);
+
+    case IsolateSend: /* args: id, object */
+        if((SIZE(args) < 3) || !IS_SMALLINT(args->data[1]) || !(message = messageWrite(args->data[2], &size)) ||
+                (isolateSend(integerValue(args->data[1]), message, size) < 0)) {
+            return NULL;
+        }
+        return trueObject;
+
+    case IsolatePending:
+        return newInteger(isolatePending());
+
+    case IsolateTake:
+        if(!(message = isolateTake(&size))) {
+            return NULL;
+        }
+        result = messageRead(message, size);
+        free(message);
+        return result;
+
+    case IsolateWait: /* arg: semaphore */
+        if((SIZE(args) < 2) || IS_SMALLINT(args->data[1]) || (SIZE(args->data[1]) < semaphoreSize) ||
+                (eventWaitFor(isolateMailbox(), EventRead, args->data[1]) < 0)) {
+            return NULL;
+        }
+        return trueObject;
+
+    case IsolateRunning: /* arg: id */
+        if((SIZE(args) < 2) || !IS_SMALLINT(args->data[1])) {
+            return NULL;
+        }
+        return isolateRunning(integerValue(args->data[1])) ? trueObject : falseObject;
+    }
+
+    return NULL;
+}
+
+
+
+/*
+Timers.  Primitive 123 has a Semaphore signaled after a number of
+milliseconds, answering the timer, stops a timer, answering whether it
+had not fired yet, or answers whether a timer is still running.  Stopping
+a timer also stops whatever else was to signal its Semaphore, so nothing
+is left waiting once a wait with a timeout is over.
+*/
+
+#define TimerStart 0
+#define TimerStop 1
+#define TimerPending 2
+
+static struct object * timerPrimitive(struct object * args)
+{
+    int id, pending;
+
+    if(!IS_SMALLINT(args->data[0])) {
+        return NULL;
+    }
+
+    switch(integerValue(args->data[0])) {
+    case TimerStart: /* args: milliseconds, semaphore */
+        if((SIZE(args) < 3) || !IS_SMALLINT(args->data[1]) || IS_SMALLINT(args->data[2]) ||
+                (SIZE(args->data[2]) < semaphoreSize) || ((id = timerStart(integerValue(args->data[1]), args->data[2])) < 0)) {
+            return NULL;
+        }
+        return newInteger(id);
+
+    case TimerStop: /* args: timer, semaphore */
+        if((SIZE(args) < 3) || !IS_SMALLINT(args->data[1]) || IS_SMALLINT(args->data[2]) ||
+                (SIZE(args->data[2]) < semaphoreSize)) {
+            return NULL;
+        }
+        pending = timerCancel(integerValue(args->data[1]));
+        eventAbandon(args->data[2]);
+        return pending ? trueObject : falseObject;
+
+    case TimerPending: /* arg: timer */
+        if((SIZE(args) < 2) || !IS_SMALLINT(args->data[1])) {
+            return NULL;
+        }
+        return timerPending(integerValue(args->data[1])) ? trueObject : falseObject;
+    }
+
+    return NULL;
+}
 
-        case 1:
-            /* this is the last hex char, convert it, note
-            that we increment j here. */
-            is_hex--;
 
-            hex_val = (int)(strchr(hexDigits,toupper(c)) - hexDigits);
 
-            if(hex_val >= 0 ) {
-                to_ptr[j] = (char)((int)to_ptr[j] + hex_val);
+/*
+Process usage.  Primitive 124 answers what a Process has used so far, an
+Array of the bytecodes it ran, the bytes it allocated and the
+microseconds it ran for, or sets quotas on how much more of each it may
+use, in bytecodes, bytes and milliseconds, nil or 0 for none.  A Process
+over a quota stops with an error at the end of its time slice.
+*/
+
+#define UsageRead 0
+#define UsageQuota 1
+
+static struct object * usagePrimitive(struct object * args)
+{
+    int64_t counts[3];
+    struct object *result, *value;
+    int i;
+
+    if((SIZE(args) < 2) || !IS_SMALLINT(args->data[0]) || IS_SMALLINT(args->data[1]) ||
+            IS_BINOBJ(args->data[1]) || (SIZE(args->data[1]) <= usageInProcess)) {
+        return NULL;
+    }
+
+    switch(integerValue(args->data[0])) {
+    case UsageRead: /* arg: process */
+        processUsage(args->data[1], &counts[0], &counts[1], &counts[2]);
+
+        result = gcalloc(3);
+        result->class = ArrayClass;
+        for(i = 0; i < 3; i++) {
+            result->data[i] = nilObject;
+        }
+
+        /* large counts are Integers, which can move the Array */
+        PUSH_ROOT(result);
+        for(i = 0; i < 3; i++) {
+            value = FITS_SMALLINT(counts[i]) ? newInteger(counts[i]) : newLInteger(counts[i]);
+            PEEK_ROOT()->data[i] = value;
+        }
+        return POP_ROOT();
+
+    case UsageQuota: /* args: process, bytecodes, bytes, milliseconds */
+        if(SIZE(args) < 5) {
+            return NULL;
+        }
+        for(i = 0; i < 3; i++) {
+            value = args->data[i + 2];
+            if(value == nilObject) {
+                counts[i] = 0;
+            } else if(IS_SMALLINT(value)) {
+                counts[i] = integerValue(value);
             } else {
-                /* this is an error! */
-                return nilObject;
+                return NULL;
             }
+        }
+        return processQuota(args->data[1], counts[0], counts[1], counts[2] * 1000);
+    }
 
-            j++;
+    return NULL;
+}
 
-            break;
 
-        default:
-            /* other characters */
-            to_ptr[j++] = c;
-            break;
+
+/*
+Regions.  Primitive 125 opens a region, answering how many are open
+with it, or closes one, answering the bytes that were freed, which are
+only freed with the last one that is open.  Closing moves what is kept,
+so the answer is never an object of the region.
+*/
+
+#define RegionOpen 0
+#define RegionClose 1
+
+static struct object * regionPrimitive(struct object * args)
+{
+    int64_t freed;
+
+    if((SIZE(args) < 1) || !IS_SMALLINT(args->data[0])) {
+        return NULL;
+    }
+
+    switch(integerValue(args->data[0])) {
+    case RegionOpen:
+        return newInteger(regionOpen());
+
+    case RegionClose:
+        if((freed = regionClose()) < 0) {
+            return NULL;
         }
+        return FITS_SMALLINT(freed) ? newInteger(freed) : newLInteger(freed);
     }
 
-    return (struct object *)newStr;
+    return NULL;
 }
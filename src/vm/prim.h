@@ -5,7 +5,16 @@
 
 extern char *tmpdir;
 
+/* server workers to fork once the server socket is bound */
+extern int preforkWorkers;
+
 extern struct object *primitive(int primitiveNumber, struct object *args, int *failed);
 extern struct object *newLInteger(int64_t val);
 extern struct object *do_Integer(int op, struct object *low, struct object *high);
 
+/* the Node of a Tree whose String or Symbol equals key, nilObject or NULL */
+extern struct object *treeFind(struct object *node, struct object *key);
+
+/* closes the files of a VM that is going away */
+extern void primRelease(void);
+
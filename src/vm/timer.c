@@ -0,0 +1,333 @@
+/*
+ * timer.c
+ *	A hierarchical timing wheel for timers in milliseconds
+ *
+ * The wheel has four levels of 64 slots.  A timer goes into the first
+ * level if it is due within 64 ms, into the second if it is due within
+ * 64 * 64 ms and so on, in the slot for its due time at that level.
+ * The wheel advances one millisecond at a time; each time the first
+ * level comes round, the next slot of the level above is emptied into
+ * the levels below, as its timers are now close enough for them.
+ * Starting and stopping a timer take constant time, and a timer is
+ * moved at most once per level before it fires.
+ *
+ * Timers further off than the top level can hold wait in its last slot
+ * and are put back each time it is emptied until they are close enough.
+ *
+ * The Semaphores of the timers are a GC root vector, like the ones of
+ * the event loop.  Ids hold the slot of a timer and how often the slot
+ * has been used, so a stale id never stops another timer.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include "err.h"
+#include "globals.h"
+#include "interp.h"
+#include "event.h"
+#include "timer.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+/* how far off the top level reaches */
+#define WHEEL_SPAN ((int64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+/* ids are slot + TIMER_SLOTS_MAX * uses and have to be SmallInts */
+#define TIMER_SLOTS_MAX 0x10000
+#define TIMER_USES_MASK 0x3fff
+
+struct timer {
+    int64_t expires;
+    int next;
+    int prev;
+    int bucket;                 /* the wheel slot it is in, -1 when free */
+    int uses;
+};
+
+static VM_LOCAL struct timer *timers = NULL;
+static VM_LOCAL struct object **timerSemaphores = NULL;
+static VM_LOCAL int timerSlots = 0;
+static VM_LOCAL int timerFree = -1;
+static VM_LOCAL int timersRunning = 0;
+
+/* the first timer in each slot of each level, -1 if none */
+static VM_LOCAL int wheel[WHEEL_LEVELS * WHEEL_SIZE];
+
+/* the time the wheel has advanced to */
+static VM_LOCAL int64_t wheelTime = 0;
+
+
+static int64_t timeNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static int timerGrow(void)
+{
+    int slots = timerSlots ? timerSlots * 2 : 64;
+    struct object **sems;
+    struct timer *table;
+    int i;
+
+    if (slots > TIMER_SLOTS_MAX) {
+        return -1;
+    }
+
+    table = realloc(timers, slots * sizeof(struct timer));
+    if (!table) {
+        return -1;
+    }
+    timers = table;
+
+    sems = realloc(timerSemaphores, slots * sizeof(struct object *));
+    if (!sems) {
+        return -1;
+    }
+    timerSemaphores = sems;
+
+    /* the new slots go on the free list in order */
+    for (i = slots - 1; i >= timerSlots; i--) {
+        timers[i].bucket = -1;
+        timers[i].uses = 0;
+        timers[i].next = timerFree;
+        timerFree = i;
+        timerSemaphores[i] = nilObject;
+    }
+
+    if (!timerSlots) {
+        for (i = 0; i < WHEEL_LEVELS * WHEEL_SIZE; i++) {
+            wheel[i] = -1;
+        }
+        addRootVector(&timerSemaphores, &timerSlots);
+    }
+    timerSlots = slots;
+
+    return 0;
+}
+
+
+/* put a timer in the slot for its due time at the lowest level it fits. */
+static void timerLink(int i)
+{
+    struct timer *t = &timers[i];
+    int64_t expires = t->expires;
+    int level = 0, bucket;
+
+    /* overdue timers fire on the next tick, far off ones wait at the top */
+    if (expires <= wheelTime) {
+        expires = wheelTime + 1;
+    } else if (expires - wheelTime >= WHEEL_SPAN) {
+        expires = wheelTime + WHEEL_SPAN - 1;
+    }
+
+    while (level < WHEEL_LEVELS - 1 && expires - wheelTime >= ((int64_t)1 << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    bucket = level * WHEEL_SIZE + (int)((expires >> (WHEEL_BITS * level)) & WHEEL_MASK);
+
+    t->bucket = bucket;
+    t->prev = -1;
+    t->next = wheel[bucket];
+    if (t->next != -1) {
+        timers[t->next].prev = i;
+    }
+    wheel[bucket] = i;
+}
+
+
+static void timerUnlink(int i)
+{
+    struct timer *t = &timers[i];
+
+    if (t->prev != -1) {
+        timers[t->prev].next = t->next;
+    } else {
+        wheel[t->bucket] = t->next;
+    }
+    if (t->next != -1) {
+        timers[t->next].prev = t->prev;
+    }
+    t->bucket = -1;
+}
+
+
+/* give a slot back, its id is not valid any more. */
+static void timerFreeSlot(int i)
+{
+    timerSemaphores[i] = nilObject;
+    timers[i].uses++;
+    timers[i].next = timerFree;
+    timerFree = i;
+    timersRunning--;
+}
+
+
+/* the slot of a timer that has not fired, or -1. */
+static int timerFind(int id)
+{
+    int i = id % TIMER_SLOTS_MAX;
+
+    if (id < 0 || i >= timerSlots || timers[i].bucket == -1 ||
+            (timers[i].uses & TIMER_USES_MASK) != id / TIMER_SLOTS_MAX) {
+        return -1;
+    }
+
+    return i;
+}
+
+
+int timerStart(int64_t ms, struct object *sem)
+{
+    int i;
+
+    if (timerFree == -1 && timerGrow() == -1) {
+        return -1;
+    }
+
+    /* an empty wheel has nothing to catch up on */
+    if (!timersRunning) {
+        wheelTime = timeNow();
+    }
+
+    i = timerFree;
+    timerFree = timers[i].next;
+    timersRunning++;
+
+    timers[i].expires = timeNow() + (ms > 0 ? ms : 0);
+    timerSemaphores[i] = sem;
+    timerLink(i);
+
+    return i + TIMER_SLOTS_MAX * (timers[i].uses & TIMER_USES_MASK);
+}
+
+
+int timerCancel(int id)
+{
+    int i = timerFind(id);
+
+    if (i == -1) {
+        return 0;
+    }
+
+    timerUnlink(i);
+    timerFreeSlot(i);
+
+    return 1;
+}
+
+
+int timerPending(int id)
+{
+    return timerFind(id) != -1;
+}
+
+
+int timerCount(void)
+{
+    return timersRunning;
+}
+
+
+int timerNext(void)
+{
+    int64_t next = -1, block, now;
+    int level, k;
+
+    if (!timersRunning) {
+        return -1;
+    }
+
+    /*
+     * The first level tells when its timers fire, the others only when
+     * their slots are emptied, which is no later than their timers fire.
+     */
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        block = wheelTime >> (WHEEL_BITS * level);
+
+        for (k = 1; k <= WHEEL_SIZE; k++) {
+            if (wheel[level * WHEEL_SIZE + (int)((block + k) & WHEEL_MASK)] != -1) {
+                if (next == -1 || ((block + k) << (WHEEL_BITS * level)) < next) {
+                    next = (block + k) << (WHEEL_BITS * level);
+                }
+                break;
+            }
+        }
+    }
+
+    now = timeNow();
+
+    return (next <= now) ? 0 : (int)(next - now);
+}
+
+
+/* move the timers of a slot to the levels below, answers the slot index. */
+static int timerCascade(int level)
+{
+    int index = (int)((wheelTime >> (WHEEL_BITS * level)) & WHEEL_MASK);
+    int bucket = level * WHEEL_SIZE + index;
+    int i, next;
+
+    for (i = wheel[bucket], wheel[bucket] = -1; i != -1; i = next) {
+        next = timers[i].next;
+        timerLink(i);
+    }
+
+    return index;
+}
+
+
+int timerExpire(void)
+{
+    struct object *sem;
+    int64_t now = timeNow();
+    int bucket, level, i, signaled = 0;
+
+    while (timersRunning && wheelTime < now) {
+        wheelTime++;
+
+        if ((wheelTime & WHEEL_MASK) == 0) {
+            for (level = 1; level < WHEEL_LEVELS && timerCascade(level) == 0; level++)
+                ;
+        }
+
+        bucket = (int)(wheelTime & WHEEL_MASK);
+
+        while ((i = wheel[bucket]) != -1) {
+            sem = timerSemaphores[i];
+            timerUnlink(i);
+            timerFreeSlot(i);
+
+            /* the timer is first, nothing else is to signal it later */
+            eventAbandon(sem);
+            signalSemaphore(sem);
+            signaled++;
+        }
+    }
+
+    if (!timersRunning) {
+        wheelTime = now;
+    }
+
+    return signaled;
+}
+
+
+void timerRelease(void)
+{
+    free(timers);
+    timers = NULL;
+    free(timerSemaphores);
+    timerSemaphores = NULL;
+    timerSlots = 0;
+    timerFree = -1;
+    timersRunning = 0;
+}
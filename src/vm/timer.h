@@ -0,0 +1,33 @@
+
+#pragma once
+
+#include <stdint.h>
+#include "memory.h"
+
+/*
+ * Timers signal a Semaphore once their time is up.  They are kept in a
+ * hierarchical timing wheel that the event loop advances when it polls,
+ * and the time to the next one bounds how long it sleeps.  A timer that
+ * fires first stops whatever else its Semaphore was given to, see
+ * eventAbandon(), so a wait with a timeout needs no polling.
+ */
+
+/* returns a timer id, or -1 */
+extern int timerStart(int64_t ms, struct object *sem);
+
+/* returns 1 if the timer was stopped before it fired, 0 if it had fired */
+extern int timerCancel(int id);
+
+extern int timerPending(int id);
+
+/* the number of timers that have not fired */
+extern int timerCount(void);
+
+/* ms until the wheel next has something to do, -1 if there are no timers */
+extern int timerNext(void);
+
+/* fires the timers that are due and returns the number signaled */
+extern int timerExpire(void);
+
+/* frees the timers, when an isolate ends */
+extern void timerRelease(void);
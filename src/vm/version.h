@@ -0,0 +1,13 @@
+#pragma once
+
+/*
+ * Common defines for version information.
+ */
+
+
+#define VERSION_STRING "4.7.2"
+#define VERSION_MAJOR (4)
+#define VERSION_MINOR (7)
+#define VERSION_PATCH (2)
+
+